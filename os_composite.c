@@ -18,6 +18,8 @@
 
 /* sqlite_io function prototypes */
 static int _cClose(sqlite3_file* baseFile) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -32,10 +34,13 @@ static int _cClose(sqlite3_file* baseFile) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(CLOSE, CPROBE_FILE(baseFile), 0, 0, res);
     return res;
 }
 
 static int _cRead(sqlite3_file* baseFile, void* buf, int iAmt, sqlite3_int64 iOfst) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -50,10 +55,13 @@ static int _cRead(sqlite3_file* baseFile, void* buf, int iAmt, sqlite3_int64 iOf
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(READ, CPROBE_FILE(baseFile), iOfst, iAmt, res);
     return res;
 }
 
 static int _cWrite(sqlite3_file* baseFile, const void* buf, int iAmt, sqlite3_int64 iOfst) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -68,10 +76,13 @@ static int _cWrite(sqlite3_file* baseFile, const void* buf, int iAmt, sqlite3_in
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(WRITE, CPROBE_FILE(baseFile), iOfst, iAmt, res);
     return res;
 }
 
 static int _cTruncate(sqlite3_file* baseFile, sqlite3_int64 size) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -86,10 +97,13 @@ static int _cTruncate(sqlite3_file* baseFile, sqlite3_int64 size) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(TRUNCATE, CPROBE_FILE(baseFile), size, 0, res);
     return res;
 }
 
 static int _cSync(sqlite3_file* baseFile, int flags) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(160);
@@ -108,10 +122,13 @@ static int _cSync(sqlite3_file* baseFile, int flags) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(SYNC, CPROBE_FILE(baseFile), 0, flags, res);
     return res;
 }
 
 static int _cFileSize(sqlite3_file* baseFile, sqlite3_int64 *pSize) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -127,10 +144,13 @@ static int _cFileSize(sqlite3_file* baseFile, sqlite3_int64 *pSize) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(FILESIZE, CPROBE_FILE(baseFile), (res == SQLITE_OK) ? *pSize : 0, 0, res);
     return res;
 }
 
 static int _cLock(sqlite3_file* baseFile, int lockType) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -150,10 +170,13 @@ static int _cLock(sqlite3_file* baseFile, int lockType) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(LOCK, CPROBE_FILE(baseFile), 0, lockType, res);
     return res;
 }
 
 static int _cUnlock(sqlite3_file* baseFile, int lockType) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -174,10 +197,13 @@ static int _cUnlock(sqlite3_file* baseFile, int lockType) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(UNLOCK, CPROBE_FILE(baseFile), 0, lockType, res);
     return res;
 }
 
 static int _cCheckReservedLock(sqlite3_file* baseFile, int *pResOut) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -193,10 +219,13 @@ static int _cCheckReservedLock(sqlite3_file* baseFile, int *pResOut) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(CHECKRESERVEDLOCK, CPROBE_FILE(baseFile), 0, *pResOut, res);
     return res;
 }
 
 static int _cFileControl(sqlite3_file* baseFile, int op, void *pArg) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -204,6 +233,7 @@ static int _cFileControl(sqlite3_file* baseFile, int op, void *pArg) {
 
         switch(op) {
             case SQLITE_FCNTL_SIZE_HINT: CTRACE_APPEND("SQLITE_FCNTL_SIZE_HINT"); break;
+            case SQLITE_FCNTL_MMAP_SIZE: CTRACE_APPEND("SQLITE_FCNTL_MMAP_SIZE"); break;
             default: CTRACE_APPEND("Unknown(%d)", op); break;
         }
 
@@ -218,10 +248,13 @@ static int _cFileControl(sqlite3_file* baseFile, int op, void *pArg) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(FILECONTROL, CPROBE_FILE(baseFile), 0, op, res);
     return res;
 }
 
 static int _cSectorSize(sqlite3_file* baseFile) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -235,10 +268,13 @@ static int _cSectorSize(sqlite3_file* baseFile) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(SECTORSIZE, CPROBE_FILE(baseFile), 0, sectorSize, 0);
     return sectorSize;
 }
 
 static int _cDeviceCharacteristics(sqlite3_file* baseFile) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(160);
@@ -266,10 +302,13 @@ static int _cDeviceCharacteristics(sqlite3_file* baseFile) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(DEVICECHARACTERISTICS, CPROBE_FILE(baseFile), 0, flags, 0);
     return flags;
 }
 
 static int _cShmMap(sqlite3_file* baseFile, int iPg, int pgsz, int i, void volatile** v) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -284,10 +323,13 @@ static int _cShmMap(sqlite3_file* baseFile, int iPg, int pgsz, int i, void volat
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(SHMMAP, CPROBE_FILE(baseFile), iPg, pgsz, res);
     return res;
 }
 
 static int _cShmLock(sqlite3_file* baseFile, int offset, int n, int flags) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(160);
@@ -310,10 +352,13 @@ static int _cShmLock(sqlite3_file* baseFile, int offset, int n, int flags) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(SHMLOCK, CPROBE_FILE(baseFile), offset, n, res);
     return res;
 }
 
 static void _cShmBarrier(sqlite3_file* baseFile) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -325,9 +370,13 @@ static void _cShmBarrier(sqlite3_file* baseFile) {
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_PRINT();
     #endif
+
+    CPROBE_END(SHMBARRIER, CPROBE_FILE(baseFile), 0, 0, 0);
 }
 
 static int _cShmUnmap(sqlite3_file* baseFile, int deleteFlag) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -342,10 +391,13 @@ static int _cShmUnmap(sqlite3_file* baseFile, int deleteFlag) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(SHMUNMAP, CPROBE_FILE(baseFile), 0, deleteFlag, res);
     return res;
 }
 
 static int _cFetch(sqlite3_file* baseFile, sqlite3_int64 iOfst, int iAmt, void **pp) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -360,10 +412,13 @@ static int _cFetch(sqlite3_file* baseFile, sqlite3_int64 iOfst, int iAmt, void *
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(FETCH, CPROBE_FILE(baseFile), iOfst, iAmt, res);
     return res;
 }
 
 static int _cUnfetch(sqlite3_file* baseFile, sqlite3_int64 iOfst, void *p) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         struct cFile* file = (struct cFile*)baseFile;
         CTRACE_STRING_DEF(80);
@@ -378,11 +433,14 @@ static int _cUnfetch(sqlite3_file* baseFile, sqlite3_int64 iOfst, void *p) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(UNFETCH, CPROBE_FILE(baseFile), iOfst, 0, res);
     return res;
 }
 
 /* sqlite_vfs function prototypes */
 static int _cOpen(sqlite3_vfs* vfs, const char *zName, sqlite3_file* baseFile, int flags, int *pOutFlags) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(320);
         CTRACE_APPEND("cOpen(vfs = <ptr>, zName = '%s', file = <not initialized>, flags = [", zName);
@@ -434,10 +492,13 @@ static int _cOpen(sqlite3_vfs* vfs, const char *zName, sqlite3_file* baseFile, i
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(OPEN, (res == SQLITE_OK) ? CPROBE_FILE(baseFile) : 0, 0, flags, res);
     return res;
 }
 
 static int _cDelete(sqlite3_vfs* vfs, const char *zName, int syncDir) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(160);
         CTRACE_APPEND("cDelete(vfs = <ptr>, zName = %s, syncDir = %d)", zName, syncDir);
@@ -451,10 +512,13 @@ static int _cDelete(sqlite3_vfs* vfs, const char *zName, int syncDir) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(DELETE, 0, 0, 0, res);
     return res;
 }
 
 static int _cAccess(sqlite3_vfs* vfs, const char *zName, int flags, int *pResOut) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(160);
         CTRACE_APPEND("cAccess(vfs = <ptr>, zName = %s, flags = [", zName);
@@ -473,10 +537,13 @@ static int _cAccess(sqlite3_vfs* vfs, const char *zName, int flags, int *pResOut
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(ACCESS, 0, 0, flags, res);
     return res;
 }
 
 static int _cFullPathname(sqlite3_vfs* vfs, const char *zName, int nOut, char *zOut) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cFullPathname(vfs = <ptr>, zName = %s, nOut = %d, zOut = <...>)", zName, nOut);
@@ -491,10 +558,13 @@ static int _cFullPathname(sqlite3_vfs* vfs, const char *zName, int nOut, char *z
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(FULLPATHNAME, 0, 0, nOut, res);
     return res;
 }
 
 static int _cRandomness(sqlite3_vfs* vfs, int nByte, char *zOut) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cRandomness(vfs = <ptr>, nByte = %d, zOut = <ptr>)", nByte);
@@ -508,10 +578,13 @@ static int _cRandomness(sqlite3_vfs* vfs, int nByte, char *zOut) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(RANDOMNESS, 0, 0, nByte, bytesOfRandomness);
     return bytesOfRandomness;
 }
 
 static int _cSleep(sqlite3_vfs* vfs, int microseconds) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cSleep(vfs = <vfs>, microseconds = %d)\n", microseconds);
@@ -525,10 +598,13 @@ static int _cSleep(sqlite3_vfs* vfs, int microseconds) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(SLEEP, 0, 0, microseconds, res);
     return res;
 }
 
 static int _cGetLastError(sqlite3_vfs* vfs, int i, char *ch) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cGetLastError(vfs = <vfs>, i = %d, ch = %s)", i, ch);
@@ -542,10 +618,13 @@ static int _cGetLastError(sqlite3_vfs* vfs, int i, char *ch) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(GETLASTERROR, 0, 0, i, res);
     return res;
 }
 
 static int _cCurrentTime(sqlite3_vfs* vfs, double* time) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cCurrentTime(vfs = <vfs>, time = <...>)");
@@ -560,11 +639,13 @@ static int _cCurrentTime(sqlite3_vfs* vfs, double* time) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(CURRENTTIME, 0, 0, 0, res);
     return res;
 }
 
 static int _cCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* time) {
-    return cCurrentTimeInt64(vfs, time);
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_VFS
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cCurrentTimeInt64(vfs = <vfs>, time = <...>)");
@@ -579,12 +660,15 @@ static int _cCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* time) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(CURRENTTIMEINT64, 0, 0, 0, res);
     return res;
 }
 
 /* sqlite_mutex function prototypes */
 #if SQLITE_THREADSAFE
 static int _cMutexInit(void) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMutexInit()");
@@ -598,10 +682,13 @@ static int _cMutexInit(void) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(MUTEXINIT, 0, 0, 0, res);
     return res;
 }
 
 static int _cMutexEnd(void) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMutexEnd()");
@@ -615,10 +702,13 @@ static int _cMutexEnd(void) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(MUTEXEND, 0, 0, 0, res);
     return res;
 }
 
 static sqlite3_mutex* _cMutexAlloc(int mutexType) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(160);
         CTRACE_APPEND("cMutexAlloc(mutexType = ");
@@ -648,10 +738,13 @@ static sqlite3_mutex* _cMutexAlloc(int mutexType) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(MUTEXALLOC, 0, CPROBE_PTR(mut), mutexType, 0);
     return mut;
 }
 
 static void _cMutexFree(sqlite3_mutex *mutex) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMutexFree(mutex = %p)", mutex);
@@ -662,9 +755,13 @@ static void _cMutexFree(sqlite3_mutex *mutex) {
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_PRINT();
     #endif
+
+    CPROBE_END(MUTEXFREE, 0, CPROBE_PTR(mutex), 0, 0);
 }
 
 static void _cMutexEnter(sqlite3_mutex *mutex) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMutexEnter(mutex = %p)", mutex);
@@ -675,9 +772,13 @@ static void _cMutexEnter(sqlite3_mutex *mutex) {
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_PRINT();
     #endif
+
+    CPROBE_END(MUTEXENTER, 0, CPROBE_PTR(mutex), 0, 0);
 }
 
 static int _cMutexTry(sqlite3_mutex *mutex) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMutexTry(mutex)");
@@ -691,10 +792,13 @@ static int _cMutexTry(sqlite3_mutex *mutex) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(MUTEXTRY, 0, CPROBE_PTR(mutex), 0, res);
     return res;
 }
 
 static void _cMutexLeave(sqlite3_mutex *mutex) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMutexLeave(mutex = %p)", mutex);
@@ -705,9 +809,13 @@ static void _cMutexLeave(sqlite3_mutex *mutex) {
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_PRINT();
     #endif
+
+    CPROBE_END(MUTEXLEAVE, 0, CPROBE_PTR(mutex), 0, 0);
 }
 
 static int _cMutexHeld(sqlite3_mutex *mutex) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMutexHeld(mutex = %p)", mutex);
@@ -720,10 +828,13 @@ static int _cMutexHeld(sqlite3_mutex *mutex) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(MUTEXHELD, 0, CPROBE_PTR(mutex), 0, res);
     return res;
 }
 
 static int _cMutexNotheld(sqlite3_mutex *mutex) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MUTEX
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMutexNotheld(mutex = %p)", mutex);
@@ -736,12 +847,15 @@ static int _cMutexNotheld(sqlite3_mutex *mutex) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(MUTEXNOTHELD, 0, CPROBE_PTR(mutex), 0, res);
     return res;
 }
 #endif
 
 /* sqlite_mem function prototypes */
 static void* _cMemMalloc(int sz) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMemMalloc(sz = %d)", sz);
@@ -754,10 +868,13 @@ static void* _cMemMalloc(int sz) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(MALLOC, 0, CPROBE_PTR(mem), sz, mem ? SQLITE_OK : SQLITE_NOMEM);
     return mem;
 }
 
 static void _cMemFree(void* mem) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMemFree(mem = %p)", mem);
@@ -768,9 +885,13 @@ static void _cMemFree(void* mem) {
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_PRINT();
     #endif
+
+    CPROBE_END(FREE, 0, CPROBE_PTR(mem), 0, 0);
 }
 
 static void* _cMemRealloc(void* mem, int newSize) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMemRealloc(mem = %p, newSize = %d)", mem, newSize);
@@ -784,10 +905,13 @@ static void* _cMemRealloc(void* mem, int newSize) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(REALLOC, 0, CPROBE_PTR(newPtr), newSize, newPtr ? SQLITE_OK : SQLITE_NOMEM);
     return newPtr;
 }
 
 static int _cMemSize(void* mem) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMemSize(mem = %p)", mem);
@@ -800,10 +924,13 @@ static int _cMemSize(void* mem) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(SIZE, 0, CPROBE_PTR(mem), sz, 0);
     return sz;
 }
 
 static int _cMemRoundup(int sz) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMemRoundup(sz = %d)", sz);
@@ -816,10 +943,13 @@ static int _cMemRoundup(int sz) {
         CTRACE_PRINT();
     #endif
 
-    return sz;
+    CPROBE_END(ROUNDUP, 0, 0, sz, newSz);
+    return newSz;
 }
 
 static int _cMemInit(void* pAppData) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMemInit(pAppData = <>)");
@@ -833,10 +963,13 @@ static int _cMemInit(void* pAppData) {
         CTRACE_PRINT();
     #endif
 
+    CPROBE_END(MEMINIT, 0, 0, 0, res);
     return res;
 }
 
 static void _cMemShutdown(void* pAppData) {
+    CPROBE_BEGIN();
+
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_STRING_DEF(80);
         CTRACE_APPEND("cMemShutdown(pAppData = <>)");
@@ -847,11 +980,210 @@ static void _cMemShutdown(void* pAppData) {
     #if SQLITE_COS_PROFILE_MEMORY
         CTRACE_PRINT();
     #endif
+
+    CPROBE_END(MEMSHUTDOWN, 0, 0, 0, 0);
+}
+
+/* sqlite_pcache function prototypes */
+static int _cPcacheInit(void* pArg) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(80);
+        CTRACE_APPEND("cPcacheInit()");
+    #endif
+
+    const int res = cPcacheInit(pArg);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_APPEND(" => ");
+        APPEND_ERR_CODE(res);
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHEINIT, 0, 0, 0, res);
+    return res;
+}
+
+static void _cPcacheShutdown(void* pArg) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(80);
+        CTRACE_APPEND("cPcacheShutdown()");
+    #endif
+
+    cPcacheShutdown(pArg);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHESHUTDOWN, 0, 0, 0, 0);
+}
+
+static sqlite3_pcache* _cPcacheCreate(int szPage, int szExtra, int bPurgeable) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(120);
+        CTRACE_APPEND("cPcacheCreate(szPage = %d, szExtra = %d, bPurgeable = %d)", szPage, szExtra, bPurgeable);
+    #endif
+
+    sqlite3_pcache* cache = cPcacheCreate(szPage, szExtra, bPurgeable);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_APPEND(" => cache = %p", cache);
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHECREATE, 0, CPROBE_PTR(cache), szPage, 0);
+    return cache;
+}
+
+static void _cPcacheCachesize(sqlite3_pcache* pCache, int nCachesize) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(80);
+        CTRACE_APPEND("cPcacheCachesize(cache = %p, nCachesize = %d)", pCache, nCachesize);
+    #endif
+
+    cPcacheCachesize(pCache, nCachesize);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHECACHESIZE, 0, CPROBE_PTR(pCache), nCachesize, 0);
+}
+
+static int _cPcachePagecount(sqlite3_pcache* pCache) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(80);
+        CTRACE_APPEND("cPcachePagecount(cache = %p)", pCache);
+    #endif
+
+    const int n = cPcachePagecount(pCache);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_APPEND(" => %d", n);
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHEPAGECOUNT, 0, CPROBE_PTR(pCache), 0, n);
+    return n;
+}
+
+static sqlite3_pcache_page* _cPcacheFetch(sqlite3_pcache* pCache, unsigned int key, int createFlag) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(120);
+        CTRACE_APPEND("cPcacheFetch(cache = %p, key = %u, createFlag = %d)", pCache, key, createFlag);
+    #endif
+
+    sqlite3_pcache_page* page = cPcacheFetch(pCache, key, createFlag);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_APPEND(" => page = %p", page);
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHEFETCH, 0, CPROBE_PTR(pCache), (int)key, page ? SQLITE_OK : SQLITE_NOMEM);
+    return page;
+}
+
+static void _cPcacheUnpin(sqlite3_pcache* pCache, sqlite3_pcache_page* pPage, int discard) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(120);
+        CTRACE_APPEND("cPcacheUnpin(cache = %p, page = %p, discard = %d)", pCache, pPage, discard);
+    #endif
+
+    cPcacheUnpin(pCache, pPage, discard);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHEUNPIN, 0, CPROBE_PTR(pCache), 0, discard);
+}
+
+static void _cPcacheRekey(sqlite3_pcache* pCache, sqlite3_pcache_page* pPage, unsigned int oldKey, unsigned int newKey) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(120);
+        CTRACE_APPEND("cPcacheRekey(cache = %p, page = %p, oldKey = %u, newKey = %u)", pCache, pPage, oldKey, newKey);
+    #endif
+
+    cPcacheRekey(pCache, pPage, oldKey, newKey);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHEREKEY, 0, CPROBE_PTR(pCache), (int)newKey, 0);
+}
+
+static void _cPcacheTruncate(sqlite3_pcache* pCache, unsigned int iLimit) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(80);
+        CTRACE_APPEND("cPcacheTruncate(cache = %p, iLimit = %u)", pCache, iLimit);
+    #endif
+
+    cPcacheTruncate(pCache, iLimit);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHETRUNCATE, 0, CPROBE_PTR(pCache), (int)iLimit, 0);
+}
+
+static void _cPcacheDestroy(sqlite3_pcache* pCache) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(80);
+        CTRACE_APPEND("cPcacheDestroy(cache = %p)", pCache);
+    #endif
+
+    cPcacheDestroy(pCache);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHEDESTROY, 0, CPROBE_PTR(pCache), 0, 0);
+}
+
+static void _cPcacheShrink(sqlite3_pcache* pCache) {
+    CPROBE_BEGIN();
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_STRING_DEF(80);
+        CTRACE_APPEND("cPcacheShrink(cache = %p)", pCache);
+    #endif
+
+    cPcacheShrink(pCache);
+
+    #if SQLITE_COS_PROFILE_PCACHE
+        CTRACE_PRINT();
+    #endif
+
+    CPROBE_END(PCACHESHRINK, 0, CPROBE_PTR(pCache), 0, 0);
 }
 
 /* API structs */
 struct sqlite3_io_methods composite_io_methods = {
-    .iVersion = 1,
+    .iVersion = 3,
     .xClose = _cClose,
     .xRead = _cRead,
     .xWrite = _cWrite,
@@ -886,7 +1218,7 @@ static sqlite3_vfs composite_vfs = {
     .szOsFile = sizeof(struct cFile),
     .mxPathname = MAX_PATHNAME,
     .pNext = 0,
-    .zName = "composite-inmemfs",
+    .zName = COMPOSITE_INMEMFS_VFS,
     .pAppData = &composite_vfs_app_data,
     .xOpen = _cOpen,
     .xDelete = _cDelete,
@@ -908,6 +1240,47 @@ static sqlite3_vfs composite_vfs = {
     .xNextSystemCall = 0
 };
 
+/* the instances added by composite_fs_add_instances(). they're never freed: SQLite keeps a VFS registered across
+ * sqlite3_shutdown(), so its pAppData has to outlive the heap.
+ */
+static struct composite_vfs_data composite_instance_data[COMPOSITE_FS_MAX_INSTANCES];
+static sqlite3_vfs composite_instance_vfs[COMPOSITE_FS_MAX_INSTANCES];
+static char composite_instance_names[COMPOSITE_FS_MAX_INSTANCES][sizeof(COMPOSITE_INMEMFS_VFS) + 4];
+static int composite_nInstance = 0;
+
+int composite_fs_add_instances(int nInstance) {
+  if( nInstance < 0 || nInstance > COMPOSITE_FS_MAX_INSTANCES - composite_nInstance ) {
+    return SQLITE_MISUSE;
+  }
+
+  int i;
+  for( i = 0; i < nInstance; i++ ) {
+    const int iInstance = composite_nInstance;
+    struct composite_vfs_data *data = &composite_instance_data[iInstance];
+    sqlite3_vfs *vfs = &composite_instance_vfs[iInstance];
+    char *zName = composite_instance_names[iInstance];
+
+    sqlite3_snprintf((int)sizeof(composite_instance_names[iInstance]), zName, "%s-%d", COMPOSITE_INMEMFS_VFS, iInstance);
+    data->prng_state = 4;
+    data->zName = zName;
+    int rc = fs_add_instance(data);
+    if( rc != SQLITE_OK ) {
+      return rc;
+    }
+    composite_nInstance++; /* the instance is in fs_init()'s list now, so its slot can't be reused */
+
+    *vfs = composite_vfs;
+    vfs->zName = zName;
+    vfs->pAppData = data;
+    rc = sqlite3_vfs_register(vfs, 0);
+    if( rc != SQLITE_OK ) {
+      return rc;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
 #if SQLITE_THREADSAFE
 static const sqlite3_mutex_methods composite_mutex_methods = {
     .xMutexInit = _cMutexInit,
@@ -933,17 +1306,60 @@ const sqlite3_mem_methods composite_mem_methods = {
     .pAppData = 0
 };
 
-/* init the OS interface */
-int sqlite3_os_init(void){
+static const sqlite3_pcache_methods2 composite_pcache_methods = {
+    .iVersion = 1,
+    .pArg = 0,
+    .xInit = _cPcacheInit,
+    .xShutdown = _cPcacheShutdown,
+    .xCreate = _cPcacheCreate,
+    .xCachesize = _cPcacheCachesize,
+    .xPagecount = _cPcachePagecount,
+    .xFetch = _cPcacheFetch,
+    .xUnpin = _cPcacheUnpin,
+    .xRekey = _cPcacheRekey,
+    .xTruncate = _cPcacheTruncate,
+    .xDestroy = _cPcacheDestroy,
+    .xShrink = _cPcacheShrink
+};
+
+/* install our mutex and memory implementations.
+ * sqlite3_os_init() runs after SQLite has already set up its mutexes and allocator, so these
+ * have to be configured before sqlite3_initialize() is called.
+ *
+ * this also registers the stats virtual tables as an auto-extension. that can't be done from
+ * sqlite3_os_init(): sqlite3_auto_extension() allocates, and SQLite's allocator calls sqlite3_initialize()
+ * while sqlite3_auto_extension() holds the master mutex. registering it initializes SQLite, so any other
+ * sqlite3_config() calls must come before this.
+ */
+int composite_os_config(void) {
+  int rc;
   #if SQLITE_THREADSAFE
-    sqlite3_config(SQLITE_CONFIG_MUTEX, &composite_mutex_methods);
+    rc = sqlite3_config(SQLITE_CONFIG_MUTEX, &composite_mutex_methods);
+    if( rc != SQLITE_OK ) return rc;
   #endif
-  sqlite3_config(SQLITE_CONFIG_MALLOC, &composite_mem_methods);
+  rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &composite_mem_methods);
+  if( rc != SQLITE_OK ) return rc;
+  rc = sqlite3_auto_extension( (void(*)(void))composite_stats_init );
+  return rc;
+}
+
+/* init the OS interface */
+int sqlite3_os_init(void){
+  /* SQLite has already initialized its own page cache by now; ours doesn't need xInit(), so it's
+   * safe to swap in here. clean pages come from inmemfs through xFetch(), which needs a nonzero mmap_size;
+   * the Makefile turns that on with SQLITE_DEFAULT_MMAP_SIZE, so an application's SQLITE_CONFIG_MMAP_SIZE
+   * still takes precedence.
+   */
+  sqlite3_config(SQLITE_CONFIG_PCACHE2, &composite_pcache_methods);
 
   struct composite_vfs_data *data = &composite_vfs_app_data;
   data->prng_state = 4; /* seed the PRNG with a completely random value */
+  data->zName = COMPOSITE_INMEMFS_VFS;
   
-  cVfsInit();
+  const int rc = cVfsInit();
+  if( rc != SQLITE_OK ) {
+    return rc;
+  }
   sqlite3_vfs_register(&composite_vfs, 1);
 
   return SQLITE_OK;
@@ -952,9 +1368,17 @@ int sqlite3_os_init(void){
 /* shutdown the OS interface */
 int sqlite3_os_end(void) {
   cVfsDeinit();
+  #if SQLITE_COS_TRACE_BINARY
+    composite_trace_dump(SQLITE_COS_TRACE_FILE);
+  #endif
+  #if SQLITE_COS_HISTOGRAMS
+    composite_latency_print();
+  #endif
   #if SQLITE_COS_PROFILE_MEMORY
-    printf("memUsage = %" PRIu64 "\n", composite_mem_app_data.outstanding_memory);
-    printf("maxMemUsage = %" PRIu64 "\n", composite_mem_app_data.max_memory);
+    struct composite_mem_stats mem;
+    cMemStats(&mem);
+    printf("memUsage = %" PRIu64 "\n", mem.outstanding_memory);
+    printf("maxMemUsage = %" PRIu64 "\n", mem.max_memory);
   #endif
   return SQLITE_OK;
 }
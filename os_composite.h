@@ -16,11 +16,27 @@
 #define SQLITE_COS_PROFILE_MEMORY 0
 #endif
 
+#ifndef SQLITE_COS_PROFILE_PCACHE
+#define SQLITE_COS_PROFILE_PCACHE 0
+#endif
+
+#ifndef SQLITE_COS_TRACE_BINARY
+#define SQLITE_COS_TRACE_BINARY 0
+#endif
+
+#ifndef SQLITE_COS_HISTOGRAMS
+#define SQLITE_COS_HISTOGRAMS 0
+#endif
+
+#ifndef SQLITE_COS_TRACE_FILE
+#define SQLITE_COS_TRACE_FILE "composite.trace" /* where sqlite3_os_end() writes the binary trace */
+#endif
+
 #ifndef SQLITE_MEM_USE_MALLOC
 #define SQLITE_MEM_USE_MALLOC 0
 #endif
 
-#if SQLITE_COS_PROFILE_VFS || SQLITE_COS_PROFILE_MUTEX || SQLITE_COS_PROFILE_MEMORY
+#if SQLITE_COS_PROFILE_VFS || SQLITE_COS_PROFILE_MUTEX || SQLITE_COS_PROFILE_MEMORY || SQLITE_COS_PROFILE_PCACHE
 
 #include <string.h>
 #include <stdio.h>
@@ -136,59 +152,576 @@
     } while(0)
 #endif
 
+#include "os_composite_trace.h" /* for CTRACE_OP_* */
+#include "os_composite_kernels.h" /* for cCopy() and cZero() */
+#include <pthread.h> /* for the shared region's pthread_mutex_t */
+
+/* call probes: each _cXxx() wrapper in os_composite.c opens with CPROBE_BEGIN() and reports the call with
+ * CPROBE_END(). the call goes to the binary trace and/or the latency histograms; see os_composite_trace.c.
+ */
+#if SQLITE_COS_TRACE_BINARY || SQLITE_COS_HISTOGRAMS
+struct cFile;
+sqlite3_uint64 cProbeNow(void);
+void cProbeRecord(int op, struct cFile* file, sqlite3_int64 offset, int len, int result, sqlite3_uint64 start);
+
+#define CPROBE_BEGIN() const sqlite3_uint64 _cprobe_start = cProbeNow()
+#define CPROBE_END(op, file, offset, len, result) cProbeRecord(CTRACE_OP_##op, file, offset, len, result, _cprobe_start)
+#define CPROBE_FILE(baseFile) ( (struct cFile*)(baseFile) )
+#define CPROBE_PTR(p) ( (sqlite3_int64)(intptr_t)(p) )
+#else
+#define CPROBE_BEGIN()
+#define CPROBE_END(op, file, offset, len, result)
+#endif
+
+/* writes the binary trace collected so far to zPath; returns SQLITE_OK, or SQLITE_ERROR if tracing
+ * isn't compiled in or the file can't be written
+ */
+int composite_trace_dump(const char* zPath);
+
+/* the kinds of file SQLite opens, from the SQLITE_OPEN_* type flags passed to xOpen() */
+#define CFILE_TYPE_MAIN_DB 0
+#define CFILE_TYPE_MAIN_JOURNAL 1
+#define CFILE_TYPE_TEMP_DB 2
+#define CFILE_TYPE_TEMP_JOURNAL 3
+#define CFILE_TYPE_TRANSIENT_DB 4
+#define CFILE_TYPE_SUBJOURNAL 5
+#define CFILE_TYPE_MASTER_JOURNAL 6
+#define CFILE_TYPE_WAL 7
+#define CFILE_TYPE_OTHER 8
+#define CFILE_TYPE_COUNT 9
+
+/* latency of one method, from the histograms kept by SQLITE_COS_HISTOGRAMS builds.
+ * percentiles are the upper bound of the histogram bucket they fall in, so they may be up to 25% high.
+ */
+struct composite_latency {
+    sqlite3_uint64 count; /* the number of calls */
+    double mean_ns;
+    double p50_ns;
+    double p99_ns;
+    double p999_ns;
+    double max_ns;
+};
+
+/* fills *pOut with the latency of method op (one of CTRACE_OP_*) on files of type fileType (one of
+ * CFILE_TYPE_*, or -1 for all types); methods that don't act on a file only have CFILE_TYPE_OTHER.
+ * returns SQLITE_OK, SQLITE_RANGE for a bad op or type, or SQLITE_ERROR if histograms aren't compiled in.
+ */
+int composite_latency_query(int op, int fileType, struct composite_latency* pOut);
+
+/* prints a table of every method and file type that has been called to stdout */
+void composite_latency_print(void);
+
+/* registers the composite_stats and composite_files virtual tables with db. composite_os_config() registers
+ * this as an auto-extension, so every connection has them; sqlite3_shutdown() clears the auto-extension list.
+ */
+int composite_stats_init(sqlite3* db, char** pzErrMsg, const sqlite3_api_routines* pApi);
+
 /* in-mem FS variables */
 #define FS_SECTOR_SIZE 4096 /* sqlite will attempt to before filesystem I/O in blocks of this size */
+#define FS_PAGE_SIZE 4096 /* file data is stored in fixed-size pages of this many bytes; matches SQLite's default page size */
 #define MAX_PATHNAME 512
 
+/* serializes access to the state that an instance's connections share: lock levels and the wal-index. in
+ * single-threaded builds the locking macros still use their argument, so that a variable only needed for the lock
+ * isn't unused.
+ */
+#if SQLITE_THREADSAFE
+#define CVFS_MUTEX_ENTER(cVfs) sqlite3_mutex_enter( (cVfs)->mutex )
+#define CVFS_MUTEX_LEAVE(cVfs) sqlite3_mutex_leave( (cVfs)->mutex )
+#else
+#define CVFS_MUTEX_ENTER(cVfs) (void)(cVfs)
+#define CVFS_MUTEX_LEAVE(cVfs) (void)(cVfs)
+#endif
+
+/* serializes access to an inmemfs instance's namespace; a file's data is guarded by the file's own mutex */
+#if SQLITE_THREADSAFE
+#define FS_NAMESPACE_ENTER(cVfs) sqlite3_mutex_enter( (cVfs)->namespaceMutex )
+#define FS_NAMESPACE_LEAVE(cVfs) sqlite3_mutex_leave( (cVfs)->namespaceMutex )
+#define FS_FILE_ENTER(file) sqlite3_mutex_enter( (file)->mutex )
+#define FS_FILE_LEAVE(file) sqlite3_mutex_leave( (file)->mutex )
+#else
+#define FS_NAMESPACE_ENTER(cVfs) (void)(cVfs)
+#define FS_NAMESPACE_LEAVE(cVfs) (void)(cVfs)
+#define FS_FILE_ENTER(file) (void)(file)
+#define FS_FILE_LEAVE(file) (void)(file)
+#endif
+
 /* API structs */
 extern struct sqlite3_io_methods composite_io_methods;
 extern struct composite_vfs_data composite_vfs_app_data;
 extern struct composite_mem_data composite_mem_app_data;
 extern const sqlite3_mem_methods composite_mem_methods;
 
+/* snapshot images: composite_fs_snapshot() writes every inmemfs file to a single image file. if an image
+ * has been set with composite_fs_set_image() (before sqlite3_initialize()), initialization maps it and the
+ * files in it are served straight from the mapping; a page is only copied into memory when it's written.
+ */
+/* writes every file of the default instance (see composite_fs_add_instances()) to zPath, replacing it atomically.
+ * each file is copied under its own lock, so take the snapshot between transactions.
+ * returns SQLITE_OK, or SQLITE_IOERR if the image can't be written.
+ */
+int composite_fs_snapshot(const char* zPath);
+
+/* sets the image to restore at the next initialization, or 0 for none. a missing image file is
+ * treated as empty; a damaged one makes sqlite3_initialize() fail with SQLITE_CORRUPT. composite_os_config()
+ * initializes SQLite, so call this before it, or between sqlite3_shutdown() and the next sqlite3_initialize().
+ * returns SQLITE_OK, or SQLITE_MISUSE if the path is too long or SQLite is already initialized
+ */
+int composite_fs_set_image(const char* zPath);
+
+/* clones: composite_fs_clone() creates a file that shares every page with the source until one of them
+ * writes it, so cloning costs a pointer copy per page rather than a copy of the data.
+ */
+
+/* sqlite3_file_control(db, zDbName, COMPOSITE_FCNTL_CLONE, (void*)zDstName) clones the database file. only the
+ * database file itself is cloned, so checkpoint first in WAL mode, and don't clone during a write transaction.
+ */
+#define COMPOSITE_FCNTL_CLONE 0x43460001
+
+/* clones the file zSrc as zDst in the default instance, replacing zDst if it exists and isn't open. the file control
+ * clones within the database's own instance.
+ * returns SQLITE_OK, SQLITE_CANTOPEN if zSrc doesn't exist, SQLITE_BUSY if zDst is open, SQLITE_MISUSE if
+ * they're the same file, or SQLITE_NOMEM
+ */
+int composite_fs_clone(const char* zSrc, const char* zDst);
+
+/* adoption: composite_fs_adopt() makes the nData bytes at pData the contents of the file zName in the default
+ * instance without copying them, replacing zName if it exists and isn't open. the file's pages point into the buffer,
+ * which must stay readable and unchanged, until they're written: a page is copied out the first time it's written,
+ * like a page of a snapshot image. the buffer belongs to the file from then on, and is passed to xFree once no page
+ * points into it anymore, or when SQLite shuts down; pass 0 for xFree to keep it. only a partial last page is copied
+ * up front.
+ * returns SQLITE_OK, SQLITE_BUSY if zName is open, SQLITE_MISUSE if SQLite isn't initialized, or SQLITE_NOMEM; on an
+ * error, the buffer still belongs to the caller.
+ */
+int composite_fs_adopt(const char* zName, const void* pData, sqlite3_int64 nData, void (*xFree)(void*));
+
+/* a main database opened with the URI parameter source=PATH, when it doesn't exist in the inmemfs yet, starts out as
+ * the file at PATH on disk, mapped read-only and adopted as above: nothing is read until it's used, reads come
+ * straight from the OS's page cache, and only the pages that are written take memory of their own. the disk file is
+ * never written, and mustn't be changed or truncated while it's mapped. the page directory still costs a few dozen
+ * bytes for each page of the file.
+ */
+
+/* export: composite_fs_export() fills *pView with the current bytes of zName in the default instance, as a list of
+ * segments that point at the file's pages rather than copies of them. pages that happen to be contiguous in memory,
+ * like those of an adopted buffer that hasn't been written, are merged into one segment, and holes point at a shared
+ * page of zeroes. the view doesn't change when the file is written (the file copies a page it shares with a view
+ * before writing it) and stays valid after the file is deleted, until composite_fs_export_release(); release it
+ * before sqlite3_shutdown().
+ * returns SQLITE_OK, SQLITE_CANTOPEN if zName doesn't exist, SQLITE_MISUSE if SQLite isn't initialized, or
+ * SQLITE_NOMEM
+ */
+struct composite_fs_segment {
+    const void* p;
+    sqlite3_int64 n;
+};
+
+struct composite_fs_view {
+    sqlite3_int64 len; /* the length of the file, and so the sum of the segments' lengths */
+    int nSegment;
+    const struct composite_fs_segment* aSegment;
+    void* pRefs; /* the page references the view holds */
+};
+
+int composite_fs_export(const char* zName, struct composite_fs_view* pView);
+void composite_fs_export_release(struct composite_fs_view* pView);
+
+/* truncating a file releases its pages, but keeps as many as it regrew by since its previous truncation, so that
+ * a journal that's truncated after every commit doesn't reallocate them each time. composite_fs_shrink() releases
+ * that slack from every file of every instance, e.g. when the process goes idle, and returns the number of bytes
+ * released.
+ */
+sqlite3_int64 composite_fs_shrink(void);
+
+/* compression: a database opened with the URI parameter compress=1 keeps its cold pages compressed, with at most
+ * compress_cache=N pages (FS_COMPRESS_DEFAULT_CACHE by default) decompressed at a time. the setting belongs to the
+ * file, so it applies to every connection once any of them has set it. compress=0 turns it off, though pages that
+ * are already compressed stay that way until they're written.
+ */
+#define FS_COMPRESS_DEFAULT_CACHE 256
+
+/* memory budget: once the page data of every inmemfs file, in every instance, takes more than nBytes, the least
+ * recently used pages are spilled to a file at zSpillPath and read back in when they're next used; an allocation
+ * that fails also spills pages to make room. the spill file is unlinked as soon as it's created, so it never
+ * outlives the process, and it's only opened once: zSpillPath is ignored while one is open. nBytes 0 removes the
+ * budget (pages that were spilled stay spilled until they're used). may be called before sqlite3_initialize() or at
+ * any time after.
+ * returns SQLITE_OK, SQLITE_MISUSE if zSpillPath is too long, or SQLITE_CANTOPEN
+ */
+int composite_fs_set_budget(sqlite3_int64 nBytes, const char* zSpillPath);
+
+/* pools: inmemfs file data (page buffers, their compressed copies and page directories) doesn't come from the SQLite
+ * heap, but from a buddy allocator of its own with two pools: COMPOSITE_FS_POOL_MAIN for main databases and their
+ * WAL files, and COMPOSITE_FS_POOL_TEMP for journals and every kind of temporary file. composite_fs_set_pool_budget()
+ * caps the bytes a pool hands out (0, the default, for no limit); once a pool is used up, writes that need more of it
+ * fail (after spilling, if there's a memory budget), so a large sort can fill the temporary pool without taking any
+ * memory the main databases need. may be called at any time; allocations already made are left alone.
+ * returns SQLITE_OK, or SQLITE_RANGE if pool isn't one of COMPOSITE_FS_POOL_*
+ */
+#define COMPOSITE_FS_POOL_MAIN 0
+#define COMPOSITE_FS_POOL_TEMP 1
+#define COMPOSITE_FS_POOL_COUNT 2
+int composite_fs_set_pool_budget(int pool, sqlite3_int64 nBytes);
+
+/* shared inmemfs: composite_shmfs_attach() maps a shared memory region of nBytes that holds a namespace of its own -
+ * its files, their pages and their locks - and registers the VFS COMPOSITE_SHMFS_VFS for it. every process that
+ * attaches the same region sees the same files, and SQLite's locks work between them, so several processes can
+ * use one in-memory database. zName is a POSIX shared memory object (see shm_open()), created if it doesn't exist;
+ * it outlives the processes until it's shm_unlink()ed, and every process must pass the nBytes it was created with.
+ * if zName is 0, the region is an anonymous memfd that's only shared with processes forked after the call.
+ *
+ * only the rollback journal modes work: the region has no wal-index, so WAL needs locking_mode=EXCLUSIVE.
+ * temporary files stay in the process's own inmemfs. the references and SQLite locks of a process that dies while
+ * it has a file open are taken back once they're in another process's way: when a lock would be BUSY, a journal
+ * looks locked, the file is deleted, or it has no slot left for another process. at most SHMFS_MAX_HOLDERS
+ * processes can have one file open at once.
+ *
+ * call it after composite_os_config(). returns SQLITE_OK, SQLITE_MISUSE if a region is already attached, nBytes
+ * is too small or the region was created with a different size, SQLITE_CANTOPEN if the region can't be created or
+ * mapped, or SQLITE_CORRUPT if it isn't a region
+ */
+#define COMPOSITE_SHMFS_VFS "composite-shm"
+int composite_shmfs_attach(const char* zName, sqlite3_int64 nBytes);
+
+/* unregisters COMPOSITE_SHMFS_VFS and unmaps the region; the region itself is left alone.
+ * returns SQLITE_OK, SQLITE_MISUSE if no region is attached, or SQLITE_BUSY if this process still has files open in it
+ */
+int composite_shmfs_detach(void);
+
+/* instances: composite_fs_add_instances() creates nInstance more inmemfs instances and registers each as a VFS of
+ * its own, named COMPOSITE_INMEMFS_VFS "-0", "-1" and so on, in the order they're created. an instance has its own
+ * namespace, its own mutexes for the namespace and for its files' locks, and counts its own memory, so connections
+ * that use different instances (e.g. one per worker thread, with sqlite3_open_v2()'s zVfs) never touch the same
+ * file and never contend for a lock; only the allocator, and the spill file under a memory budget, are still shared.
+ * the files of the default instance, COMPOSITE_INMEMFS_VFS, aren't visible to the others, nor theirs to it.
+ * composite_files has a vfs column that names each file's instance.
+ *
+ * call it after composite_os_config(), before opening connections that use the new instances, and not from two
+ * threads at once. instances last as long as the process: they're emptied by sqlite3_shutdown() like the default
+ * instance, but stay registered. returns SQLITE_OK, SQLITE_MISUSE if SQLite isn't initialized or there would be more
+ * than COMPOSITE_FS_MAX_INSTANCES, or SQLITE_NOMEM
+ */
+#define COMPOSITE_INMEMFS_VFS "composite-inmemfs"
+#define COMPOSITE_FS_MAX_INSTANCES 64
+int composite_fs_add_instances(int nInstance);
+
+/* memory budget for SQLite's heap: the allocator reserves CMEM_ARENA_RESERVE bytes of address space (256GB, or as much
+ * as the system allows) when it's initialized, and only backs the part that's in use with memory. allocations that
+ * would take more than nBytes fail. 0, the default, uses the tightest memory.max of the process's cgroups, or the
+ * physical memory if there's no limit. may be called before sqlite3_initialize() or at any time after; a budget
+ * below what's in use only stops further growth. has no effect in SQLITE_MEM_USE_MALLOC builds.
+ * returns SQLITE_OK, or SQLITE_RANGE if nBytes is negative
+ */
+int composite_mem_set_budget(sqlite3_int64 nBytes);
+
+/* installs composite's mutex and memory allocator and registers composite_stats_init() as an auto-extension.
+ * registering the auto-extension initializes SQLite, so this must be the last step of the setup before
+ * sqlite3_initialize(): sqlite3_config() and composite_fs_set_image() calls made after it return SQLITE_MISUSE.
+ */
+int composite_os_config(void);
+
 /* cFile */
 struct cFile {
     struct sqlite3_io_methods* composite_io_methods;
     const char* zName;
     void* fd;
+    unsigned int fileId; /* a copy of the fs_file's id, for tracing */
+    int fileType; /* one of CFILE_TYPE_*, for the latency histograms */
+    sqlite3_int64 mmapSize; /* xFetch() only hands out pointers below this offset; set with SQLITE_FCNTL_MMAP_SIZE */
+    int nFetchOut; /* the number of pointers handed out by xFetch() that haven't been released */
+    int eLock; /* the lock this connection holds on the file: one of SQLITE_LOCK_* */
+    int shmMapped; /* 1 if this connection has mapped the file's wal-index */
+    unsigned short shmSharedMask; /* the wal-index lock slots this connection holds SHARED */
+    unsigned short shmExclMask; /* the wal-index lock slots this connection holds EXCLUSIVE */
+};
+
+/* a mutex; SQLite only sees these through sqlite3_mutex pointers */
+struct cMutex {
+    int lock; /* 0 if unlocked, 1 if locked, 2 if locked and other threads may be waiting */
+    int id; /* the SQLITE_MUTEX_* type the mutex was allocated as */
+    int owner; /* the id of the thread that holds the mutex, or 0 */
+    int nRef; /* the number of times the owner has entered the mutex */
+    sqlite3_uint64 nEnter; /* the number of times the mutex has been acquired; only written by the owner */
+    sqlite3_uint64 nContended; /* how many of those acquisitions had to wait for another thread */
 };
 
+/* an inmemfs instance, and the pAppData of the VFS it's registered as. each is aligned to a cache line of its own, so
+ * that instances used from different threads don't share one.
+ */
 struct composite_vfs_data {
     sqlite3_uint64 prng_state;
-};
+    const char* zName; /* the name of the instance's VFS */
+    struct fs_slot* slots; /* the instance's file namespace, an open-addressing hash table; see _fs_file_link() */
+    int nSlots; /* always a power of two */
+    int nFiles;
+    sqlite3_int64 resident; /* the bytes of page buffers and compressed copies the instance's files hold (a buffer
+                             * shared by clones counts once for each); see composite_fs_set_budget()
+                             */
+    sqlite3_mutex* namespaceMutex; /* see FS_NAMESPACE_ENTER(); 0 in single-threaded builds */
+    sqlite3_mutex* mutex; /* see CVFS_MUTEX_ENTER(); 0 in single-threaded builds */
+    struct composite_vfs_data* next; /* the next instance, in the order they were added */
+} __attribute__((aligned(64)));
 
+/* in multi-threaded builds, each thread keeps a count of its own that it only adds to these now and then;
+ * cMemStats() sums them all
+ */
 struct composite_mem_data {
     sqlite3_int64 outstanding_memory; /* how many bytes of memory have we given out? */
     sqlite3_int64 max_memory; /* the largest value of 'outstanding_memory' that we've seen over the life */
 };
 
+/* a snapshot of the allocator's state, from cMemStats(). the slab counts are 0 in SQLITE_MEM_USE_MALLOC builds. */
+struct composite_mem_stats {
+    sqlite3_int64 outstanding_memory;
+    sqlite3_int64 max_memory;
+    sqlite3_int64 arena_size; /* the size of the arena, in bytes: its budget */
+    sqlite3_int64 arena_reserved; /* the address space reserved for it */
+    sqlite3_int64 arena_committed; /* the part of that which has been made usable */
+    sqlite3_int64 retained_bytes; /* free slabs whose pages are kept in memory for reuse */
+    int nSlab; /* the number of slabs in the arena */
+    int nSlabTouched; /* slabs that have ever been used; the rest of the arena has never been written */
+    int nSlabFree; /* slabs that are free, whether or not they've been used */
+    int nSlabSmall; /* slabs that hold small objects */
+    int nSlabLarge; /* slabs that are part of a large allocation */
+    int nLargestFreeRun; /* the most contiguous free slabs, and so the largest allocation that can still succeed */
+    sqlite3_int64 small_bytes; /* the bytes of small objects handed out, out of nSlabSmall * the slab size */
+    int nThreadCache; /* threads that have a cache of their own */
+    sqlite3_int64 cached_bytes; /* small objects held in the threads' caches; part of small_bytes */
+    sqlite3_uint64 nCacheHit; /* allocations served from a thread's cache */
+    sqlite3_uint64 nCacheRefill; /* times a thread took a batch of objects from the slabs */
+    sqlite3_uint64 nCacheFlush; /* ... and gave a batch back */
+    sqlite3_uint64 nMutexEnter; /* acquisitions of the allocator's mutex */
+    sqlite3_uint64 nMutexContended;
+};
+
+/* a snapshot of one inmemfs pool's state, from cPoolStats() */
+struct composite_pool_stats {
+    sqlite3_int64 used; /* the bytes handed out, rounded up to the size of their blocks */
+    sqlite3_int64 peak;
+    sqlite3_int64 mapped; /* the bytes mapped for the pool, used or not */
+    sqlite3_int64 budget;
+    int nChunk; /* the number of chunks the buddy allocator has mapped */
+    int nExtent; /* the number of allocations too large for a chunk, each mapped on its own */
+    sqlite3_uint64 nAlloc;
+    sqlite3_uint64 nFail;
+    sqlite3_uint64 nMutexEnter; /* acquisitions of the pool's mutex */
+    sqlite3_uint64 nMutexContended;
+};
+
 /* inmem fs structs */
+struct fs_page {
+    char* buf; /* FS_PAGE_SIZE bytes of file data, or 0 if the page is only held compressed (zbuf) or spilled */
+    int pin; /* the number of pointers into buf handed out by fs_fetch(); a pinned page must not be freed */
+    int mapped; /* 1 if buf points into the snapshot image or is the shared zero page (a hole), both read-only; the page
+                 * is copied before it's written
+                 */
+    int* shared; /* if buf is shared with clones, the number of pages that point to it; the page is copied before it's
+                  * written while that's more than 1. 0 if the page is the buffer's only owner.
+                  */
+    char* zbuf; /* a compressed copy of the page (see fs_set_compression()), always owned by the page; 0 if there's none.
+                 * it's dropped when the page is written.
+                 */
+    int zlen; /* the length of zbuf */
+    int recent; /* set whenever the page is used; cleared by the clock hand that looks for pages to compress or spill */
+    int spill; /* if the page has been spilled (buf and zbuf are 0), 1 + its slot in the spill file; otherwise 0 */
+    struct fs_extern* ext; /* if buf points into an adopted buffer (mapped is then 1), the buffer; see fs_adopt() */
+};
+
+/* a buffer adopted with fs_adopt(): one given to composite_fs_adopt(), or a file mapped with the source= URI
+ * parameter. pages point into it until they're written; it's handed back to xFree once the last of them lets go.
+ */
+struct fs_extern {
+    void* p; /* what's passed to xFree */
+    void (*xFree)(void*); /* 0 if the caller keeps the buffer */
+    int nRef; /* the pages, views and retired buffers that point into it */
+};
+
+/* a page buffer that was replaced while SQLite still had pointers into it from fs_fetch(); it's released once
+ * the page is unpinned
+ */
+struct fs_retired {
+    char* buf;
+    int* shared;
+    struct fs_extern* ext;
+    int iPage;
+    struct fs_retired* next;
+};
+
 struct fs_data {
-    char* buf; /* a pointer to the buffer containing the file's data */
-    sqlite3_int64 len; /* the portion of this buffer contains valid data */
+    struct fs_page* pages; /* the page directory; pages[i] holds bytes [i*FS_PAGE_SIZE, (i+1)*FS_PAGE_SIZE) of the file */
+    int nPages; /* the number of pages that have been allocated */
+    int nSlots; /* the number of entries the page directory has room for */
+    sqlite3_int64 len; /* the number of bytes of the file that contain valid data */
+    sqlite3_int64 truncated; /* the length the file was last truncated (or shrunk) to, or -1 if it never was */
+    sqlite3_int64 peak; /* the longest the file has been since then; see fs_truncate() */
+};
+
+/* the wal-index of a database, shared by every connection that has it mapped */
+struct fs_shm {
+    volatile void** regions; /* the mapped regions; a region never moves once it has been allocated */
+    int nRegion; /* the number of regions that have been allocated */
+    int szRegion; /* the size of each region, in bytes */
+    int nRef; /* the number of connections that have the wal-index mapped */
+    int nShared[SQLITE_SHM_NLOCK]; /* for each lock slot, the number of connections holding it SHARED */
+    int exclusive[SQLITE_SHM_NLOCK]; /* for each lock slot, 1 if a connection holds it EXCLUSIVE */
 };
 
 struct fs_file {
     struct composite_vfs_data* cVfs;
-    struct fs_file* next; /* the next file in the list */
+    int pool; /* the pool the file's data comes from: one of COMPOSITE_FS_POOL_* */
 
     const char* zName; /* the name of the file */
+    unsigned int hash; /* the hash of zName; computed once, when the file is created */
+    unsigned int id; /* a number that identifies this file for as long as the process runs */
     struct fs_data data;
     int ref; /* the number of open cFile's the file has */
     int deleteOnClose; /* if 1, then this file should be deleted once it's reference count reaches 0 */
+    struct fs_shm* shm; /* the wal-index, or 0 if no connection has it mapped */
+    struct fs_retired* retired; /* guarded by mutex */
+    int eLock; /* the strongest lock any connection holds on the file: one of SQLITE_LOCK_* */
+    int nShared; /* the number of connections holding a SHARED or stronger lock */
+    sqlite3_mutex* mutex; /* guards data and the counters below; 0 in single-threaded builds */
+    sqlite3_uint64 nRead; /* the number of fs_read() calls */
+    sqlite3_uint64 nReadBytes; /* the number of bytes fs_read() has returned */
+    sqlite3_uint64 nWrite; /* the number of fs_write() calls */
+    sqlite3_uint64 nWriteBytes; /* the number of bytes fs_write() has written */
+    sqlite3_uint64 nFetch; /* the number of pointers fs_fetch() has handed out */
+    int nHotMax; /* the most pages the file keeps decompressed once it has compressed any; 0 if compression is off */
+    int nHot; /* the number of pages with a buffer of their own (not the image or the zero page) in buf */
+    int iClock; /* the page the clock hand looks at next */
+    int evictMiss; /* the FS_EVICT_* kinds of eviction the clock hand last got nowhere with */
+    sqlite3_uint64 nCompress; /* the number of pages compressed */
+    sqlite3_uint64 nCompressNs; /* the time spent compressing them */
+    sqlite3_uint64 nDecompress; /* the number of pages decompressed */
+    sqlite3_uint64 nDecompressNs; /* the time spent decompressing them */
+    int nZBytes; /* the bytes of the pages' compressed copies */
+    int iGuardFirst; /* the pages the current call is working on, which mustn't be compressed or spilled under it */
+    int iGuardLast;
+    sqlite3_uint64 nSpill; /* the number of pages spilled */
+    sqlite3_uint64 nFault; /* the number of spilled pages read back in */
+    sqlite3_uint64 nFaultNs; /* the time spent reading them */
+};
+
+/* a snapshot of one file, from fs_list() */
+struct fs_file_info {
+    char zName[MAX_PATHNAME+1];
+    const char* zVfs; /* the name of the file's instance */
+    unsigned int id;
+    sqlite3_int64 size; /* the length of the file */
+    sqlite3_int64 capacity; /* the bytes of page buffers the file holds, which may be more than its size */
+    sqlite3_int64 mapped; /* the bytes of those that are still served from the snapshot image or an adopted buffer */
+    sqlite3_int64 shared; /* the bytes of those that are shared with clones */
+    sqlite3_int64 holes; /* the bytes of pages that hold no buffer and read back as zeroes; not part of capacity */
+    sqlite3_int64 compressed; /* the bytes of pages that have a compressed copy */
+    sqlite3_int64 compressed_size; /* the bytes those copies take; part of capacity */
+    sqlite3_int64 spilled; /* the bytes of pages in the spill file; not part of capacity */
+    int ref;
+    int deleteOnClose;
+    sqlite3_uint64 nRead;
+    sqlite3_uint64 nReadBytes;
+    sqlite3_uint64 nWrite;
+    sqlite3_uint64 nWriteBytes;
+    sqlite3_uint64 nFetch;
+    sqlite3_uint64 nMutexEnter; /* acquisitions of the file's mutex; 0 unless composite's mutexes are installed */
+    sqlite3_uint64 nMutexContended;
+    sqlite3_uint64 nCompress;
+    sqlite3_uint64 nCompressNs;
+    sqlite3_uint64 nDecompress;
+    sqlite3_uint64 nDecompressNs;
+    sqlite3_uint64 nSpill;
+    sqlite3_uint64 nFault;
+    sqlite3_uint64 nFaultNs;
+};
+
+/* an entry in the file namespace, an open-addressing hash table; file is 0 for an empty slot */
+struct fs_slot {
+    unsigned int hash; /* a copy of file->hash, so probes don't have to touch the file */
+    struct fs_file* file;
+};
+
+/* shared inmemfs structs. these live in the shared region, which each process maps at a different address, so
+ * they refer to each other by their offset from the start of the region rather than by pointer. an offset of 0
+ * is never a page: the region header is there.
+ */
+#define SHMFS_MAX_FILES 64
+#define SHMFS_MAX_HOLDERS 16
+#define SHMFS_DIR_ENTRIES (FS_PAGE_SIZE / 8) /* the offsets that fit in a directory page */
+
+/* a process that has a file open, and what it holds on the file, so that it can be taken back if the process dies */
+struct shmfs_holder {
+    int pid; /* 0 for a free slot */
+    int nOpen; /* the process's open cFile's on the file */
+    int nShared; /* those of them that hold a SHARED or stronger lock */
+};
+
+/* a file in the shared region. its pages are found through a two-level directory: dir is the offset of a page of
+ * SHMFS_DIR_ENTRIES offsets of leaf pages, each of which holds the offsets of SHMFS_DIR_ENTRIES data pages. a 0
+ * offset anywhere is a hole that reads back as zeroes.
+ */
+struct shmfs_file {
+    char zName[MAX_PATHNAME+1];
+    unsigned int id;
+    pthread_mutex_t lock; /* a robust, process-shared mutex that guards the fields below it, up to used */
+    sqlite3_int64 len; /* the number of bytes of the file that contain valid data */
+    sqlite3_uint64 dir; /* the offset of the top-level directory page, or 0 if the file has no pages */
+    int eLock; /* the strongest lock any connection holds on the file: one of SQLITE_LOCK_* */
+    int nShared; /* the number of connections holding a SHARED or stronger lock */
+    int writerPid; /* the process of the connection whose lock is stronger than SHARED, or 0 */
+    struct shmfs_holder holders[SHMFS_MAX_HOLDERS];
+    int used; /* 1 if this entry is a file; guarded, like the rest, by the region's lock */
+    int ref; /* the number of open cFile's the file has, in every process */
+    int deleteOnClose;
+};
+
+struct shmfs_region {
+    char magic[8];
+    int version;
+    int state; /* SHMFS_STATE_* */
+    int initPid; /* the process that's setting up the region; another takes over if it dies before it's READY */
+    sqlite3_uint64 size; /* the size of the region, in bytes */
+    pthread_mutex_t lock; /* a robust, process-shared mutex that guards the page allocator and the files' namespace fields */
+    unsigned int nextId;
+    sqlite3_uint64 nextPage; /* the offset of the first page that has never been allocated */
+    sqlite3_uint64 freePages; /* the offset of the first free page, which holds the offset of the next, or 0 */
+    sqlite3_uint64 nFree; /* the number of pages on that list */
+    struct shmfs_file files[SHMFS_MAX_FILES];
 };
 
 /* methods for the in-memory FS used by composite */
-void fs_init();
+int fs_init();
 void fs_deinit();
-struct fs_file* fs_open(sqlite3_vfs* vfs, const char* zName);
+int fs_add_instance(struct composite_vfs_data* cVfs);
+#define FS_OPEN_EXISTS ((struct fs_file*)-1) /* fs_open()'s result when bExclusive is set and the file already exists */
+struct fs_file* fs_open(sqlite3_vfs* vfs, const char* zName, int pool, int bExclusive);
 void fs_close(struct fs_file* file);
 int fs_read(struct fs_file* file, sqlite3_int64 offset, int len, void* buf);
 int fs_write(struct fs_file* file, sqlite3_int64 offset, int len, const void* buf);
 int fs_truncate(struct fs_file* file, sqlite3_int64 size);
 void fs_size_hint(struct fs_file* file, sqlite3_int64 size);
+void* fs_fetch(struct fs_file* file, sqlite3_int64 offset, int len);
+void fs_unfetch(struct fs_file* file, sqlite3_int64 offset);
+int fs_shm_map(struct fs_file* file, int iRegion, int szRegion, int bExtend, volatile void** pp);
+void fs_shm_unmap(struct fs_file* file);
 int fs_exists(sqlite3_vfs* vfs, const char *zName);
 int fs_delete(sqlite3_vfs* vfs, const char *zName);
+int fs_list(struct fs_file_info** paInfo);
+int fs_clone(struct composite_vfs_data* cVfs, const char* zSrc, const char* zDst);
+#define FS_ADOPT_EXISTS (-1) /* fs_adopt()'s result when bReplace is 0 and the file already exists */
+int fs_adopt(struct composite_vfs_data* cVfs, const char* zName, const void* pData, sqlite3_int64 nData, void (*xFree)(void*), void* pFreeArg, int bReplace);
+int fs_adopt_file(struct composite_vfs_data* cVfs, const char* zName, const char* zPath, int bReplace);
+int fs_export(struct composite_vfs_data* cVfs, const char* zName, struct composite_fs_view* pView);
+void fs_export_release(struct composite_fs_view* pView);
+void fs_set_compression(struct fs_file* file, int nHotMax);
+int fs_set_budget(sqlite3_int64 nBytes, const char* zSpillPath);
+void fs_budget_stats(sqlite3_int64* pResident, sqlite3_int64* pBudget, sqlite3_int64* pSpilled, sqlite3_int64* pSpillFile);
+sqlite3_int64 fs_shrink(void);
+int fs_snapshot(struct composite_vfs_data* cVfs, const char* zPath);
+int fs_restore(struct composite_vfs_data* cVfs, const char* zPath);
+
+/* page compression; see os_composite_lz.c */
+int cLzCompress(const char* zSrc, int n, char* zDst, int max);
+int cLzDecompress(const char* zSrc, int n, char* zDst, int max);
 
 /* sqlite_io function prototypes */
 int cClose(sqlite3_file* file);
@@ -203,7 +736,7 @@ int cCheckReservedLock(sqlite3_file* file, int *pResOut);
 int cFileControl(sqlite3_file* file, int op, void *pArg);
 int cSectorSize(sqlite3_file* file);
 int cDeviceCharacteristics(sqlite3_file* file);
-int cShmMap(sqlite3_file* file, int iPg, int pgsz, int i, void volatile** v);
+int cShmMap(sqlite3_file* file, int iPg, int pgsz, int bExtend, void volatile** v);
 int cShmLock(sqlite3_file* file, int offset, int n, int flags);
 void cShmBarrier(sqlite3_file* file);
 int cShmUnmap(sqlite3_file* file, int deleteFlag);
@@ -220,7 +753,7 @@ int cSleep(sqlite3_vfs* vfs, int microseconds);
 int cGetLastError(sqlite3_vfs* vfs, int i, char *ch);
 int cCurrentTime(sqlite3_vfs* vfs, double* time);
 int cCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* time);
-void cVfsInit();
+int cVfsInit();
 void cVfsDeinit();
 
 /* sqlite_mutex function prototypes */
@@ -233,6 +766,9 @@ int cMutexTry(sqlite3_mutex *mutex);
 void cMutexLeave(sqlite3_mutex *mutex);
 int cMutexHeld(sqlite3_mutex *mutex);
 int cMutexNotheld(sqlite3_mutex *mutex);
+int cMutexInstalled(void);
+void cMutexCounters(sqlite3_mutex *mutex, sqlite3_uint64* pnEnter, sqlite3_uint64* pnContended);
+int cMutexStats(int mutexType, sqlite3_uint64* pnEnter, sqlite3_uint64* pnContended);
 
 /* sqlite_mem function prototypes */
 void *cMemMalloc(int sz);         /* Memory allocation function */
@@ -242,5 +778,28 @@ int cMemSize(void* mem);           /* Return the size of an allocation */
 int cMemRoundup(int sz);          /* Round up request size to allocation size */
 int cMemInit(void* pAppData);           /* Initialize the memory allocator */
 void cMemShutdown(void* pAppData);      /* Deinitialize the memory allocator */
+void cMemStats(struct composite_mem_stats* pStats);
+
+/* inmemfs pool function prototypes; see os_composite_pool.c */
+void* cPoolMalloc(int iPool, int sz);
+void cPoolFree(void* mem);
+int cPoolSize(void* mem);
+void* cPoolRealloc(int iPool, void* mem, int newSize);
+void cPoolSetBudget(int iPool, sqlite3_int64 nBytes);
+void cPoolStats(int iPool, struct composite_pool_stats* pStats);
+void cPoolShutdown(void);
+
+/* sqlite_pcache function prototypes */
+int cPcacheInit(void* pArg);
+void cPcacheShutdown(void* pArg);
+sqlite3_pcache* cPcacheCreate(int szPage, int szExtra, int bPurgeable);
+void cPcacheCachesize(sqlite3_pcache* pCache, int nCachesize);
+int cPcachePagecount(sqlite3_pcache* pCache);
+sqlite3_pcache_page* cPcacheFetch(sqlite3_pcache* pCache, unsigned int key, int createFlag);
+void cPcacheUnpin(sqlite3_pcache* pCache, sqlite3_pcache_page* pPage, int discard);
+void cPcacheRekey(sqlite3_pcache* pCache, sqlite3_pcache_page* pPage, unsigned int oldKey, unsigned int newKey);
+void cPcacheTruncate(sqlite3_pcache* pCache, unsigned int iLimit);
+void cPcacheDestroy(sqlite3_pcache* pCache);
+void cPcacheShrink(sqlite3_pcache* pCache);
 
 #endif
@@ -2,6 +2,8 @@
 
 #if SQLITE_OS_OTHER
 
+#include "os_composite.h"
+
 /* returns 1 if the given strings are equal, 0 if not */
 static int _fs_strequals(const char* s1, const char* s2, const int n) {
     int i = 0;
@@ -19,22 +21,151 @@ static int _fs_strequals(const char* s1, const char* s2, const int n) {
 }
 
 static void _fs_copydata(char* dst, const char* src, int n) {
+    cCopy(dst, src, (size_t)n);
+}
+
+static void _fs_zerodata(char* dst, int n) {
+    cZero(dst, (size_t)n);
+}
+
+#include <errno.h> /* for errno */
+#include <stdio.h> /* for fopen(), fwrite(), snprintf() and rename() */
+#include <string.h> /* for memcmp(), memcpy() and memset() */
+#include <fcntl.h> /* for open() */
+#include <unistd.h> /* for close(), pread(), pwrite() and unlink() */
+#include <sys/mman.h> /* for mmap() */
+#include <sys/stat.h> /* for fstat() */
+#include <time.h> /* for clock_gettime() */
+
+/* returns 1 if the n bytes at src are all zero, 0 if not. src is read a word at a time, eight words per test */
+static int _fs_iszero(const char* src, int n) {
     int i = 0;
+    for( ; i + 64 <= n; i += 64 ) {
+        sqlite3_uint64 w[8];
+        memcpy(w, &src[i], sizeof(w));
+        if( (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0 ) {
+            return 0;
+        }
+    }
+    for( ; i + 8 <= n; i += 8 ) {
+        sqlite3_uint64 w;
+        memcpy(&w, &src[i], sizeof(w));
+        if( w != 0 ) {
+            return 0;
+        }
+    }
     for( ; i < n; i++ ) {
-        dst[i] = src[i];
+        if( src[i] != 0 ) {
+            return 0;
+        }
     }
+
+    return 1;
 }
 
-#include "os_composite.h"
+#define INITIAL_PAGE_SLOTS 16 /* the number of entries a new file's page directory has room for */
+
+/* a page is only kept compressed if that saves at least a quarter of it */
+#define FS_COMPRESS_MAX_LEN (FS_PAGE_SIZE * 3 / 4)
+
+/* the number of pages spilled to make room when an allocation fails */
+#define FS_SPILL_ON_FAILURE 16
 
-#define INITIAL_BUF_DATA_SIZE (FS_SECTOR_SIZE*2)
+/* what _fs_evict() was doing when it got nowhere; see fs_file->evictMiss */
+#define FS_EVICT_COMPRESS 1
+#define FS_EVICT_SPILL 2
+
+/* fs_write() keeps a bit per page it writes data to on the stack, in this many words; longer writes use the heap */
+#define FS_WRITE_ZERO_WORDS 4
 
 /* the maximum possible size of a file; the largest value that can be represented with a signed 64-bit int
  * on 32-bit systems, the actual minimum will be much lower.
  */
 #define MAX_FILE_LEN ( (int64_t)(1L<<(sizeof(int64_t)-1)) )
 
-static struct fs_file* _fs_file_list = 0;
+/* the snapshot image written by fs_snapshot(). integers are in native byte order: an image is meant to be
+ * restored on the machine that wrote it.
+ *
+ *   struct fs_image_header
+ *   for each file: struct fs_image_file, then the file's name, nul-terminated and padded to 8 bytes
+ *   zeroes up to the next FS_PAGE_SIZE boundary (dir_size)
+ *   the pages of each file, in directory order
+ */
+#define FS_IMAGE_MAGIC "CFSIMG1"
+#define FS_IMAGE_VERSION 1
+
+struct fs_image_header {
+    char magic[8]; /* FS_IMAGE_MAGIC, nul-terminated */
+    unsigned int version; /* FS_IMAGE_VERSION */
+    unsigned int page_size; /* FS_PAGE_SIZE */
+    unsigned int nFiles;
+    unsigned int reserved;
+    sqlite3_uint64 dir_size; /* the offset of the first page; a multiple of FS_PAGE_SIZE */
+    sqlite3_uint64 nPages; /* the number of pages that follow the directory */
+};
+
+struct fs_image_file {
+    sqlite3_uint64 len; /* the length of the file */
+    sqlite3_uint64 first_page; /* the index of the file's first page among the image's pages */
+    sqlite3_uint64 nPages; /* the number of pages needed to hold len bytes */
+    unsigned int name_len; /* the length of the name, not counting the nul */
+    unsigned int reserved;
+};
+
+#define FS_IMAGE_ALIGN8(n) ( ((n) + 7) & ~(sqlite3_uint64)7 )
+
+#define INITIAL_NAMESPACE_SLOTS 64 /* the number of slots in a new namespace table; must be a power of two */
+
+/* every instance's file namespace (cVfs->slots) is an open-addressing hash table with linear probing, kept at most
+ * half full. a lookup for a name that doesn't exist (e.g. "does the -journal exist?") usually ends at the first
+ * empty slot after comparing one or two hashes, without comparing any names.
+ */
+
+/* the instances, starting with the default one, in the order they were added. an instance is never removed, so the
+ * list can be walked without a lock; its namespace is emptied by fs_deinit() and set up again by fs_init().
+ */
+static struct composite_vfs_data* _fs_instances = &composite_vfs_app_data;
+
+static unsigned int _fs_next_id = 0; /* file ids are handed out in order, starting at 1 */
+
+/* the page every hole points to. a hole is a page that has never been written, or was last written with
+ * nothing but zeroes; it's treated like a page of the snapshot image (read-only, shared without a count, and
+ * copied before it's written), so a pre-sized or mostly-empty file costs little more than its page directory.
+ */
+static const char _fs_zero_page[FS_PAGE_SIZE] __attribute__((aligned(16)));
+
+/* the snapshot image restored by fs_restore(); it stays mapped until fs_deinit() */
+static void* _fs_image = 0;
+static size_t _fs_image_size = 0;
+
+/* the memory budget: the most the files of every instance may hold (see cVfs->resident) before pages are spilled to
+ * the spill file; 0 for no limit.
+ */
+static sqlite3_int64 _fs_budget = 0;
+
+/* the spill file, which is unlinked as soon as it's created. each spilled page takes one FS_PAGE_SIZE slot; the
+ * slot bookkeeping is guarded by FS_SPILL_ENTER(), while a slot's contents belong to the page that holds it.
+ */
+static int _fs_spill_fd = -1;
+static unsigned int _fs_spill_nSlots = 0; /* the number of slots the file has grown to */
+static unsigned int* _fs_spill_aFree = 0; /* a stack of slots that are free again */
+static int _fs_spill_nFree = 0;
+static int _fs_spill_nFreeAlloc = 0;
+
+/* serializes access to the spill file's slot bookkeeping, which every instance shares; taken with a file's mutex held,
+ * never the other way around. the mutex is SQLITE_MUTEX_STATIC_VFS1, looked up once by fs_init().
+ */
+#if SQLITE_THREADSAFE
+static sqlite3_mutex* _fs_spill_mutex = 0;
+#define FS_SPILL_ENTER() sqlite3_mutex_enter( _fs_spill_mutex )
+#define FS_SPILL_LEAVE() sqlite3_mutex_leave( _fs_spill_mutex )
+#else
+#define FS_SPILL_ENTER()
+#define FS_SPILL_LEAVE()
+#endif
+
+static void _fs_file_free(struct fs_file* file);
+static void _fs_evict(struct fs_file* file, int nForce);
 
 /* private inmem fs functions */
 static void* _FS_MALLOC(int sz) {
@@ -42,10 +173,6 @@ static void* _FS_MALLOC(int sz) {
     return composite_mem_methods.xMalloc(sz);
 }
 
-static int _FS_MEMSIZE(void* mem) {
-    return composite_mem_methods.xSize(mem);
-}
-
 static void* _FS_REALLOC(void* mem, int newSize) {
     return composite_mem_methods.xRealloc(mem, newSize);
 }
@@ -54,6 +181,19 @@ static void _FS_FREE(void* mem) {
     composite_mem_methods.xFree(mem);
 }
 
+/* file data - page buffers, their compressed copies and page directories - comes from the file's pool instead */
+static void* _FS_DATA_MALLOC(struct fs_file* file, int sz) {
+    return cPoolMalloc(file->pool, sz);
+}
+
+static void* _FS_DATA_REALLOC(struct fs_file* file, void* mem, int newSize) {
+    return cPoolRealloc(file->pool, mem, newSize);
+}
+
+static void _FS_DATA_FREE(void* mem) {
+    cPoolFree(mem);
+}
+
 static char* _fs_copystring(const char* str, int n) {
     /* get the length of the string */
     int len;
@@ -66,58 +206,128 @@ static char* _fs_copystring(const char* str, int n) {
     }
 
     /* perform the copy */
-    int i = 0;
-    for( i = 0; i < len; i++ ) {
-        new_str[i] = str[i];
-    }
+    _fs_copydata(new_str, str, len);
     new_str[len] = 0;
 
     return new_str;
 }
 
-/* adds the given file to _fs_file_list */
-static void _fs_file_link(struct fs_file* file) {
-    file->next = _fs_file_list->next;
-    _fs_file_list->next = file;
+/* returns the FNV-1a hash of the first MAX_PATHNAME characters of zName */
+static unsigned int _fs_hash(const char* zName) {
+    unsigned int hash = 2166136261u;
+    int i;
+    for( i = 0; zName[i] != 0 && i < MAX_PATHNAME; i++ ) {
+        hash ^= (unsigned char)zName[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* puts the file in the first free slot of its probe sequence; the table must have a free slot */
+static void _fs_slot_insert(struct fs_slot* slots, int nSlots, unsigned int hash, struct fs_file* file) {
+    const int mask = nSlots - 1;
+    int i = hash & mask;
+    while( slots[i].file != 0 ) {
+        i = (i + 1) & mask;
+    }
+
+    slots[i].hash = hash;
+    slots[i].file = file;
+}
+
+/* adds the given file to its instance's namespace, doubling the table if it would become more than half full
+ * returns 1 on success, 0 on failure
+ */
+static int _fs_file_link(struct fs_file* file) {
+    struct composite_vfs_data* cVfs = file->cVfs;
+    if( (cVfs->nFiles + 1) * 2 > cVfs->nSlots ) {
+        const int new_nSlots = cVfs->nSlots * 2;
+        struct fs_slot* new_slots = _FS_MALLOC( new_nSlots * sizeof(struct fs_slot) );
+        if( new_slots == 0 ) {
+            return 0;
+        }
+
+        int i;
+        for( i = 0; i < new_nSlots; i++ ) {
+            new_slots[i].file = 0;
+        }
+
+        /* rehashing only needs the stored hashes; names are never rehashed */
+        for( i = 0; i < cVfs->nSlots; i++ ) {
+            if( cVfs->slots[i].file ) {
+                _fs_slot_insert(new_slots, new_nSlots, cVfs->slots[i].hash, cVfs->slots[i].file);
+            }
+        }
+
+        _FS_FREE( cVfs->slots );
+        cVfs->slots = new_slots;
+        cVfs->nSlots = new_nSlots;
+    }
+
+    _fs_slot_insert(cVfs->slots, cVfs->nSlots, file->hash, file);
+    cVfs->nFiles++;
+    return 1;
 }
 
-/* removes the given file from _fs_file_list */
+/* removes the given file from its instance's namespace */
 static void _fs_file_unlink(struct fs_file* file) {
-    struct fs_file* prev = _fs_file_list;
-    struct fs_file* next = _fs_file_list->next;
+    struct composite_vfs_data* cVfs = file->cVfs;
+    struct fs_slot* slots = cVfs->slots;
+    const int mask = cVfs->nSlots - 1;
+    int i = file->hash & mask;
+    while( slots[i].file != file ) {
+        if( slots[i].file == 0 ) {
+            return; /* the file isn't in the namespace */
+        }
+        i = (i + 1) & mask;
+    }
+
+    /* empty the slot, then shift later entries of the probe run back into the hole so that
+     * lookups can keep stopping at the first empty slot (no tombstones are needed)
+     */
+    slots[i].file = 0;
+    cVfs->nFiles--;
 
-    while( next != 0 ) {
-        if( next == file ) {
-            prev->next = next->next;
-            file->next = 0;
+    int j = i;
+    for( ;; ) {
+        j = (j + 1) & mask;
+        if( slots[j].file == 0 ) {
             break;
         }
 
-        prev = next;
-        next = next->next;
+        /* the entry at j can fill the hole at i unless its home slot lies cyclically in (i, j] */
+        const int home = slots[j].hash & mask;
+        const int in_range = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if( !in_range ) {
+            slots[i] = slots[j];
+            slots[j].file = 0;
+            i = j;
+        }
     }
 }
 
-/* searches _fs_file_list for the file with the given name, or 0 if it doesn't exist */
-static struct fs_file* _fs_find_file(sqlite3_vfs* vfs, const char* zName) {
-    struct fs_file* file;
-    for( file = _fs_file_list->next; file != 0; file = file->next ) {
-        if( _fs_strequals(file->zName, zName, MAX_PATHNAME) ) {
-            return file;
+/* searches the instance's namespace for the file with the given name and hash, or 0 if it doesn't exist */
+static struct fs_file* _fs_find_file(struct composite_vfs_data* cVfs, const char* zName, unsigned int hash) {
+    const struct fs_slot* slots = cVfs->slots;
+    const int mask = cVfs->nSlots - 1;
+    int i = hash & mask;
+    for( ; slots[i].file != 0; i = (i + 1) & mask ) {
+        if( slots[i].hash == hash && _fs_strequals(slots[i].file->zName, zName, MAX_PATHNAME) ) {
+            return slots[i].file;
         }
     }
 
     return 0;
 }
 
-static struct fs_file* _fs_file_alloc(sqlite3_vfs* vfs, const char *zName) {
-    struct composite_vfs_data* cVfs = (struct composite_vfs_data*)(vfs->pAppData);
+static struct fs_file* _fs_file_alloc(struct composite_vfs_data* cVfs, const char *zName, unsigned int hash, int pool) {
     struct fs_file* file = _FS_MALLOC( sizeof(struct fs_file) );
     if( file == 0 )
         return 0;
     
-    char* buf = _FS_MALLOC( INITIAL_BUF_DATA_SIZE );
-    if( buf == 0 ) {
+    struct fs_page* pages = cPoolMalloc( pool, INITIAL_PAGE_SLOTS * sizeof(struct fs_page) );
+    if( pages == 0 ) {
         _FS_FREE(file);
         return 0;
     }
@@ -125,186 +335,1940 @@ static struct fs_file* _fs_file_alloc(sqlite3_vfs* vfs, const char *zName) {
     char* zNameCopy = _fs_copystring(zName, MAX_PATHNAME);
     if( zNameCopy == 0 ) {
         _FS_FREE(file);
-        _FS_FREE(buf);
+        _FS_DATA_FREE(pages);
         return 0;
     }
     
     file->cVfs = cVfs;
-    file->next = 0;
+    file->pool = pool;
     file->zName = zNameCopy;
-    file->data.buf = buf;
+    file->hash = hash;
+    file->id = __atomic_add_fetch(&_fs_next_id, 1, __ATOMIC_RELAXED);
+    file->data.pages = pages;
+    file->data.nPages = 0;
+    file->data.nSlots = INITIAL_PAGE_SLOTS;
     file->data.len = 0;
+    file->data.truncated = -1;
+    file->data.peak = 0;
     file->ref = 0;
     file->deleteOnClose = 0;
+    file->shm = 0;
+    file->retired = 0;
+    file->eLock = SQLITE_LOCK_NONE;
+    file->nShared = 0;
+    file->mutex = 0;
+    file->nRead = 0;
+    file->nReadBytes = 0;
+    file->nWrite = 0;
+    file->nWriteBytes = 0;
+    file->nFetch = 0;
+    file->nHotMax = 0;
+    file->nHot = 0;
+    file->iClock = 0;
+    file->evictMiss = 0;
+    file->nCompress = 0;
+    file->nCompressNs = 0;
+    file->nDecompress = 0;
+    file->nDecompressNs = 0;
+    file->nZBytes = 0;
+    file->iGuardFirst = 0;
+    file->iGuardLast = -1;
+    file->nSpill = 0;
+    file->nFault = 0;
+    file->nFaultNs = 0;
 
-    _fs_file_link(file);
+    #if SQLITE_THREADSAFE
+        file->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+        if( file->mutex == 0 ) {
+            _fs_file_free(file);
+            return 0;
+        }
+    #endif
+
+    if( _fs_file_link(file) == 0 ) {
+        _fs_file_free(file);
+        return 0;
+    }
 
     return file;
 }
 
+/* free a wal-index and all of its regions */
+static void _fs_shm_free(struct fs_shm* shm) {
+    int i;
+    for( i = 0; i < shm->nRegion; i++ ) {
+        _FS_FREE( (void*)shm->regions[i] );
+    }
+
+    if( shm->regions ) {
+        _FS_FREE( (void*)shm->regions );
+    }
+
+    _FS_FREE( shm );
+}
+
+/* drops a reference to an adopted buffer, handing it back once nothing points into it */
+static void _fs_extern_release(struct fs_extern* ext) {
+    if( __atomic_sub_fetch(&ext->nRef, 1, __ATOMIC_ACQ_REL) > 0 ) {
+        return;
+    }
+
+    if( ext->xFree ) {
+        ext->xFree(ext->p);
+    }
+    _FS_FREE( ext );
+}
+
+/* drops a reference to a page buffer, freeing it once no page points to it.
+ * buffers in the snapshot image are never freed, and adopted buffers are only released as a whole.
+ */
+static void _fs_buf_release(char* buf, int* shared, int mapped, struct fs_extern* ext) {
+    if( ext ) {
+        _fs_extern_release(ext);
+    }
+
+    if( mapped ) {
+        return;
+    }
+
+    if( shared ) {
+        if( __atomic_sub_fetch(shared, 1, __ATOMIC_ACQ_REL) > 0 ) {
+            return; /* a clone still points to it */
+        }
+        _FS_FREE( shared );
+    }
+
+    _FS_DATA_FREE( buf );
+}
+
+/* 1 if buf is a buffer the page holds (on its own or with clones), and so counts towards file->nHot */
+static int _fs_page_is_hot(const struct fs_page* page) {
+    return page->buf != 0 && !page->mapped;
+}
+
+/* forgets that _fs_evict() got nowhere, now that a page it passed over may be usable */
+static void _fs_evict_reset(struct fs_file* file) {
+    file->evictMiss = 0;
+}
+
+static void _fs_hot_add(struct fs_file* file, int n) {
+    if( n > 0 ) {
+        _fs_evict_reset(file);
+    }
+    file->nHot += n;
+    __atomic_add_fetch(&file->cVfs->resident, (sqlite3_int64)n * FS_PAGE_SIZE, __ATOMIC_RELAXED);
+}
+
+static void _fs_zbytes_add(struct fs_file* file, int n) {
+    file->nZBytes += n;
+    __atomic_add_fetch(&file->cVfs->resident, (sqlite3_int64)n, __ATOMIC_RELAXED);
+}
+
+/* returns the bytes of page data the files of every instance hold */
+static sqlite3_int64 _fs_resident() {
+    sqlite3_int64 resident = 0;
+    const struct composite_vfs_data* cVfs;
+    for( cVfs = _fs_instances; cVfs; cVfs = __atomic_load_n(&cVfs->next, __ATOMIC_ACQUIRE) ) {
+        resident += __atomic_load_n(&cVfs->resident, __ATOMIC_RELAXED);
+    }
+    return resident;
+}
+
+/* returns the number of pages that should be spilled to get back under the memory budget */
+static int _fs_over_budget() {
+    const sqlite3_int64 budget = __atomic_load_n(&_fs_budget, __ATOMIC_RELAXED);
+    if( budget == 0 || __atomic_load_n(&_fs_spill_fd, __ATOMIC_RELAXED) < 0 ) {
+        return 0;
+    }
+
+    const sqlite3_int64 excess = _fs_resident() - budget;
+    return (excess > 0) ? (int)( (excess + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE ) : 0;
+}
+
+/* returns a free slot in the spill file */
+static unsigned int _fs_spill_slot_alloc() {
+    FS_SPILL_ENTER();
+    const unsigned int slot = (_fs_spill_nFree > 0) ? _fs_spill_aFree[ --_fs_spill_nFree ] : _fs_spill_nSlots++;
+    FS_SPILL_LEAVE();
+    return slot;
+}
+
+/* returns a slot to the free stack; if the stack can't grow, the slot is lost until the spill file is closed */
+static void _fs_spill_slot_free(unsigned int slot) {
+    FS_SPILL_ENTER();
+    if( _fs_spill_nFree == _fs_spill_nFreeAlloc ) {
+        const int nAlloc = _fs_spill_nFreeAlloc ? _fs_spill_nFreeAlloc * 2 : 64;
+        unsigned int* aFree = _FS_REALLOC(_fs_spill_aFree, nAlloc * sizeof(unsigned int));
+        if( aFree ) {
+            _fs_spill_aFree = aFree;
+            _fs_spill_nFreeAlloc = nAlloc;
+        }
+    }
+    if( _fs_spill_nFree < _fs_spill_nFreeAlloc ) {
+        _fs_spill_aFree[ _fs_spill_nFree++ ] = slot;
+    }
+    FS_SPILL_LEAVE();
+}
+
+/* reads or writes the page in slot; returns 1 on success, 0 on failure */
+static int _fs_spill_io(unsigned int slot, char* buf, int bWrite) {
+    const off_t offset = (off_t)slot * FS_PAGE_SIZE;
+    const ssize_t n = bWrite ? pwrite(_fs_spill_fd, buf, FS_PAGE_SIZE, offset) : pread(_fs_spill_fd, buf, FS_PAGE_SIZE, offset);
+    return n == FS_PAGE_SIZE;
+}
+
+/* releases all of a page's storage: its buffers and its spill slot */
+static void _fs_page_release(struct fs_file* file, struct fs_page* page) {
+    if( _fs_page_is_hot(page) ) {
+        _fs_hot_add(file, -1);
+    }
+    if( page->buf ) {
+        _fs_buf_release(page->buf, page->shared, page->mapped, page->ext);
+    }
+    if( page->zbuf ) {
+        _fs_zbytes_add(file, -page->zlen);
+        _FS_DATA_FREE( page->zbuf );
+    }
+    if( page->spill ) {
+        _fs_spill_slot_free( (unsigned int)(page->spill - 1) );
+    }
+}
+
+/* allocates a page buffer. if memory has run out and there's a spill file, some of the file's pages are spilled
+ * to make room first.
+ */
+static char* _fs_page_alloc(struct fs_file* file) {
+    char* buf = _FS_DATA_MALLOC( file, FS_PAGE_SIZE );
+    if( buf == 0 && _fs_spill_fd >= 0 ) {
+        _fs_evict(file, FS_SPILL_ON_FAILURE);
+        buf = _FS_DATA_MALLOC( file, FS_PAGE_SIZE );
+    }
+    return buf;
+}
+
+/* releases the buffers that were replaced while page iPage was pinned, or every one if iPage is -1 */
+static void _fs_release_retired(struct fs_file* file, int iPage) {
+    struct fs_retired** pp = &file->retired;
+    while( *pp ) {
+        struct fs_retired* retired = *pp;
+        if( iPage != -1 && retired->iPage != iPage ) {
+            pp = &retired->next;
+            continue;
+        }
+
+        *pp = retired->next;
+        _fs_buf_release(retired->buf, retired->shared, retired->ext != 0, retired->ext);
+        _FS_FREE( retired );
+    }
+}
+
 /* free the file and all of its blocks */
 static void _fs_file_free(struct fs_file* file) {
+    if( file->shm ) {
+        _fs_shm_free( file->shm );
+        file->shm = 0;
+    }
+
     if( file->zName ) {
         _FS_FREE( (char*)file->zName );
         file->zName = 0;
     }
 
-    if( file->data.buf ) {
-        _FS_FREE( file->data.buf );
-        file->data.buf = 0;
+    if( file->data.pages ) {
+        int i;
+        for( i = 0; i < file->data.nPages; i++ ) {
+            _fs_page_release( file, &file->data.pages[i] );
+        }
+
+        _FS_DATA_FREE( file->data.pages );
+        file->data.pages = 0;
+        file->data.nPages = 0;
     }
 
+    _fs_release_retired(file, -1);
+
+    #if SQLITE_THREADSAFE
+        if( file->mutex ) {
+            sqlite3_mutex_free( file->mutex );
+            file->mutex = 0;
+        }
+    #endif
+
     _FS_FREE( file );
 }
 
-/* makes sure that there is sz bytes of space in file's data buffer
+/* makes sure that the page directory has room for nSlots entries.
+ * only the directory itself is resized; the page buffers it points to never move,
+ * so pointers handed out by fs_fetch() stay valid.
  * returns 1 on success, 0 on failure
  */
-static int _fs_data_ensure_capacity(struct fs_file* file, sqlite3_int64 sz) {
-    int old_size = _FS_MEMSIZE(file->data.buf);
-    if( old_size < sz ) {
-        int new_size = old_size * 2;
-        if( new_size < sz ) {
-            new_size = sz;
+static int _fs_data_ensure_slots(struct fs_file* file, int nSlots) {
+    if( file->data.nSlots < nSlots ) {
+        int new_slots = file->data.nSlots * 2;
+        if( new_slots < nSlots ) {
+            new_slots = nSlots;
         }
 
-        void* new_buf = _FS_REALLOC(file->data.buf, new_size);
-        if( new_buf == 0 ) {
+        struct fs_page* new_pages = _FS_DATA_REALLOC(file, file->data.pages, new_slots * sizeof(struct fs_page));
+        if( new_pages == 0 && _fs_spill_fd >= 0 ) {
+            _fs_evict(file, FS_SPILL_ON_FAILURE);
+            new_pages = _FS_DATA_REALLOC(file, file->data.pages, new_slots * sizeof(struct fs_page));
+        }
+        if( new_pages == 0 ) {
             return 0;
-        } else {
-            file->data.buf = new_buf;
         }
+
+        file->data.pages = new_pages;
+        file->data.nSlots = new_slots;
     }
 
     return 1;
 }
 
-/* inmem fs functions */
-void fs_init() {
-    _fs_file_list = _FS_MALLOC( sizeof(struct fs_file) );
-    _fs_file_list->zName = 0;
-    _fs_file_list->data.buf = 0;
-    _fs_file_list->next = 0;
+static int _fs_page_is_hole(const struct fs_page* page) {
+    return page->buf == _fs_zero_page;
 }
 
-void fs_deinit() {
-    /* free all files from memory */
-    struct fs_file* file = _fs_file_list->next;
-    for( ; file != 0; ) {
-        void* next = file->next;
-        _fs_file_free(file);
-        file = next;
-    }
+static void _fs_page_init_hole(struct fs_page* page) {
+    page->buf = (char*)_fs_zero_page;
+    page->pin = 0;
+    page->mapped = 1;
+    page->shared = 0;
+    page->zbuf = 0;
+    page->zlen = 0;
+    page->recent = 0;
+    page->spill = 0;
+    page->ext = 0;
+}
 
-    /* clear the file list */
-    _FS_FREE( _fs_file_list );
-    _fs_file_list = 0;
+static sqlite3_uint64 _fs_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sqlite3_uint64)ts.tv_sec * 1000000000 + (sqlite3_uint64)ts.tv_nsec;
 }
 
-struct fs_file* fs_open(sqlite3_vfs* vfs, const char* zName) {
-    //TODO make this atomic
-    //atomic {
-    struct fs_file* file = _fs_find_file(vfs, zName);
-    if( file == 0 ) {
-        file = _fs_file_alloc(vfs, zName);
+/* brings a page that's only held compressed or spilled back into a buffer of its own. a compressed copy is kept,
+ * so the page can go cold again without being recompressed, as long as it isn't written; a spill slot is freed.
+ * returns 1 on success, 0 on failure
+ */
+static int _fs_page_load(struct fs_file* file, struct fs_page* page) {
+    page->recent = 1;
+    if( page->buf ) {
+        return 1;
     }
-    //}
-    if( file == 0 ) {
+
+    char* buf = _fs_page_alloc(file);
+    if( buf == 0 ) {
         return 0;
     }
 
-    file->ref++;
-    return file;
+    const sqlite3_uint64 start = _fs_now_ns();
+    if( page->zbuf ) {
+        if( cLzDecompress(page->zbuf, page->zlen, buf, FS_PAGE_SIZE) != FS_PAGE_SIZE ) {
+            _FS_DATA_FREE( buf );
+            return 0;
+        }
+        file->nDecompressNs += _fs_now_ns() - start;
+        file->nDecompress++;
+    } else {
+        if( _fs_spill_io( (unsigned int)(page->spill - 1), buf, 0 ) == 0 ) {
+            _FS_DATA_FREE( buf );
+            return 0;
+        }
+        _fs_spill_slot_free( (unsigned int)(page->spill - 1) );
+        page->spill = 0;
+        file->nFaultNs += _fs_now_ns() - start;
+        file->nFault++;
+    }
+
+    page->buf = buf;
+    _fs_hot_add(file, 1);
+    return 1;
 }
 
-void fs_close(struct fs_file* file) {
-    //TODO make this threadsafe
-    file->ref--;
-    if( file->ref == 0 && file->deleteOnClose ) { /* have we been waiting to delete this file? */
-        _fs_file_unlink(file); //unlink the file from the list of files
-        _fs_file_free(file); //free the memory the file used
+/* drops the decompressed copy of a page, compressing it first if it doesn't have a compressed copy yet.
+ * returns 1 on success, or 0 if the page doesn't compress well
+ */
+static int _fs_page_compress(struct fs_file* file, struct fs_page* page) {
+    if( page->zbuf == 0 ) {
+        char tmp[FS_COMPRESS_MAX_LEN];
+        const sqlite3_uint64 start = _fs_now_ns();
+        const int zlen = cLzCompress(page->buf, FS_PAGE_SIZE, tmp, sizeof(tmp));
+        file->nCompressNs += _fs_now_ns() - start;
+        file->nCompress++;
+
+        char* zbuf = zlen ? _FS_DATA_MALLOC( file, zlen ) : 0;
+        if( zbuf == 0 ) {
+            return 0;
+        }
+
+        _fs_copydata(zbuf, tmp, zlen);
+        page->zbuf = zbuf;
+        page->zlen = zlen;
+        _fs_zbytes_add(file, zlen);
     }
-}
 
-/* returns the number of bytes read, or -1 if an error occurred. short reads are allowed. */
-int fs_read(struct fs_file* file, sqlite3_int64 offset, int len, void* buf) {
-    //TODO check locks
+    _FS_DATA_FREE( page->buf );
+    page->buf = 0;
+    _fs_hot_add(file, -1);
+    return 1;
+}
 
-    /* perform sanity checks on offset and len */
-    if( offset < 0 || len < 0 ) {
-        return -1;
+/* writes a page out to the spill file and releases its buffers. returns 1 on success, 0 on failure */
+static int _fs_page_spill(struct fs_file* file, struct fs_page* page) {
+    char tmp[FS_PAGE_SIZE];
+    char* data = page->buf;
+    if( data == 0 ) {
+        if( cLzDecompress(page->zbuf, page->zlen, tmp, FS_PAGE_SIZE) != FS_PAGE_SIZE ) {
+            return 0;
+        }
+        data = tmp;
     }
-    
-    /* determine the number of bytes to read */
-    sqlite3_int64 end_offset = offset + (sqlite3_int64)len;
-    if( end_offset > file->data.len ) end_offset = file->data.len;
-    int bytes_read = (int)(end_offset - offset);
 
-    /* copy the bytes into the buffer */
-    if( bytes_read > 0 ) {
-        _fs_copydata( (char*)buf, (const char*)(&file->data.buf[offset]), bytes_read);
+    const unsigned int slot = _fs_spill_slot_alloc();
+    if( _fs_spill_io(slot, data, 1) == 0 ) {
+        _fs_spill_slot_free(slot);
+        return 0;
     }
 
-    return bytes_read;
+    _fs_page_release(file, page);
+    page->buf = 0;
+    page->zbuf = 0;
+    page->zlen = 0;
+    page->spill = (int)slot + 1;
+    file->nSpill++;
+    return 1;
 }
 
-/* returns the number of bytes written, or -1 if an error occurred. partial writes are not allowed. */
-int fs_write(struct fs_file* file, sqlite3_int64 offset, int len, const void* buf) {
-    //TODO check locks -- this should occur atomically
+/* sets the pages [first, last] that _fs_evict() must leave alone while the current call works on them */
+static void _fs_guard(struct fs_file* file, int first, int last) {
+    file->iGuardFirst = first;
+    file->iGuardLast = last;
+}
 
-    /* perform sanity checks on offset and len */
-    if( offset < 0 || len < 0 ) {
-        return -1;
+/* the clock hand: sweeps the page directory for pages to spill or compress, giving each recently used page a second
+ * chance. pinned pages, pages shared with a clone, holes, image pages and the pages the current call is working on
+ * (iGuardFirst to iGuardLast) are passed over. nForce pages are spilled when memory has run out, or as many as it
+ * takes to get back under the memory budget; otherwise pages are compressed while the file has more than nHotMax
+ * decompressed. the budget is checked once, on entry, since that sums every instance's resident bytes.
+ *
+ * the sweep gives up after two turns if there aren't enough pages it can use, or after one if there isn't a single
+ * one. if it got nowhere, the file remembers (evictMiss), and later calls return at once until one of its pages may
+ * have become usable (see _fs_evict_reset()).
+ */
+static void _fs_evict(struct fs_file* file, int nForce) {
+    int nSpill = (nForce > 0) ? nForce : _fs_over_budget();
+    if( nSpill == 0 && !(file->nHotMax > 0 && file->nHot > file->nHotMax) ) {
+        return;
     }
-
-    /* ensure that our buffer is large enough to perform the write */
-    sqlite3_int64 end_offset = offset + (sqlite3_int64)len;
-    if( _fs_data_ensure_capacity(file, end_offset) == 0 ) {
-        return -1; /* we don't have enough memory to perform the write */
+    if( file->evictMiss & ((nSpill > 0) ? FS_EVICT_SPILL : FS_EVICT_COMPRESS) ) {
+        return;
     }
 
-    /* perform the write */
-    _fs_copydata( (char*)(&file->data.buf[offset]), (const char*)buf, len );
+    int nCandidate = 0; /* the pages seen that could have been spilled or compressed */
+    int nEvicted = 0;
+    int steps;
+    for( steps = 0; steps < file->data.nPages * 2; steps++ ) {
+        const int bSpill = nSpill > 0;
+        const int bCompress = file->nHotMax > 0 && file->nHot > file->nHotMax;
+        if( !bSpill && !bCompress ) {
+            return;
+        }
+        if( steps == file->data.nPages && nCandidate == 0 ) {
+            break;
+        }
 
-    /* adjust file->data.len */
-    file->data.len = end_offset;
+        if( file->iClock >= file->data.nPages ) {
+            file->iClock = 0;
+        }
 
-    return len;
-}
+        const int i = file->iClock++;
+        struct fs_page* page = &file->data.pages[i];
+        if( page->mapped || page->pin > 0 || page->shared || (page->buf == 0 && (page->zbuf == 0 || !bSpill))
+            || (i >= file->iGuardFirst && i <= file->iGuardLast) ) {
+            continue;
+        }
+        nCandidate++;
 
-/* returns 1 on success, 0 on failure */
-int fs_truncate(struct fs_file* file, sqlite3_int64 size) {
-    if( size < file->data.len ) {
-        file->data.len = size; //TODO reclaim this memory
+        if( page->recent ) {
+            page->recent = 0;
+            continue;
+        }
+
+        if( bSpill ) {
+            if( _fs_page_spill(file, page) ) {
+                nSpill--;
+                nEvicted++;
+                continue;
+            }
+        } else if( _fs_page_compress(file, page) ) {
+            nEvicted++;
+            continue;
+        }
+
+        page->recent = 1; /* it didn't spill or compress; pass it over for a turn */
+    }
+
+    /* the pages the current call is working on may be usable once it's done */
+    if( nEvicted == 0 && file->iGuardFirst > file->iGuardLast ) {
+        file->evictMiss |= (nSpill > 0) ? FS_EVICT_SPILL : FS_EVICT_COMPRESS;
     }
-    return 1;
 }
 
-void fs_size_hint(struct fs_file* file, sqlite3_int64 size) {
-    _fs_data_ensure_capacity(file, size);
+/* shrinks the page directory once it's less than a quarter full; a failure just leaves it larger */
+static void _fs_data_shrink_slots(struct fs_file* file) {
+    if( file->data.nSlots <= INITIAL_PAGE_SLOTS || file->data.nPages > file->data.nSlots / 4 ) {
+        return;
+    }
+
+    int new_slots = file->data.nPages * 2;
+    if( new_slots < INITIAL_PAGE_SLOTS ) {
+        new_slots = INITIAL_PAGE_SLOTS;
+    }
+
+    struct fs_page* new_pages = _FS_DATA_REALLOC(file, file->data.pages, new_slots * sizeof(struct fs_page));
+    if( new_pages ) {
+        file->data.pages = new_pages;
+        file->data.nSlots = new_slots;
+    }
 }
 
-/* returns 1 if the given file exists, 0 if it doesn't */
-int fs_exists(sqlite3_vfs* vfs, const char *zName) {
-    struct fs_file* file = _fs_find_file(vfs, zName);
-    return (file != 0);
+/* the number of pages needed to hold sz bytes */
+static sqlite3_int64 _fs_data_pages_for(sqlite3_int64 sz) {
+    return (sz + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE;
 }
 
-/* returns 1 on success, 0 on failure */
-int fs_delete(sqlite3_vfs* vfs, const char *zName) {
-    struct fs_file* file = _fs_find_file(vfs, zName);
-    if( file == 0 ) { /* the file doesn't exist */
-        return 1;
+/* makes sure that there is sz bytes of space in file's pages
+ * new pages are holes, so this only allocates page directory entries; existing data is never copied.
+ * returns 1 on success, 0 on failure
+ */
+static int _fs_data_ensure_capacity(struct fs_file* file, sqlite3_int64 sz) {
+    const sqlite3_int64 nPages = _fs_data_pages_for(sz);
+    if( nPages > 0x7fffffff ) {
+        return 0; /* the page directory is indexed with an int */
     }
 
-    if( file->ref == 0 ) { /* no one has this file open currently */
-        _fs_file_unlink(file);
-        _fs_file_free(file);
-    } else { /* the file is open somewhere */
-        file->deleteOnClose = 1; /* when this file is closed, it will be deleted */
+    if( _fs_data_ensure_slots(file, (int)nPages) == 0 ) {
+        return 0;
+    }
+
+    while( file->data.nPages < nPages ) {
+        _fs_page_init_hole( &file->data.pages[ file->data.nPages ] );
+        file->data.nPages++;
     }
 
     return 1;
 }
 
+/* gives page i a buffer of its own, so it can be written: holes get a zeroed buffer, and pages in the snapshot
+ * image, or still shared with a clone, are copied.
+ * SQLite only reads through pointers from fs_fetch(), and gets a pointer to the new buffer on its next fetch,
+ * so a pinned page's old buffer just has to stay valid until the page is unpinned: the image and the zero page
+ * are never unmapped while SQLite is running, and a shared or adopted buffer is kept on the retired list.
+ * returns 1 on success, 0 on failure
+ */
+static int _fs_page_make_writable(struct fs_file* file, int i) {
+    struct fs_page* page = &file->data.pages[i];
+
+    /* the compressed copy goes stale as soon as the page is written */
+    if( _fs_page_load(file, page) == 0 ) {
+        return 0;
+    }
+    if( page->zbuf ) {
+        _fs_zbytes_add(file, -page->zlen);
+        _FS_DATA_FREE( page->zbuf );
+        page->zbuf = 0;
+        page->zlen = 0;
+    }
+
+    /* once every clone has written or dropped its copy, the buffer is ours again. nothing can start sharing
+     * it meanwhile: only its last owner can clone it, and that's us, under our lock.
+     */
+    if( page->shared && __atomic_load_n(page->shared, __ATOMIC_ACQUIRE) == 1 ) {
+        _FS_FREE( page->shared );
+        page->shared = 0;
+        _fs_evict_reset(file);
+    }
+
+    if( !page->mapped && !page->shared ) {
+        return 1;
+    }
+
+    char* buf = _fs_page_alloc(file);
+    if( buf == 0 ) {
+        return 0;
+    }
+    if( _fs_page_is_hole(page) ) {
+        _fs_zerodata(buf, FS_PAGE_SIZE);
+    } else {
+        _fs_copydata(buf, page->buf, FS_PAGE_SIZE);
+    }
+
+    if( page->pin > 0 && (!page->mapped || page->ext) ) {
+        struct fs_retired* retired = _FS_MALLOC( sizeof(struct fs_retired) );
+        if( retired == 0 ) {
+            _FS_DATA_FREE( buf );
+            return 0;
+        }
+
+        retired->buf = page->buf;
+        retired->shared = page->shared;
+        retired->ext = page->ext;
+        retired->iPage = i;
+        retired->next = file->retired;
+        file->retired = retired;
+    } else {
+        _fs_buf_release(page->buf, page->shared, page->mapped, page->ext);
+    }
+
+    if( !_fs_page_is_hot(page) ) {
+        _fs_hot_add(file, 1);
+    }
+    page->buf = buf;
+    page->mapped = 0;
+    page->shared = 0;
+    page->ext = 0;
+    return 1;
+}
+
+/* turns page i, which must not be pinned, back into a hole, releasing its buffer */
+static void _fs_page_make_hole(struct fs_file* file, int i) {
+    struct fs_page* page = &file->data.pages[i];
+    _fs_page_release(file, page);
+    _fs_page_init_hole(page);
+}
+
+/* releases every page past the first nKeep, and shrinks the page directory to match. a pinned page keeps its
+ * buffer (SQLite may still read through a pointer into it), and so does its directory entry, so the unpinned
+ * pages before it become holes instead of being dropped.
+ * returns the number of bytes of buffers the file let go of
+ */
+static sqlite3_int64 _fs_data_release_tail(struct fs_file* file, sqlite3_int64 nKeep) {
+    sqlite3_int64 released = 0;
+    int i;
+    for( i = file->data.nPages - 1; i >= nKeep; i-- ) {
+        struct fs_page* page = &file->data.pages[i];
+        if( page->pin > 0 ) {
+            continue;
+        }
+
+        if( _fs_page_is_hot(page) ) {
+            released += FS_PAGE_SIZE;
+        }
+        if( page->zbuf ) {
+            released += page->zlen;
+        }
+
+        if( i == file->data.nPages - 1 ) {
+            _fs_page_release(file, page);
+            file->data.nPages--;
+        } else {
+            _fs_page_make_hole(file, i);
+        }
+    }
+
+    _fs_data_shrink_slots(file);
+    return released;
+}
+
+/* returns 1 if a write that ends at end, with a gap of zeroes from gap_start up to it, replaces every byte of page i */
+static int _fs_write_covers_page(sqlite3_int64 i, sqlite3_int64 gap_start, sqlite3_int64 end) {
+    const sqlite3_int64 page_start = i * FS_PAGE_SIZE;
+    return page_start >= gap_start && page_start + FS_PAGE_SIZE <= end;
+}
+
+/* sets up an instance's empty namespace and its mutexes. the default instance uses SQLite's static VFS mutexes,
+ * which also serialize every other instance's fs_add_instance(); the others get mutexes of their own.
+ * returns SQLITE_OK or SQLITE_NOMEM
+ */
+static int _fs_instance_init(struct composite_vfs_data* cVfs) {
+    cVfs->slots = _FS_MALLOC( INITIAL_NAMESPACE_SLOTS * sizeof(struct fs_slot) );
+    if( cVfs->slots == 0 ) {
+        return SQLITE_NOMEM;
+    }
+    cVfs->nSlots = INITIAL_NAMESPACE_SLOTS;
+    cVfs->nFiles = 0;
+    cVfs->resident = 0;
+
+    int i;
+    for( i = 0; i < cVfs->nSlots; i++ ) {
+        cVfs->slots[i].file = 0;
+    }
+
+    cVfs->namespaceMutex = 0;
+    cVfs->mutex = 0;
+    #if SQLITE_THREADSAFE
+        if( cVfs == &composite_vfs_app_data ) {
+            cVfs->namespaceMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+            cVfs->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+        } else {
+            cVfs->namespaceMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+            cVfs->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+        }
+        if( cVfs->namespaceMutex == 0 || cVfs->mutex == 0 ) {
+            return SQLITE_NOMEM; /* _fs_instance_deinit() frees whatever was allocated */
+        }
+    #endif
+
+    return SQLITE_OK;
+}
+
+/* frees every file of an instance, and its namespace */
+static void _fs_instance_deinit(struct composite_vfs_data* cVfs) {
+    int i;
+    for( i = 0; i < cVfs->nSlots; i++ ) {
+        if( cVfs->slots[i].file ) {
+            _fs_file_free( cVfs->slots[i].file );
+        }
+    }
+
+    _FS_FREE( cVfs->slots );
+    cVfs->slots = 0;
+    cVfs->nSlots = 0;
+    cVfs->nFiles = 0;
+
+    #if SQLITE_THREADSAFE
+        if( cVfs != &composite_vfs_app_data ) {
+            sqlite3_mutex_free(cVfs->namespaceMutex);
+            sqlite3_mutex_free(cVfs->mutex);
+        }
+    #endif
+    cVfs->namespaceMutex = 0;
+    cVfs->mutex = 0;
+}
+
+/* inmem fs functions */
+int fs_init() {
+    #if SQLITE_THREADSAFE
+        _fs_spill_mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS1);
+    #endif
+
+    struct composite_vfs_data* cVfs;
+    for( cVfs = _fs_instances; cVfs; cVfs = cVfs->next ) {
+        const int rc = _fs_instance_init(cVfs);
+        if( rc != SQLITE_OK ) {
+            fs_deinit();
+            return rc;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+/* sets up cVfs as a new instance, with an empty namespace, and adds it to the list that fs_init() and fs_deinit()
+ * walk. returns SQLITE_OK, SQLITE_MISUSE if the inmemfs isn't initialized, or SQLITE_NOMEM
+ */
+int fs_add_instance(struct composite_vfs_data* cVfs) {
+    struct composite_vfs_data* head = _fs_instances;
+    if( head->slots == 0 ) {
+        return SQLITE_MISUSE;
+    }
+
+    cVfs->next = 0;
+    const int rc = _fs_instance_init(cVfs);
+    if( rc != SQLITE_OK ) {
+        _fs_instance_deinit(cVfs);
+        return rc;
+    }
+
+    /* the list is walked without a lock, so the instance is only linked in once it's ready */
+    FS_NAMESPACE_ENTER(head);
+    struct composite_vfs_data* last = head;
+    while( last->next ) {
+        last = last->next;
+    }
+    __atomic_store_n(&last->next, cVfs, __ATOMIC_RELEASE);
+    FS_NAMESPACE_LEAVE(head);
+
+    return SQLITE_OK;
+}
+
+void fs_deinit() {
+    /* free every instance's files, and clear the namespaces */
+    struct composite_vfs_data* cVfs;
+    for( cVfs = _fs_instances; cVfs; cVfs = cVfs->next ) {
+        _fs_instance_deinit(cVfs);
+    }
+
+    /* no file holds a spill slot anymore */
+    if( _fs_spill_fd >= 0 ) {
+        close(_fs_spill_fd);
+        _fs_spill_fd = -1;
+    }
+    _FS_FREE( _fs_spill_aFree );
+    _fs_spill_aFree = 0;
+    _fs_spill_nFree = 0;
+    _fs_spill_nFreeAlloc = 0;
+    _fs_spill_nSlots = 0;
+
+    /* no file points into the image anymore */
+    if( _fs_image ) {
+        munmap(_fs_image, _fs_image_size);
+        _fs_image = 0;
+        _fs_image_size = 0;
+    }
+
+    /* and no file holds a pool block: give the pools' memory back */
+    cPoolShutdown();
+}
+
+/* opens zName, creating it if it doesn't exist; with bExclusive, an existing file isn't opened and FS_OPEN_EXISTS
+ * is returned instead. returns 0 if there's no memory for a new file
+ */
+struct fs_file* fs_open(sqlite3_vfs* vfs, const char* zName, int pool, int bExclusive) {
+    struct composite_vfs_data* cVfs = (struct composite_vfs_data*)vfs->pAppData;
+    const unsigned int hash = _fs_hash(zName);
+
+    FS_NAMESPACE_ENTER(cVfs);
+    struct fs_file* file = _fs_find_file(cVfs, zName, hash);
+    if( file && bExclusive ) {
+        FS_NAMESPACE_LEAVE(cVfs);
+        return FS_OPEN_EXISTS;
+    }
+    if( file == 0 ) {
+        file = _fs_file_alloc(cVfs, zName, hash, pool);
+    }
+    if( file ) {
+        file->ref++;
+    }
+    FS_NAMESPACE_LEAVE(cVfs);
+
+    return file;
+}
+
+void fs_close(struct fs_file* file) {
+    struct composite_vfs_data* cVfs = file->cVfs;
+
+    FS_NAMESPACE_ENTER(cVfs);
+    file->ref--;
+    if( file->ref == 0 && file->deleteOnClose ) { /* have we been waiting to delete this file? */
+        _fs_file_unlink(file); //unlink the file from the list of files
+        _fs_file_free(file); //free the memory the file used
+    }
+    FS_NAMESPACE_LEAVE(cVfs);
+}
+
+/* returns the number of bytes read, or -1 if an error occurred. short reads are allowed. */
+int fs_read(struct fs_file* file, sqlite3_int64 offset, int len, void* buf) {
+    /* perform sanity checks on offset and len */
+    if( offset < 0 || len < 0 ) {
+        return -1;
+    }
+
+    FS_FILE_ENTER(file);
+    file->nRead++;
+
+    /* determine the number of bytes to read */
+    sqlite3_int64 end_offset = offset + (sqlite3_int64)len;
+    if( end_offset > file->data.len ) end_offset = file->data.len;
+    if( end_offset <= offset ) {
+        FS_FILE_LEAVE(file);
+        return 0; /* the read starts at or past the end of the file */
+    }
+    const int bytes_read = (int)(end_offset - offset);
+
+    /* copy the bytes into the buffer, one page at a time */
+    char* dst = (char*)buf;
+    while( offset < end_offset ) {
+        const int page_offset = (int)(offset % FS_PAGE_SIZE);
+        sqlite3_int64 n = FS_PAGE_SIZE - page_offset;
+        if( n > end_offset - offset ) n = end_offset - offset;
+
+        const int iPage = (int)(offset / FS_PAGE_SIZE);
+        struct fs_page* page = &file->data.pages[iPage];
+        _fs_guard(file, iPage, iPage);
+        if( _fs_page_is_hole(page) ) {
+            _fs_zerodata( dst, (int)n );
+        } else if( _fs_page_load(file, page) ) {
+            _fs_copydata( dst, (const char*)&page->buf[ page_offset ], (int)n );
+        } else {
+            _fs_guard(file, 0, -1);
+            FS_FILE_LEAVE(file);
+            return -1; /* we don't have enough memory to decompress the page, or it couldn't be read back in */
+        }
+        dst += n;
+        offset += n;
+    }
+
+    _fs_guard(file, 0, -1);
+    _fs_evict(file, 0);
+    file->nReadBytes += bytes_read;
+    FS_FILE_LEAVE(file);
+    return bytes_read;
+}
+
+/* returns the number of bytes written, or -1 if an error occurred. partial writes are not allowed. */
+int fs_write(struct fs_file* file, sqlite3_int64 offset, int len, const void* buf) {
+    /* perform sanity checks on offset and len */
+    if( offset < 0 || len < 0 ) {
+        return -1;
+    }
+
+    FS_FILE_ENTER(file);
+    file->nWrite++;
+
+    /* ensure that our buffer is large enough to perform the write */
+    sqlite3_int64 end_offset = offset + (sqlite3_int64)len;
+    if( _fs_data_ensure_capacity(file, end_offset) == 0 ) {
+        FS_FILE_LEAVE(file);
+        return -1; /* we don't have enough memory to perform the write */
+    }
+
+    /* writing past the end of the file leaves a gap, [gap_start, offset), that must read back as zeroes. every page
+     * the write or the gap touches is made writable before any of them is changed, except the pages that end up
+     * all zeroes: those become holes. a pinned page stays put, and is zeroed in place instead.
+     */
+    const char* src = (const char*)buf;
+    const sqlite3_int64 gap_start = (offset < file->data.len) ? offset : file->data.len;
+
+    /* a page the write replaces becomes a hole if it's all gap, or if the data written to it is all zeroes. the data
+     * is only checked once: the first pass records the answer for each page the data lands on, in aZero, a bit
+     * per page from offset's page on, and the second pass reads it back
+     */
+    const sqlite3_int64 data_first = offset / FS_PAGE_SIZE;
+    const sqlite3_int64 nDataPages = (len > 0) ? (end_offset - 1) / FS_PAGE_SIZE - data_first + 1 : 0;
+    sqlite3_uint64 aZeroStatic[FS_WRITE_ZERO_WORDS];
+    sqlite3_uint64* aZero = aZeroStatic;
+    if( nDataPages > FS_WRITE_ZERO_WORDS * 64 ) {
+        aZero = _FS_MALLOC( (int)( (nDataPages + 63) / 64 * sizeof(sqlite3_uint64) ) );
+        if( aZero == 0 ) {
+            FS_FILE_LEAVE(file);
+            return -1;
+        }
+    }
+
+    _fs_guard(file, (int)(gap_start / FS_PAGE_SIZE), (int)((end_offset - 1) / FS_PAGE_SIZE));
+    sqlite3_int64 i;
+    for( i = gap_start / FS_PAGE_SIZE; i * FS_PAGE_SIZE < end_offset; i++ ) {
+        int zero = file->data.pages[i].pin == 0 && _fs_write_covers_page(i, gap_start, end_offset);
+        if( i >= data_first ) {
+            const sqlite3_int64 b = i - data_first;
+            if( zero ) {
+                const sqlite3_int64 data_start = (i * FS_PAGE_SIZE > offset) ? i * FS_PAGE_SIZE : offset;
+                zero = _fs_iszero(&src[ data_start - offset ], (int)((i + 1) * FS_PAGE_SIZE - data_start));
+            }
+            if( zero ) {
+                aZero[b / 64] |= 1ull << (b % 64);
+            } else {
+                aZero[b / 64] &= ~(1ull << (b % 64));
+            }
+        }
+
+        if( zero ) {
+            continue;
+        }
+
+        if( _fs_page_make_writable(file, (int)i) == 0 ) {
+            _fs_guard(file, 0, -1);
+            if( aZero != aZeroStatic ) _FS_FREE(aZero);
+            FS_FILE_LEAVE(file);
+            return -1; /* we don't have enough memory to perform the write */
+        }
+    }
+
+    /* perform the write, one page at a time */
+    for( i = gap_start / FS_PAGE_SIZE; i * FS_PAGE_SIZE < end_offset; i++ ) {
+        const int zero = (i >= data_first)
+            ? ( aZero[ (i - data_first) / 64 ] >> ((i - data_first) % 64) ) & 1
+            : file->data.pages[i].pin == 0 && _fs_write_covers_page(i, gap_start, end_offset);
+        if( zero ) {
+            _fs_page_make_hole(file, (int)i);
+            continue;
+        }
+
+        char* page_buf = file->data.pages[i].buf;
+        const sqlite3_int64 page_start = i * FS_PAGE_SIZE;
+        const sqlite3_int64 page_end = page_start + FS_PAGE_SIZE;
+
+        /* the part of the gap on this page */
+        sqlite3_int64 start = (page_start > gap_start) ? page_start : gap_start;
+        sqlite3_int64 end = (page_end < offset) ? page_end : offset;
+        if( start < end ) {
+            _fs_zerodata( &page_buf[ start - page_start ], (int)(end - start) );
+        }
+
+        /* the part of the write on this page */
+        start = (page_start > offset) ? page_start : offset;
+        end = (page_end < end_offset) ? page_end : end_offset;
+        if( start < end ) {
+            _fs_copydata( &page_buf[ start - page_start ], &src[ start - offset ], (int)(end - start) );
+        }
+    }
+
+    /* adjust file->data.len; writes inside the file don't change its size */
+    if( end_offset > file->data.len ) {
+        file->data.len = end_offset;
+        if( end_offset > file->data.peak ) {
+            file->data.peak = end_offset;
+        }
+    }
+
+    _fs_guard(file, 0, -1);
+    if( aZero != aZeroStatic ) _FS_FREE(aZero);
+    _fs_evict(file, 0);
+    file->nWriteBytes += len;
+    FS_FILE_LEAVE(file);
+    return len;
+}
+
+/* shrinks the file to size bytes; a larger size leaves the file as it is.
+ * the pages past the new end are released, except for as many bytes as the file regrew by after its previous
+ * truncation: a journal that's truncated after every commit, then regrows to about the same size, keeps reusing
+ * the same pages, while a file that stops regrowing loses that slack at its next truncation (or to fs_shrink()).
+ * returns 1 on success, 0 on failure
+ */
+int fs_truncate(struct fs_file* file, sqlite3_int64 size) {
+    FS_FILE_ENTER(file);
+    if( size < file->data.len ) {
+        const sqlite3_int64 slack = (file->data.truncated >= 0 && file->data.peak > file->data.truncated)
+            ? file->data.peak - file->data.truncated : 0;
+
+        file->data.len = size;
+        file->data.truncated = size;
+        file->data.peak = size;
+        _fs_data_release_tail(file, _fs_data_pages_for(size + slack));
+    }
+    FS_FILE_LEAVE(file);
+    return 1;
+}
+
+/* releases every file's pages past its end, in every instance, including the slack fs_truncate() keeps; returns the
+ * bytes released
+ */
+sqlite3_int64 fs_shrink(void) {
+    sqlite3_int64 released = 0;
+
+    struct composite_vfs_data* cVfs;
+    for( cVfs = _fs_instances; cVfs; cVfs = __atomic_load_n(&cVfs->next, __ATOMIC_ACQUIRE) ) {
+        FS_NAMESPACE_ENTER(cVfs);
+        int i;
+        for( i = 0; i < cVfs->nSlots; i++ ) {
+            struct fs_file* file = cVfs->slots[i].file;
+            if( file == 0 ) {
+                continue;
+            }
+
+            FS_FILE_ENTER(file);
+            released += _fs_data_release_tail(file, _fs_data_pages_for(file->data.len));
+            file->data.truncated = file->data.len;
+            file->data.peak = file->data.len;
+            FS_FILE_LEAVE(file);
+        }
+        FS_NAMESPACE_LEAVE(cVfs);
+    }
+
+    return released;
+}
+
+void fs_size_hint(struct fs_file* file, sqlite3_int64 size) {
+    FS_FILE_ENTER(file);
+    _fs_data_ensure_capacity(file, size);
+    FS_FILE_LEAVE(file);
+}
+
+/* sets the memory budget, and opens the spill file at zSpillPath if there isn't one yet; see composite_fs_set_budget().
+ * returns SQLITE_OK, or SQLITE_CANTOPEN if the spill file can't be created
+ */
+int fs_set_budget(sqlite3_int64 nBytes, const char* zSpillPath) {
+    int rc = SQLITE_OK;
+
+    FS_SPILL_ENTER();
+    if( _fs_spill_fd < 0 && zSpillPath ) {
+        const int fd = open(zSpillPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if( fd < 0 ) {
+            rc = SQLITE_CANTOPEN;
+        } else {
+            unlink(zSpillPath); /* the slots live on in the open file, which goes away with the process */
+            __atomic_store_n(&_fs_spill_fd, fd, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&_fs_budget, (nBytes > 0) ? nBytes : 0, __ATOMIC_RELAXED);
+    FS_SPILL_LEAVE();
+
+    return rc;
+}
+
+/* reports the memory budget: the bytes of page data held in memory, the budget, and the bytes of pages in the
+ * spill file and of the spill file itself
+ */
+void fs_budget_stats(sqlite3_int64* pResident, sqlite3_int64* pBudget, sqlite3_int64* pSpilled, sqlite3_int64* pSpillFile) {
+    *pResident = _fs_resident();
+    *pBudget = __atomic_load_n(&_fs_budget, __ATOMIC_RELAXED);
+
+    FS_SPILL_ENTER();
+    *pSpilled = ((sqlite3_int64)_fs_spill_nSlots - _fs_spill_nFree) * FS_PAGE_SIZE;
+    *pSpillFile = (sqlite3_int64)_fs_spill_nSlots * FS_PAGE_SIZE;
+    FS_SPILL_LEAVE();
+}
+
+/* turns compression of the file's cold pages on, keeping at most nHotMax pages decompressed, or off if nHotMax is 0 */
+void fs_set_compression(struct fs_file* file, int nHotMax) {
+    FS_FILE_ENTER(file);
+    file->nHotMax = (nHotMax > 0) ? nHotMax : 0;
+    _fs_evict_reset(file);
+    _fs_evict(file, 0);
+    FS_FILE_LEAVE(file);
+}
+
+/* returns a pointer to len bytes of the file's data starting at offset, or 0 if they can't be
+ * handed out directly: the range must lie within the file and within a single page.
+ * the page is pinned until a matching fs_unfetch(). writes to the file are applied to it in place, unless the
+ * page has to be copied first (see _fs_page_make_writable()); then the pointer keeps showing the old data.
+ */
+void* fs_fetch(struct fs_file* file, sqlite3_int64 offset, int len) {
+    const int page_offset = (int)(offset % FS_PAGE_SIZE);
+    if( offset < 0 || len <= 0 || page_offset + len > FS_PAGE_SIZE ) {
+        return 0; /* the range spans two pages, which aren't contiguous in memory */
+    }
+
+    FS_FILE_ENTER(file);
+    if( offset + len > file->data.len ) {
+        FS_FILE_LEAVE(file);
+        return 0;
+    }
+
+    const int iPage = (int)(offset / FS_PAGE_SIZE);
+    struct fs_page* page = &file->data.pages[iPage];
+    _fs_guard(file, iPage, iPage);
+    const int ok = _fs_page_load(file, page);
+    _fs_guard(file, 0, -1);
+    if( !ok ) {
+        FS_FILE_LEAVE(file);
+        return 0; /* SQLite falls back to reading the page */
+    }
+    page->pin++;
+    file->nFetch++;
+    _fs_evict(file, 0);
+    FS_FILE_LEAVE(file);
+
+    return &page->buf[ page_offset ];
+}
+
+/* releases a pointer handed out by fs_fetch() for the given offset */
+void fs_unfetch(struct fs_file* file, sqlite3_int64 offset) {
+    FS_FILE_ENTER(file);
+    struct fs_page* page = &file->data.pages[ offset / FS_PAGE_SIZE ];
+    page->pin--;
+    if( page->pin == 0 ) {
+        _fs_evict_reset(file);
+        if( file->retired ) {
+            _fs_release_retired(file, (int)(offset / FS_PAGE_SIZE));
+        }
+    }
+    FS_FILE_LEAVE(file);
+}
+
+/* maps region iRegion of the file's wal-index into *pp, allocating the wal-index on first use.
+ * if the region doesn't exist and bExtend is 0, *pp is set to 0.
+ * the first call by each connection must be matched by a call to fs_shm_unmap().
+ * returns 1 on success, 0 if we ran out of memory
+ * the caller must hold the CVFS mutex, which guards every file's wal-index.
+ */
+int fs_shm_map(struct fs_file* file, int iRegion, int szRegion, int bExtend, volatile void** pp) {
+    struct fs_shm* shm = file->shm;
+    *pp = 0;
+
+    if( shm == 0 ) {
+        shm = _FS_MALLOC( sizeof(struct fs_shm) );
+        if( shm == 0 ) {
+            return 0;
+        }
+
+        int i;
+        shm->regions = 0;
+        shm->nRegion = 0;
+        shm->szRegion = szRegion;
+        shm->nRef = 0;
+        for( i = 0; i < SQLITE_SHM_NLOCK; i++ ) {
+            shm->nShared[i] = 0;
+            shm->exclusive[i] = 0;
+        }
+        file->shm = shm;
+    }
+
+    if( iRegion >= shm->nRegion ) {
+        if( !bExtend ) {
+            return 1;
+        }
+
+        const int sz = (iRegion+1) * sizeof(void*);
+        volatile void** new_regions = shm->regions ? _FS_REALLOC( (void*)shm->regions, sz ) : _FS_MALLOC( sz );
+        if( new_regions == 0 ) {
+            return 0;
+        }
+        shm->regions = new_regions;
+
+        while( shm->nRegion <= iRegion ) {
+            char* region = _FS_MALLOC( shm->szRegion );
+            if( region == 0 ) {
+                return 0;
+            }
+
+            _fs_zerodata(region, shm->szRegion);
+            shm->regions[ shm->nRegion++ ] = region;
+        }
+    }
+
+    *pp = shm->regions[iRegion];
+    return 1;
+}
+
+/* releases a connection's mapping of the wal-index. once the last connection has
+ * unmapped it, the wal-index is freed; SQLite rebuilds it from the WAL if it's needed again.
+ */
+void fs_shm_unmap(struct fs_file* file) {
+    struct fs_shm* shm = file->shm;
+    if( shm == 0 ) {
+        return;
+    }
+
+    shm->nRef--;
+    if( shm->nRef > 0 ) {
+        return;
+    }
+
+    _fs_shm_free(shm);
+    file->shm = 0;
+}
+
+/* returns 1 if the given file exists, 0 if it doesn't */
+int fs_exists(sqlite3_vfs* vfs, const char *zName) {
+    struct composite_vfs_data* cVfs = (struct composite_vfs_data*)vfs->pAppData;
+    const unsigned int hash = _fs_hash(zName);
+
+    FS_NAMESPACE_ENTER(cVfs);
+    struct fs_file* file = _fs_find_file(cVfs, zName, hash);
+    FS_NAMESPACE_LEAVE(cVfs);
+
+    return (file != 0);
+}
+
+/* returns 1 on success, 0 on failure */
+int fs_delete(sqlite3_vfs* vfs, const char *zName) {
+    struct composite_vfs_data* cVfs = (struct composite_vfs_data*)vfs->pAppData;
+    const unsigned int hash = _fs_hash(zName);
+
+    FS_NAMESPACE_ENTER(cVfs);
+    struct fs_file* file = _fs_find_file(cVfs, zName, hash);
+    if( file == 0 ) { /* the file doesn't exist */
+        FS_NAMESPACE_LEAVE(cVfs);
+        return 1;
+    }
+
+    if( file->ref == 0 ) { /* no one has this file open currently */
+        _fs_file_unlink(file);
+        _fs_file_free(file);
+    } else { /* the file is open somewhere */
+        file->deleteOnClose = 1; /* when this file is closed, it will be deleted */
+    }
+    FS_NAMESPACE_LEAVE(cVfs);
+
+    return 1;
+}
+
+/* appends a snapshot of each of cVfs's files to aInfo, which holds n already and has room for them; returns the
+ * new count. the caller holds the instance's namespace mutex.
+ */
+static int _fs_list_instance(struct composite_vfs_data* cVfs, struct fs_file_info* aInfo, int n) {
+    int i;
+    for( i = 0; i < cVfs->nSlots; i++ ) {
+        struct fs_file* file = cVfs->slots[i].file;
+        if( file == 0 ) {
+            continue;
+        }
+
+        struct fs_file_info* info = &aInfo[n++];
+        int j;
+        for( j = 0; file->zName[j] != 0 && j < MAX_PATHNAME; j++ ) {
+            info->zName[j] = file->zName[j];
+        }
+        info->zName[j] = 0;
+        info->zVfs = cVfs->zName;
+        info->id = file->id;
+        info->ref = file->ref;
+        info->deleteOnClose = file->deleteOnClose;
+
+        FS_FILE_ENTER(file);
+        info->size = file->data.len;
+        info->capacity = 0;
+        info->mapped = 0;
+        info->shared = 0;
+        info->holes = 0;
+        info->compressed = 0;
+        info->compressed_size = 0;
+        info->spilled = 0;
+        for( j = 0; j < file->data.nPages; j++ ) {
+            const struct fs_page* page = &file->data.pages[j];
+            if( _fs_page_is_hole(page) ) {
+                info->holes += FS_PAGE_SIZE;
+                continue;
+            }
+            if( page->spill ) {
+                info->spilled += FS_PAGE_SIZE;
+            }
+            if( page->zbuf ) {
+                info->compressed += FS_PAGE_SIZE;
+                info->compressed_size += page->zlen;
+                info->capacity += page->zlen;
+            }
+            if( page->buf == 0 ) {
+                continue;
+            }
+            info->capacity += FS_PAGE_SIZE;
+            if( page->mapped ) info->mapped += FS_PAGE_SIZE;
+            if( page->shared && __atomic_load_n(page->shared, __ATOMIC_RELAXED) > 1 ) info->shared += FS_PAGE_SIZE;
+        }
+        info->nRead = file->nRead;
+        info->nReadBytes = file->nReadBytes;
+        info->nWrite = file->nWrite;
+        info->nWriteBytes = file->nWriteBytes;
+        info->nFetch = file->nFetch;
+        info->nCompress = file->nCompress;
+        info->nCompressNs = file->nCompressNs;
+        info->nDecompress = file->nDecompress;
+        info->nDecompressNs = file->nDecompressNs;
+        info->nSpill = file->nSpill;
+        info->nFault = file->nFault;
+        info->nFaultNs = file->nFaultNs;
+        FS_FILE_LEAVE(file);
+
+        info->nMutexEnter = 0;
+        info->nMutexContended = 0;
+        #if SQLITE_THREADSAFE
+            if( cMutexInstalled() ) {
+                cMutexCounters(file->mutex, &info->nMutexEnter, &info->nMutexContended);
+            }
+        #endif
+    }
+
+    return n;
+}
+
+/* takes a snapshot of every file in every instance, one instance at a time, in no particular order.
+ * *paInfo is set to an array that the caller must release with sqlite3_free(), or 0 if there are no files.
+ * returns the number of files, or -1 if we ran out of memory
+ */
+int fs_list(struct fs_file_info** paInfo) {
+    struct fs_file_info* aInfo = 0;
+    int n = 0;
+
+    *paInfo = 0;
+
+    struct composite_vfs_data* cVfs;
+    for( cVfs = _fs_instances; cVfs; cVfs = __atomic_load_n(&cVfs->next, __ATOMIC_ACQUIRE) ) {
+        FS_NAMESPACE_ENTER(cVfs);
+        if( cVfs->nFiles == 0 ) {
+            FS_NAMESPACE_LEAVE(cVfs);
+            continue;
+        }
+
+        struct fs_file_info* aGrown = sqlite3_realloc64( aInfo, (n + cVfs->nFiles) * sizeof(struct fs_file_info) );
+        if( aGrown == 0 ) {
+            FS_NAMESPACE_LEAVE(cVfs);
+            sqlite3_free(aInfo);
+            return -1;
+        }
+        aInfo = aGrown;
+
+        n = _fs_list_instance(cVfs, aInfo, n);
+        FS_NAMESPACE_LEAVE(cVfs);
+    }
+
+    *paInfo = aInfo;
+    return n;
+}
+
+/* clones zSrc as zDst, both in cVfs: the clone's page directory points to the source's page buffers, which are shared
+ * (and copied by whichever file writes them first) from then on. holes, and pages in the snapshot image, are
+ * shared without a count, since they're never freed; pages of an adopted buffer take a reference to it.
+ * returns SQLITE_OK, SQLITE_CANTOPEN, SQLITE_BUSY, SQLITE_MISUSE or SQLITE_NOMEM; see composite_fs_clone()
+ */
+int fs_clone(struct composite_vfs_data* cVfs, const char* zSrc, const char* zDst) {
+    const unsigned int dst_hash = _fs_hash(zDst);
+
+    FS_NAMESPACE_ENTER(cVfs);
+    struct fs_file* src = _fs_find_file(cVfs, zSrc, _fs_hash(zSrc));
+    if( src == 0 ) {
+        FS_NAMESPACE_LEAVE(cVfs);
+        return SQLITE_CANTOPEN;
+    }
+
+    struct fs_file* dst = _fs_find_file(cVfs, zDst, dst_hash);
+    if( dst == src ) {
+        FS_NAMESPACE_LEAVE(cVfs);
+        return SQLITE_MISUSE;
+    }
+    if( dst ) {
+        if( dst->ref > 0 ) {
+            FS_NAMESPACE_LEAVE(cVfs);
+            return SQLITE_BUSY;
+        }
+
+        _fs_file_unlink(dst);
+        _fs_file_free(dst);
+    }
+
+    dst = _fs_file_alloc(cVfs, zDst, dst_hash, src->pool);
+    if( dst == 0 ) {
+        FS_NAMESPACE_LEAVE(cVfs);
+        return SQLITE_NOMEM;
+    }
+
+    FS_FILE_ENTER(src);
+    int ok = _fs_data_ensure_slots(dst, src->data.nPages);
+
+    int i;
+    for( i = 0; i < src->data.nPages && ok; i++ ) {
+        struct fs_page* page = &src->data.pages[i];
+        struct fs_page* copy = &dst->data.pages[i];
+        copy->buf = page->buf;
+        copy->pin = 0;
+        copy->mapped = page->mapped;
+        copy->shared = 0;
+        copy->zbuf = 0;
+        copy->zlen = 0;
+        copy->recent = 0;
+        copy->spill = 0;
+        copy->ext = page->ext;
+        if( page->ext ) {
+            __atomic_add_fetch(&page->ext->nRef, 1, __ATOMIC_RELAXED);
+        }
+
+        if( page->spill ) {
+            /* a spilled page gets a slot of its own */
+            char tmp[FS_PAGE_SIZE];
+            const unsigned int slot = _fs_spill_slot_alloc();
+            if( _fs_spill_io( (unsigned int)(page->spill - 1), tmp, 0 ) == 0 || _fs_spill_io(slot, tmp, 1) == 0 ) {
+                _fs_spill_slot_free(slot);
+                ok = 0;
+                break;
+            }
+            copy->spill = (int)slot + 1;
+        } else if( page->buf == 0 ) {
+            /* a page that's only held compressed: its compressed copy is small, so it's copied rather than shared */
+            copy->zbuf = _FS_DATA_MALLOC( dst, page->zlen );
+            if( copy->zbuf == 0 ) {
+                ok = 0;
+                break;
+            }
+            _fs_copydata(copy->zbuf, page->zbuf, page->zlen);
+            copy->zlen = page->zlen;
+            _fs_zbytes_add(dst, page->zlen);
+        } else if( !page->mapped ) {
+            if( page->shared == 0 ) {
+                page->shared = _FS_MALLOC( sizeof(int) );
+                if( page->shared == 0 ) {
+                    ok = 0;
+                    break;
+                }
+                *page->shared = 1;
+            }
+            __atomic_add_fetch(page->shared, 1, __ATOMIC_RELAXED);
+            copy->shared = page->shared;
+            _fs_hot_add(dst, 1);
+        }
+
+        dst->data.nPages++;
+    }
+    dst->data.len = src->data.len;
+    dst->nHotMax = src->nHotMax;
+    dst->data.peak = src->data.len;
+    FS_FILE_LEAVE(src);
+
+    if( !ok ) {
+        /* freeing the clone drops the references it took */
+        _fs_file_unlink(dst);
+        _fs_file_free(dst);
+    }
+    FS_NAMESPACE_LEAVE(cVfs);
+
+    return ok ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+/* makes the nData bytes at pData the contents of zName in cVfs: every whole page points into the buffer, and is copied when
+ * it's first written (see _fs_page_make_writable()). a partial last page is copied now, since every page must have
+ * FS_PAGE_SIZE readable bytes. xFree(pFreeArg) is called once no page points into the buffer anymore.
+ * an existing zName is replaced if bReplace is set; otherwise it's left alone, and checked for under the same lock
+ * that creates the file, so that of two callers that find zName missing at once, only one adopts it.
+ * returns SQLITE_OK, SQLITE_BUSY, FS_ADOPT_EXISTS or SQLITE_NOMEM; see composite_fs_adopt()
+ */
+int fs_adopt(struct composite_vfs_data* cVfs, const char* zName, const void* pData, sqlite3_int64 nData, void (*xFree)(void*), void* pFreeArg, int bReplace) {
+    const unsigned int hash = _fs_hash(zName);
+    const sqlite3_int64 nWhole = nData / FS_PAGE_SIZE;
+    const int nTail = (int)(nData % FS_PAGE_SIZE);
+    if( nData < 0 || _fs_data_pages_for(nData) > 0x7fffffff ) {
+        return SQLITE_NOMEM;
+    }
+
+    struct fs_extern* ext = _FS_MALLOC( sizeof(struct fs_extern) );
+    if( ext == 0 ) {
+        return SQLITE_NOMEM;
+    }
+    ext->p = pFreeArg;
+    ext->xFree = 0; /* until the file is set up, the buffer is still the caller's */
+    ext->nRef = 1; /* our own reference, which keeps the buffer while the pages are set up */
+
+    FS_NAMESPACE_ENTER(cVfs);
+    struct fs_file* file = _fs_find_file(cVfs, zName, hash);
+    if( file && (!bReplace || file->ref > 0) ) {
+        FS_NAMESPACE_LEAVE(cVfs);
+        _FS_FREE( ext );
+        return bReplace ? SQLITE_BUSY : FS_ADOPT_EXISTS;
+    }
+    if( file ) {
+        _fs_file_unlink(file);
+        _fs_file_free(file);
+    }
+
+    file = _fs_file_alloc(cVfs, zName, hash, COMPOSITE_FS_POOL_MAIN);
+    int ok = file != 0 && _fs_data_ensure_slots(file, (int)_fs_data_pages_for(nData));
+
+    char* tail = 0;
+    if( ok && nTail > 0 ) {
+        tail = _fs_page_alloc(file);
+        ok = tail != 0;
+    }
+
+    if( !ok ) {
+        if( file ) {
+            _fs_file_unlink(file);
+            _fs_file_free(file);
+        }
+        FS_NAMESPACE_LEAVE(cVfs);
+        _FS_FREE( ext );
+        return SQLITE_NOMEM;
+    }
+
+    const char* data = (const char*)pData;
+    sqlite3_int64 i;
+    for( i = 0; i < nWhole; i++ ) {
+        struct fs_page* page = &file->data.pages[i];
+        _fs_page_init_hole(page);
+        page->buf = (char*)&data[ i * FS_PAGE_SIZE ];
+        page->ext = ext;
+    }
+    ext->nRef += (int)nWhole;
+
+    if( tail ) {
+        _fs_copydata(tail, &data[ nWhole * FS_PAGE_SIZE ], nTail);
+        _fs_zerodata(&tail[nTail], FS_PAGE_SIZE - nTail);
+        _fs_page_init_hole( &file->data.pages[nWhole] );
+        file->data.pages[nWhole].buf = tail;
+        file->data.pages[nWhole].mapped = 0;
+        _fs_hot_add(file, 1);
+    }
+
+    file->data.nPages = (int)_fs_data_pages_for(nData);
+    file->data.len = nData;
+    file->data.peak = nData;
+    ext->xFree = xFree;
+    FS_NAMESPACE_LEAVE(cVfs);
+
+    /* if no page points into the buffer, this hands it straight back */
+    _fs_extern_release(ext);
+    return SQLITE_OK;
+}
+
+/* a file mapped by fs_adopt_file() */
+struct fs_mapping {
+    void* p;
+    size_t n;
+};
+
+static void _fs_mapping_free(void* pArg) {
+    struct fs_mapping* mapping = pArg;
+    munmap(mapping->p, mapping->n);
+    _FS_FREE( mapping );
+}
+
+/* adopts the file at zPath on disk as the contents of zName in cVfs, as fs_adopt() does with bReplace. the mapping
+ * is private and read-only, like the snapshot image's, so the disk file is never written. an empty file leaves zName
+ * empty.
+ * returns SQLITE_OK, SQLITE_CANTOPEN, SQLITE_BUSY if zName is open, FS_ADOPT_EXISTS, or SQLITE_NOMEM
+ */
+int fs_adopt_file(struct composite_vfs_data* cVfs, const char* zName, const char* zPath, int bReplace) {
+    const int fd = open(zPath, O_RDONLY | O_CLOEXEC);
+    if( fd < 0 ) {
+        return SQLITE_CANTOPEN;
+    }
+
+    struct stat st;
+    if( fstat(fd, &st) != 0 ) {
+        close(fd);
+        return SQLITE_CANTOPEN;
+    }
+    if( st.st_size == 0 ) {
+        close(fd);
+        return SQLITE_OK;
+    }
+
+    struct fs_mapping* mapping = _FS_MALLOC( sizeof(struct fs_mapping) );
+    void* p = mapping ? mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if( p == MAP_FAILED ) {
+        _FS_FREE( mapping );
+        return mapping ? SQLITE_CANTOPEN : SQLITE_NOMEM;
+    }
+    mapping->p = p;
+    mapping->n = (size_t)st.st_size;
+
+    const int rc = fs_adopt(cVfs, zName, p, (sqlite3_int64)st.st_size, _fs_mapping_free, mapping, bReplace);
+    if( rc != SQLITE_OK ) {
+        _fs_mapping_free(mapping);
+    }
+    return rc;
+}
+
+/* a reference an export holds on one page's buffer */
+struct fs_view_ref {
+    char* buf;
+    int* shared;
+    int mapped;
+    struct fs_extern* ext;
+};
+
+/* what composite_fs_view.pRefs points to: the references, followed in the same allocation by the segments */
+struct fs_view_refs {
+    int nRef;
+    struct fs_view_ref aRef[1];
+};
+
+/* fills *pView with segments that point at the pages of zName in cVfs, sharing each page buffer the way a clone does.
+ * returns SQLITE_OK, SQLITE_CANTOPEN or SQLITE_NOMEM; see composite_fs_export()
+ */
+int fs_export(struct composite_vfs_data* cVfs, const char* zName, struct composite_fs_view* pView) {
+    pView->len = 0;
+    pView->nSegment = 0;
+    pView->aSegment = 0;
+    pView->pRefs = 0;
+
+    FS_NAMESPACE_ENTER(cVfs);
+    struct fs_file* file = _fs_find_file(cVfs, zName, _fs_hash(zName));
+    if( file == 0 ) {
+        FS_NAMESPACE_LEAVE(cVfs);
+        return SQLITE_CANTOPEN;
+    }
+
+    FS_FILE_ENTER(file);
+    const int nPages = (int)_fs_data_pages_for(file->data.len);
+    const int nAlloc = nPages ? nPages : 1;
+    struct fs_view_refs* refs = sqlite3_malloc64( sizeof(struct fs_view_refs) + (sqlite3_uint64)nAlloc * (sizeof(struct fs_view_ref) + sizeof(struct composite_fs_segment)) );
+    if( refs == 0 ) {
+        FS_FILE_LEAVE(file);
+        FS_NAMESPACE_LEAVE(cVfs);
+        return SQLITE_NOMEM;
+    }
+    struct composite_fs_segment* aSeg = (struct composite_fs_segment*)&refs->aRef[nAlloc];
+    refs->nRef = 0;
+
+    int i, nSeg = 0, ok = 1;
+    for( i = 0; i < nPages; i++ ) {
+        struct fs_page* page = &file->data.pages[i];
+        _fs_guard(file, i, i); /* the pages before it are shared by now, and so passed over anyway */
+        if( !_fs_page_is_hole(page) && _fs_page_load(file, page) == 0 ) {
+            ok = 0;
+            break;
+        }
+
+        if( !page->mapped ) {
+            if( page->shared == 0 ) {
+                page->shared = _FS_MALLOC( sizeof(int) );
+                if( page->shared == 0 ) {
+                    ok = 0;
+                    break;
+                }
+                *page->shared = 1;
+            }
+            __atomic_add_fetch(page->shared, 1, __ATOMIC_RELAXED);
+        } else if( page->ext ) {
+            __atomic_add_fetch(&page->ext->nRef, 1, __ATOMIC_RELAXED);
+        }
+
+        struct fs_view_ref* ref = &refs->aRef[ refs->nRef++ ];
+        ref->buf = page->buf;
+        ref->shared = page->shared;
+        ref->mapped = page->mapped;
+        ref->ext = page->ext;
+
+        sqlite3_int64 n = file->data.len - (sqlite3_int64)i * FS_PAGE_SIZE;
+        if( n > FS_PAGE_SIZE ) n = FS_PAGE_SIZE;
+        if( nSeg > 0 && (const char*)aSeg[nSeg - 1].p + aSeg[nSeg - 1].n == page->buf ) {
+            aSeg[nSeg - 1].n += n; /* contiguous with the previous page */
+        } else {
+            aSeg[nSeg].p = page->buf;
+            aSeg[nSeg].n = n;
+            nSeg++;
+        }
+    }
+    _fs_guard(file, 0, -1);
+    const sqlite3_int64 len = file->data.len;
+    FS_FILE_LEAVE(file);
+    FS_NAMESPACE_LEAVE(cVfs);
+
+    pView->pRefs = refs;
+    if( !ok ) {
+        fs_export_release(pView);
+        return SQLITE_NOMEM;
+    }
+
+    pView->len = len;
+    pView->nSegment = nSeg;
+    pView->aSegment = aSeg;
+    return SQLITE_OK;
+}
+
+/* drops the references a view holds */
+void fs_export_release(struct composite_fs_view* pView) {
+    struct fs_view_refs* refs = pView->pRefs;
+    if( refs == 0 ) {
+        return;
+    }
+
+    int i;
+    for( i = 0; i < refs->nRef; i++ ) {
+        const struct fs_view_ref* ref = &refs->aRef[i];
+        _fs_buf_release(ref->buf, ref->shared, ref->mapped, ref->ext);
+    }
+
+    sqlite3_free(refs);
+    pView->len = 0;
+    pView->nSegment = 0;
+    pView->aSegment = 0;
+    pView->pRefs = 0;
+}
+
+static int _fs_strlen(const char* str) {
+    int len;
+    for( len = 0; str[len] != 0 && len < MAX_PATHNAME; len++ ) {}
+    return len;
+}
+
+/* the files that go in a snapshot: files that are waiting to be deleted are left out */
+static int _fs_snapshot_includes(struct fs_file* file) {
+    return file != 0 && !file->deleteOnClose;
+}
+
+/* writes every file of cVfs to an image at zPath; see fs_image_header for the format.
+ * the image is written next to zPath, then renamed over it, so a crash never leaves a partial image behind.
+ * returns SQLITE_OK or SQLITE_IOERR
+ */
+int fs_snapshot(struct composite_vfs_data* cVfs, const char* zPath) {
+    char zTmp[MAX_PATHNAME + 8];
+    if( snprintf(zTmp, sizeof(zTmp), "%s-tmp", zPath) >= (int)sizeof(zTmp) ) {
+        return SQLITE_IOERR;
+    }
+
+    FILE* f = fopen(zTmp, "wb");
+    if( f == 0 ) {
+        return SQLITE_IOERR;
+    }
+
+    /* hold the namespace for the whole snapshot, so that files can't come or go while we write them */
+    FS_NAMESPACE_ENTER(cVfs);
+
+    struct fs_image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FS_IMAGE_MAGIC, sizeof(FS_IMAGE_MAGIC));
+    header.version = FS_IMAGE_VERSION;
+    header.page_size = FS_PAGE_SIZE;
+
+    sqlite3_uint64 dir_bytes = sizeof(struct fs_image_header);
+    int i;
+    for( i = 0; i < cVfs->nSlots; i++ ) {
+        if( _fs_snapshot_includes(cVfs->slots[i].file) ) {
+            dir_bytes += sizeof(struct fs_image_file) + FS_IMAGE_ALIGN8( _fs_strlen(cVfs->slots[i].file->zName) + 1 );
+            header.nFiles++;
+        }
+    }
+    header.dir_size = (dir_bytes + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE * FS_PAGE_SIZE;
+
+    struct fs_image_file* aEntry = sqlite3_malloc64( (header.nFiles ? header.nFiles : 1) * sizeof(struct fs_image_file) );
+    int ok = (aEntry != 0) && fseek(f, (long)header.dir_size, SEEK_SET) == 0;
+
+    /* the pages, one file at a time; each file is locked while it's copied */
+    int n = 0;
+    for( i = 0; i < cVfs->nSlots && ok; i++ ) {
+        struct fs_file* file = cVfs->slots[i].file;
+        if( !_fs_snapshot_includes(file) ) {
+            continue;
+        }
+
+        struct fs_image_file* entry = &aEntry[n++];
+        memset(entry, 0, sizeof(*entry));
+
+        FS_FILE_ENTER(file);
+        entry->len = file->data.len;
+        entry->first_page = header.nPages;
+        entry->nPages = (file->data.len + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE;
+        entry->name_len = _fs_strlen(file->zName);
+
+        /* holes are skipped over, leaving holes in the image too on filesystems that support them. compressed and
+         * spilled pages are written out without bringing them back into memory.
+         */
+        sqlite3_uint64 j;
+        for( j = 0; j < entry->nPages && ok; j++ ) {
+            const struct fs_page* page = &file->data.pages[j];
+            if( _fs_page_is_hole(page) ) {
+                ok = fseek(f, FS_PAGE_SIZE, SEEK_CUR) == 0;
+            } else if( page->spill ) {
+                char tmp[FS_PAGE_SIZE];
+                ok = _fs_spill_io( (unsigned int)(page->spill - 1), tmp, 0 ) && fwrite(tmp, FS_PAGE_SIZE, 1, f) == 1;
+            } else if( page->buf == 0 ) {
+                char tmp[FS_PAGE_SIZE];
+                ok = cLzDecompress(page->zbuf, page->zlen, tmp, FS_PAGE_SIZE) == FS_PAGE_SIZE && fwrite(tmp, FS_PAGE_SIZE, 1, f) == 1;
+            } else {
+                ok = fwrite(page->buf, FS_PAGE_SIZE, 1, f) == 1;
+            }
+        }
+        FS_FILE_LEAVE(file);
+
+        header.nPages += entry->nPages;
+    }
+
+    /* the directory; the gap between it and the first page was left as zeroes by the seek */
+    if( ok ) {
+        ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    }
+
+    static const char zPad[8] = { 0 };
+    n = 0;
+    for( i = 0; i < cVfs->nSlots && ok; i++ ) {
+        struct fs_file* file = cVfs->slots[i].file;
+        if( !_fs_snapshot_includes(file) ) {
+            continue;
+        }
+
+        const struct fs_image_file* entry = &aEntry[n++];
+        const int padding = (int)( FS_IMAGE_ALIGN8(entry->name_len + 1) - entry->name_len );
+        ok = fwrite(entry, sizeof(*entry), 1, f) == 1
+            && fwrite(file->zName, entry->name_len, 1, f) == 1
+            && fwrite(zPad, padding, 1, f) == 1;
+    }
+
+    FS_NAMESPACE_LEAVE(cVfs);
+    sqlite3_free(aEntry);
+
+    /* a seek past the end doesn't extend the file, so trailing holes need the image to be extended explicitly */
+    if( fflush(f) != 0 || (ok && ftruncate(fileno(f), (off_t)header.dir_size + (off_t)header.nPages * FS_PAGE_SIZE) != 0) || fsync(fileno(f)) != 0 ) {
+        ok = 0;
+    }
+    if( fclose(f) != 0 ) {
+        ok = 0;
+    }
+
+    if( !ok || rename(zTmp, zPath) != 0 ) {
+        remove(zTmp);
+        return SQLITE_IOERR;
+    }
+
+    return SQLITE_OK;
+}
+
+/* adds the files in the image to the namespace, which must be empty. the image is mapped rather than read,
+ * so restoring costs time in proportion to the number of files, and each page is only read from disk
+ * when it's first used.
+ */
+static int _fs_restore_files(struct composite_vfs_data* cVfs) {
+    const char* image = (const char*)_fs_image;
+    const struct fs_image_header* header = (const struct fs_image_header*)image;
+
+    if( _fs_image_size < sizeof(*header)
+        || memcmp(header->magic, FS_IMAGE_MAGIC, sizeof(FS_IMAGE_MAGIC)) != 0
+        || header->version != FS_IMAGE_VERSION
+        || header->page_size != FS_PAGE_SIZE
+        || header->dir_size % FS_PAGE_SIZE != 0
+        || header->dir_size > _fs_image_size
+        || header->nPages > (_fs_image_size - header->dir_size) / FS_PAGE_SIZE ) {
+        return SQLITE_CORRUPT;
+    }
+
+    sqlite3_uint64 pos = sizeof(*header);
+    unsigned int i;
+    for( i = 0; i < header->nFiles; i++ ) {
+        if( pos + sizeof(struct fs_image_file) > header->dir_size ) {
+            return SQLITE_CORRUPT;
+        }
+
+        const struct fs_image_file* entry = (const struct fs_image_file*)&image[pos];
+        const char* zName = &image[ pos + sizeof(*entry) ];
+        pos += sizeof(*entry) + FS_IMAGE_ALIGN8(entry->name_len + 1);
+
+        if( pos > header->dir_size
+            || entry->name_len > MAX_PATHNAME
+            || zName[ entry->name_len ] != 0
+            || entry->first_page > header->nPages
+            || entry->nPages > header->nPages - entry->first_page
+            || entry->nPages > 0x7fffffff
+            || entry->len > entry->nPages * FS_PAGE_SIZE ) {
+            return SQLITE_CORRUPT;
+        }
+
+        struct fs_file* file = _fs_file_alloc(cVfs, zName, _fs_hash(zName), COMPOSITE_FS_POOL_MAIN);
+        if( file == 0 || _fs_data_ensure_slots(file, (int)entry->nPages) == 0 ) {
+            return SQLITE_NOMEM;
+        }
+
+        const char* pages = &image[ (sqlite3_int64)header->dir_size + (sqlite3_int64)entry->first_page * FS_PAGE_SIZE ];
+        sqlite3_uint64 j;
+        for( j = 0; j < entry->nPages; j++ ) {
+            file->data.pages[j].buf = (char*)&pages[ (sqlite3_int64)j * FS_PAGE_SIZE ];
+            file->data.pages[j].pin = 0;
+            file->data.pages[j].mapped = 1;
+            file->data.pages[j].shared = 0;
+            file->data.pages[j].zbuf = 0;
+            file->data.pages[j].zlen = 0;
+            file->data.pages[j].recent = 0;
+            file->data.pages[j].spill = 0;
+            file->data.pages[j].ext = 0;
+        }
+        file->data.nPages = (int)entry->nPages;
+        file->data.len = (sqlite3_int64)entry->len;
+        file->data.peak = file->data.len;
+    }
+
+    return SQLITE_OK;
+}
+
+/* restores the files in the image at zPath into the (empty) namespace; a missing image restores nothing.
+ * returns SQLITE_OK, SQLITE_CORRUPT for a damaged image, or SQLITE_IOERR / SQLITE_NOMEM.
+ * if the restore fails, the namespace is left empty.
+ */
+int fs_restore(struct composite_vfs_data* cVfs, const char* zPath) {
+    const int fd = open(zPath, O_RDONLY);
+    if( fd < 0 ) {
+        return (errno == ENOENT) ? SQLITE_OK : SQLITE_IOERR;
+    }
+
+    struct stat st;
+    if( fstat(fd, &st) != 0 ) {
+        close(fd);
+        return SQLITE_IOERR;
+    }
+    if( st.st_size == 0 ) {
+        close(fd);
+        return SQLITE_CORRUPT;
+    }
+
+    /* a private mapping: the pages are read-only to us, and writes copy them out (see _fs_page_make_writable()) */
+    void* image = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( image == MAP_FAILED ) {
+        return SQLITE_IOERR;
+    }
+
+    FS_NAMESPACE_ENTER(cVfs);
+    _fs_image = image;
+    _fs_image_size = (size_t)st.st_size;
+    const int rc = _fs_restore_files(cVfs);
+    FS_NAMESPACE_LEAVE(cVfs);
+
+    if( rc != SQLITE_OK ) {
+        /* fs_deinit() frees whatever was restored and unmaps the image */
+        fs_deinit();
+        fs_init();
+    }
+
+    return rc;
+}
+
 #endif //SQLITE_OS_OTHER
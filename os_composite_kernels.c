@@ -0,0 +1,396 @@
+/* Contains the copy and zero kernels behind cCopy() and cZero(), and the runtime dispatch between them
+ *
+ * each kernel moves whole vectors, and finishes with one vector that ends at the last byte, overlapping the ones
+ * before it, instead of a byte loop for the remainder. the first call picks the widest set the CPU supports.
+ */
+
+#if SQLITE_OS_OTHER
+
+#include "os_composite_kernels.h"
+
+#include <stdint.h> /* for uint64_t and uintptr_t */
+#include <string.h> /* for memcpy() */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CKERNEL_X86 1
+#include <immintrin.h> /* for the SSE2, AVX2 and AVX-512 intrinsics */
+#else
+#define CKERNEL_X86 0
+#endif
+
+typedef void (*ckernel_copy_fn)(void* dst, const void* src, size_t n);
+typedef void (*ckernel_zero_fn)(void* dst, size_t n);
+
+/* copies fewer bytes than a vector holds: two words that may overlap, or a byte at a time for less than a word */
+static void _ckernel_copy_small(char* d, const char* s, size_t n) {
+    if( n >= 8 ) {
+        uint64_t a, b;
+        memcpy(&a, s, 8);
+        memcpy(&b, s + n - 8, 8);
+        memcpy(d, &a, 8);
+        memcpy(d + n - 8, &b, 8);
+        return;
+    }
+
+    while( n-- > 0 ) {
+        *d++ = *s++;
+    }
+}
+
+static void _ckernel_zero_small(char* d, size_t n) {
+    if( n >= 8 ) {
+        const uint64_t z = 0;
+        memcpy(d, &z, 8);
+        memcpy(d + n - 8, &z, 8);
+        return;
+    }
+
+    while( n-- > 0 ) {
+        *d++ = 0;
+    }
+}
+
+/* the portable kernels: a word at a time */
+static void _ckernel_copy_scalar(void* dst, const void* src, size_t n) {
+    char* d = dst;
+    const char* s = src;
+    if( n < 8 ) {
+        _ckernel_copy_small(d, s, n);
+        return;
+    }
+
+    uint64_t last;
+    memcpy(&last, s + n - 8, 8);
+    char* const dLast = d + n - 8;
+    for( ; n >= 8; d += 8, s += 8, n -= 8 ) {
+        uint64_t w;
+        memcpy(&w, s, 8);
+        memcpy(d, &w, 8);
+    }
+    memcpy(dLast, &last, 8);
+}
+
+static void _ckernel_zero_scalar(void* dst, size_t n) {
+    char* d = dst;
+    if( n < 8 ) {
+        _ckernel_zero_small(d, n);
+        return;
+    }
+
+    const uint64_t z = 0;
+    char* const dLast = d + n - 8;
+    for( ; n >= 8; d += 8, n -= 8 ) {
+        memcpy(d, &z, 8);
+    }
+    memcpy(dLast, &z, 8);
+}
+
+#if CKERNEL_X86
+
+/* the number of bytes to skip so that d is aligned to w, a power of two */
+#define CKERNEL_ALIGN_SKIP(d, w) ( (size_t)( ((w) - ((uintptr_t)(d) & ((w) - 1))) & ((w) - 1) ) )
+
+__attribute__((target("sse2")))
+static void _ckernel_copy_sse2(void* dst, const void* src, size_t n) {
+    char* d = dst;
+    const char* s = src;
+    if( n < 16 ) {
+        _ckernel_copy_small(d, s, n);
+        return;
+    }
+
+    const __m128i last = _mm_loadu_si128((const __m128i*)(s + n - 16));
+    char* const dLast = d + n - 16;
+
+    if( n >= CKERNEL_NT_THRESHOLD ) {
+        /* streaming stores must be aligned: copy one unaligned vector, then carry on from the next boundary */
+        const size_t skip = CKERNEL_ALIGN_SKIP(d, 16);
+        _mm_storeu_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+        d += skip; s += skip; n -= skip;
+        for( ; n >= 64; d += 64, s += 64, n -= 64 ) {
+            _mm_stream_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+            _mm_stream_si128((__m128i*)(d + 16), _mm_loadu_si128((const __m128i*)(s + 16)));
+            _mm_stream_si128((__m128i*)(d + 32), _mm_loadu_si128((const __m128i*)(s + 32)));
+            _mm_stream_si128((__m128i*)(d + 48), _mm_loadu_si128((const __m128i*)(s + 48)));
+        }
+        _mm_sfence();
+    }
+
+    for( ; n >= 64; d += 64, s += 64, n -= 64 ) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)s);
+        const __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+        const __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_storeu_si128((__m128i*)d, a);
+        _mm_storeu_si128((__m128i*)(d + 16), b);
+        _mm_storeu_si128((__m128i*)(d + 32), c);
+        _mm_storeu_si128((__m128i*)(d + 48), e);
+    }
+    for( ; n >= 16; d += 16, s += 16, n -= 16 ) {
+        _mm_storeu_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+    }
+    _mm_storeu_si128((__m128i*)dLast, last);
+}
+
+__attribute__((target("sse2")))
+static void _ckernel_zero_sse2(void* dst, size_t n) {
+    char* d = dst;
+    if( n < 16 ) {
+        _ckernel_zero_small(d, n);
+        return;
+    }
+
+    const __m128i z = _mm_setzero_si128();
+    char* const dLast = d + n - 16;
+
+    if( n >= CKERNEL_NT_THRESHOLD ) {
+        const size_t skip = CKERNEL_ALIGN_SKIP(d, 16);
+        _mm_storeu_si128((__m128i*)d, z);
+        d += skip; n -= skip;
+        for( ; n >= 64; d += 64, n -= 64 ) {
+            _mm_stream_si128((__m128i*)d, z);
+            _mm_stream_si128((__m128i*)(d + 16), z);
+            _mm_stream_si128((__m128i*)(d + 32), z);
+            _mm_stream_si128((__m128i*)(d + 48), z);
+        }
+        _mm_sfence();
+    }
+
+    for( ; n >= 64; d += 64, n -= 64 ) {
+        _mm_storeu_si128((__m128i*)d, z);
+        _mm_storeu_si128((__m128i*)(d + 16), z);
+        _mm_storeu_si128((__m128i*)(d + 32), z);
+        _mm_storeu_si128((__m128i*)(d + 48), z);
+    }
+    for( ; n >= 16; d += 16, n -= 16 ) {
+        _mm_storeu_si128((__m128i*)d, z);
+    }
+    _mm_storeu_si128((__m128i*)dLast, z);
+}
+
+__attribute__((target("avx2")))
+static void _ckernel_copy_avx2(void* dst, const void* src, size_t n) {
+    char* d = dst;
+    const char* s = src;
+    if( n < 32 ) {
+        _ckernel_copy_sse2(d, s, n);
+        return;
+    }
+
+    const __m256i last = _mm256_loadu_si256((const __m256i*)(s + n - 32));
+    char* const dLast = d + n - 32;
+
+    if( n >= CKERNEL_NT_THRESHOLD ) {
+        const size_t skip = CKERNEL_ALIGN_SKIP(d, 32);
+        _mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+        d += skip; s += skip; n -= skip;
+        for( ; n >= 128; d += 128, s += 128, n -= 128 ) {
+            _mm256_stream_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+            _mm256_stream_si256((__m256i*)(d + 32), _mm256_loadu_si256((const __m256i*)(s + 32)));
+            _mm256_stream_si256((__m256i*)(d + 64), _mm256_loadu_si256((const __m256i*)(s + 64)));
+            _mm256_stream_si256((__m256i*)(d + 96), _mm256_loadu_si256((const __m256i*)(s + 96)));
+        }
+        _mm_sfence();
+    }
+
+    for( ; n >= 128; d += 128, s += 128, n -= 128 ) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*)s);
+        const __m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+        const __m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+        const __m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+        _mm256_storeu_si256((__m256i*)d, a);
+        _mm256_storeu_si256((__m256i*)(d + 32), b);
+        _mm256_storeu_si256((__m256i*)(d + 64), c);
+        _mm256_storeu_si256((__m256i*)(d + 96), e);
+    }
+    for( ; n >= 32; d += 32, s += 32, n -= 32 ) {
+        _mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+    }
+    _mm256_storeu_si256((__m256i*)dLast, last);
+}
+
+__attribute__((target("avx2")))
+static void _ckernel_zero_avx2(void* dst, size_t n) {
+    char* d = dst;
+    if( n < 32 ) {
+        _ckernel_zero_sse2(d, n);
+        return;
+    }
+
+    const __m256i z = _mm256_setzero_si256();
+    char* const dLast = d + n - 32;
+
+    if( n >= CKERNEL_NT_THRESHOLD ) {
+        const size_t skip = CKERNEL_ALIGN_SKIP(d, 32);
+        _mm256_storeu_si256((__m256i*)d, z);
+        d += skip; n -= skip;
+        for( ; n >= 128; d += 128, n -= 128 ) {
+            _mm256_stream_si256((__m256i*)d, z);
+            _mm256_stream_si256((__m256i*)(d + 32), z);
+            _mm256_stream_si256((__m256i*)(d + 64), z);
+            _mm256_stream_si256((__m256i*)(d + 96), z);
+        }
+        _mm_sfence();
+    }
+
+    for( ; n >= 128; d += 128, n -= 128 ) {
+        _mm256_storeu_si256((__m256i*)d, z);
+        _mm256_storeu_si256((__m256i*)(d + 32), z);
+        _mm256_storeu_si256((__m256i*)(d + 64), z);
+        _mm256_storeu_si256((__m256i*)(d + 96), z);
+    }
+    for( ; n >= 32; d += 32, n -= 32 ) {
+        _mm256_storeu_si256((__m256i*)d, z);
+    }
+    _mm256_storeu_si256((__m256i*)dLast, z);
+}
+
+__attribute__((target("avx512f")))
+static void _ckernel_copy_avx512(void* dst, const void* src, size_t n) {
+    char* d = dst;
+    const char* s = src;
+    if( n < 64 ) {
+        _ckernel_copy_avx2(d, s, n);
+        return;
+    }
+
+    const __m512i last = _mm512_loadu_si512((const void*)(s + n - 64));
+    char* const dLast = d + n - 64;
+
+    if( n >= CKERNEL_NT_THRESHOLD ) {
+        const size_t skip = CKERNEL_ALIGN_SKIP(d, 64);
+        _mm512_storeu_si512((void*)d, _mm512_loadu_si512((const void*)s));
+        d += skip; s += skip; n -= skip;
+        for( ; n >= 256; d += 256, s += 256, n -= 256 ) {
+            _mm512_stream_si512((void*)d, _mm512_loadu_si512((const void*)s));
+            _mm512_stream_si512((void*)(d + 64), _mm512_loadu_si512((const void*)(s + 64)));
+            _mm512_stream_si512((void*)(d + 128), _mm512_loadu_si512((const void*)(s + 128)));
+            _mm512_stream_si512((void*)(d + 192), _mm512_loadu_si512((const void*)(s + 192)));
+        }
+        _mm_sfence();
+    }
+
+    for( ; n >= 256; d += 256, s += 256, n -= 256 ) {
+        const __m512i a = _mm512_loadu_si512((const void*)s);
+        const __m512i b = _mm512_loadu_si512((const void*)(s + 64));
+        const __m512i c = _mm512_loadu_si512((const void*)(s + 128));
+        const __m512i e = _mm512_loadu_si512((const void*)(s + 192));
+        _mm512_storeu_si512((void*)d, a);
+        _mm512_storeu_si512((void*)(d + 64), b);
+        _mm512_storeu_si512((void*)(d + 128), c);
+        _mm512_storeu_si512((void*)(d + 192), e);
+    }
+    for( ; n >= 64; d += 64, s += 64, n -= 64 ) {
+        _mm512_storeu_si512((void*)d, _mm512_loadu_si512((const void*)s));
+    }
+    _mm512_storeu_si512((void*)dLast, last);
+}
+
+__attribute__((target("avx512f")))
+static void _ckernel_zero_avx512(void* dst, size_t n) {
+    char* d = dst;
+    if( n < 64 ) {
+        _ckernel_zero_avx2(d, n);
+        return;
+    }
+
+    const __m512i z = _mm512_setzero_si512();
+    char* const dLast = d + n - 64;
+
+    if( n >= CKERNEL_NT_THRESHOLD ) {
+        const size_t skip = CKERNEL_ALIGN_SKIP(d, 64);
+        _mm512_storeu_si512((void*)d, z);
+        d += skip; n -= skip;
+        for( ; n >= 256; d += 256, n -= 256 ) {
+            _mm512_stream_si512((void*)d, z);
+            _mm512_stream_si512((void*)(d + 64), z);
+            _mm512_stream_si512((void*)(d + 128), z);
+            _mm512_stream_si512((void*)(d + 192), z);
+        }
+        _mm_sfence();
+    }
+
+    for( ; n >= 256; d += 256, n -= 256 ) {
+        _mm512_storeu_si512((void*)d, z);
+        _mm512_storeu_si512((void*)(d + 64), z);
+        _mm512_storeu_si512((void*)(d + 128), z);
+        _mm512_storeu_si512((void*)(d + 192), z);
+    }
+    for( ; n >= 64; d += 64, n -= 64 ) {
+        _mm512_storeu_si512((void*)d, z);
+    }
+    _mm512_storeu_si512((void*)dLast, z);
+}
+
+#endif // CKERNEL_X86
+
+static const ckernel_copy_fn _ckernel_copy_fns[CKERNEL_COUNT] = {
+    _ckernel_copy_scalar,
+#if CKERNEL_X86
+    _ckernel_copy_sse2,
+    _ckernel_copy_avx2,
+    _ckernel_copy_avx512
+#endif
+};
+
+static const ckernel_zero_fn _ckernel_zero_fns[CKERNEL_COUNT] = {
+    _ckernel_zero_scalar,
+#if CKERNEL_X86
+    _ckernel_zero_sse2,
+    _ckernel_zero_avx2,
+    _ckernel_zero_avx512
+#endif
+};
+
+/* until the first call, these point at functions that pick the kernels and then call them. threads that race
+ * on the first call all pick the same kernels, so the stores don't need to be ordered.
+ */
+static void _ckernel_copy_first(void* dst, const void* src, size_t n);
+static void _ckernel_zero_first(void* dst, size_t n);
+static ckernel_copy_fn _ckernel_copy = _ckernel_copy_first;
+static ckernel_zero_fn _ckernel_zero = _ckernel_zero_first;
+
+static void _ckernel_copy_first(void* dst, const void* src, size_t n) {
+    cKernelSelect(cKernelBest());
+    _ckernel_copy(dst, src, n);
+}
+
+static void _ckernel_zero_first(void* dst, size_t n) {
+    cKernelSelect(cKernelBest());
+    _ckernel_zero(dst, n);
+}
+
+void cCopy(void* dst, const void* src, size_t n) {
+    __atomic_load_n(&_ckernel_copy, __ATOMIC_RELAXED)(dst, src, n);
+}
+
+void cZero(void* dst, size_t n) {
+    __atomic_load_n(&_ckernel_zero, __ATOMIC_RELAXED)(dst, n);
+}
+
+int cKernelBest(void) {
+#if CKERNEL_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports("avx512f") ) return CKERNEL_AVX512;
+    if( __builtin_cpu_supports("avx2") ) return CKERNEL_AVX2;
+    if( __builtin_cpu_supports("sse2") ) return CKERNEL_SSE2;
+#endif
+    return CKERNEL_SCALAR;
+}
+
+int cKernelSelect(int level) {
+    if( level < 0 || level > cKernelBest() ) {
+        return 0;
+    }
+
+    __atomic_store_n(&_ckernel_copy, _ckernel_copy_fns[level], __ATOMIC_RELAXED);
+    __atomic_store_n(&_ckernel_zero, _ckernel_zero_fns[level], __ATOMIC_RELAXED);
+    return 1;
+}
+
+const char* cKernelName(int level) {
+    static const char* const names[CKERNEL_COUNT] = { "scalar", "sse2", "avx2", "avx512" };
+    return (level >= 0 && level < CKERNEL_COUNT) ? names[level] : "?";
+}
+
+#endif // SQLITE_OS_OTHER
@@ -0,0 +1,42 @@
+/* Memory copy and zero kernels for the inmemfs and the allocator
+ *
+ * this header is shared with the microbenchmark (tools/kernel_bench.c), so it only depends on <stddef.h>.
+ *
+ * cCopy() and cZero() call the widest kernel the CPU supports; the choice is made on the first call.
+ * copies of at least CKERNEL_NT_THRESHOLD bytes use non-temporal stores, which bypass the cache: a copy that
+ * large would evict everything else from it, and the destination usually isn't read again right away.
+ */
+#ifndef SQLITE_COS_OS_COMPOSITE_KERNELS_H
+#define SQLITE_COS_OS_COMPOSITE_KERNELS_H
+
+#include <stddef.h>
+
+#ifndef CKERNEL_NT_THRESHOLD
+#define CKERNEL_NT_THRESHOLD (1024 * 1024)
+#endif
+
+/* the kernel sets, from narrowest to widest */
+#define CKERNEL_SCALAR 0
+#define CKERNEL_SSE2 1
+#define CKERNEL_AVX2 2
+#define CKERNEL_AVX512 3
+#define CKERNEL_COUNT 4
+
+/* copies n bytes from src to dst, which must not overlap */
+void cCopy(void* dst, const void* src, size_t n);
+
+/* sets n bytes at dst to zero */
+void cZero(void* dst, size_t n);
+
+/* returns the widest kernel set this CPU supports: one of CKERNEL_* */
+int cKernelBest(void);
+
+/* makes cCopy() and cZero() use the kernel set 'level' (e.g. to benchmark it); returns 1, or 0 if the CPU doesn't
+ * support it, and then leaves the choice alone
+ */
+int cKernelSelect(int level);
+
+/* the name of a kernel set, e.g. "avx2" */
+const char* cKernelName(int level);
+
+#endif
@@ -0,0 +1,168 @@
+/* Contains a small LZ77 codec for compressing inmemfs pages
+ *
+ * the format is a sequence of blocks, each of which copies some literal bytes from the input and then
+ * repeats a run of bytes that was already decompressed:
+ *
+ *   token: the high nibble is the literal count, the low nibble is the match length minus CLZ_MIN_MATCH;
+ *          a nibble of 15 is followed by extra length bytes, added on until one is less than 255
+ *   the literal bytes
+ *   the match offset, 2 bytes little-endian, then the match length's extra bytes
+ *
+ * the last block has no match: it ends where the input does. pages are small, so an offset always fits in 16 bits.
+ */
+
+#if SQLITE_OS_OTHER
+
+#include "os_composite.h"
+
+#include <string.h> /* for memcpy() and memset() */
+
+#define CLZ_MIN_MATCH 4
+#define CLZ_HASH_BITS 12
+#define CLZ_MAX_INPUT 0xffff /* positions are kept as 16-bit values */
+
+static unsigned int _clz_read32(const unsigned char* p) {
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int _clz_hash(unsigned int v) {
+    return (v * 2654435761u) >> (32 - CLZ_HASH_BITS);
+}
+
+/* appends the extra bytes of a length whose nibble was 15; returns the new output position, or -1 if out of room */
+static int _clz_put_len(unsigned char* dst, int out, int max, int len) {
+    while( len >= 255 ) {
+        if( out >= max ) return -1;
+        dst[out++] = 255;
+        len -= 255;
+    }
+
+    if( out >= max ) return -1;
+    dst[out++] = (unsigned char)len;
+    return out;
+}
+
+/* appends a block of nLit literals from lit, followed by a match of mlen bytes at offset back (no match if mlen is 0).
+ * returns the new output position, or -1 if out of room
+ */
+static int _clz_put_block(unsigned char* dst, int out, int max, const unsigned char* lit, int nLit, int offset, int mlen) {
+    const int mcode = mlen ? mlen - CLZ_MIN_MATCH : 0;
+    if( out >= max ) return -1;
+    dst[out++] = (unsigned char)( ((nLit < 15 ? nLit : 15) << 4) | (mcode < 15 ? mcode : 15) );
+
+    if( nLit >= 15 && (out = _clz_put_len(dst, out, max, nLit - 15)) < 0 ) return -1;
+    if( out + nLit > max ) return -1;
+    memcpy(&dst[out], lit, nLit);
+    out += nLit;
+
+    if( mlen == 0 ) {
+        return out;
+    }
+
+    if( out + 2 > max ) return -1;
+    dst[out++] = (unsigned char)(offset & 0xff);
+    dst[out++] = (unsigned char)(offset >> 8);
+    if( mcode >= 15 && (out = _clz_put_len(dst, out, max, mcode - 15)) < 0 ) return -1;
+    return out;
+}
+
+/* compresses the n bytes at zSrc into zDst; returns the compressed length, or 0 if it would take more than max
+ * bytes (the data doesn't compress well enough to be worth it)
+ */
+int cLzCompress(const char* zSrc, int n, char* zDst, int max) {
+    const unsigned char* src = (const unsigned char*)zSrc;
+    unsigned char* dst = (unsigned char*)zDst;
+    if( n > CLZ_MAX_INPUT ) {
+        return 0;
+    }
+
+    /* a stale or colliding entry just fails the comparison below, so the table doesn't need to be exact */
+    unsigned short table[1 << CLZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    int out = 0, anchor = 0, pos = 0;
+    while( pos + CLZ_MIN_MATCH <= n ) {
+        const unsigned int v = _clz_read32(&src[pos]);
+        const unsigned int h = _clz_hash(v);
+        const int cand = table[h];
+        table[h] = (unsigned short)pos;
+
+        if( cand >= pos || _clz_read32(&src[cand]) != v ) {
+            pos += 1 + ((pos - anchor) >> 6); /* skip ahead faster through data that isn't matching */
+            continue;
+        }
+
+        int mlen = CLZ_MIN_MATCH;
+        while( pos + mlen < n && src[cand + mlen] == src[pos + mlen] ) {
+            mlen++;
+        }
+
+        out = _clz_put_block(dst, out, max, &src[anchor], pos - anchor, pos - cand, mlen);
+        if( out < 0 ) {
+            return 0;
+        }
+
+        pos += mlen;
+        anchor = pos;
+    }
+
+    out = _clz_put_block(dst, out, max, &src[anchor], n - anchor, 0, 0);
+    return (out < 0) ? 0 : out;
+}
+
+/* reads the extra bytes of a length whose nibble was 15; returns the new input position, or -1 if the input ends */
+static int _clz_get_len(const unsigned char* src, int in, int n, int* pLen) {
+    unsigned char b;
+    do {
+        if( in >= n ) return -1;
+        b = src[in++];
+        *pLen += b;
+    } while( b == 255 );
+    return in;
+}
+
+/* decompresses the n bytes at zSrc into zDst, which has room for max bytes.
+ * returns the decompressed length, or -1 if the data is damaged
+ */
+int cLzDecompress(const char* zSrc, int n, char* zDst, int max) {
+    const unsigned char* src = (const unsigned char*)zSrc;
+    unsigned char* dst = (unsigned char*)zDst;
+
+    int in = 0, out = 0;
+    while( in < n ) {
+        const unsigned char token = src[in++];
+
+        int nLit = token >> 4;
+        if( nLit == 15 && (in = _clz_get_len(src, in, n, &nLit)) < 0 ) return -1;
+        if( nLit > n - in || nLit > max - out ) return -1;
+        memcpy(&dst[out], &src[in], nLit);
+        in += nLit;
+        out += nLit;
+
+        if( in == n ) {
+            break; /* the last block has no match */
+        }
+
+        if( in + 2 > n ) return -1;
+        const int offset = src[in] | (src[in + 1] << 8);
+        in += 2;
+
+        int mlen = token & 15;
+        if( mlen == 15 && (in = _clz_get_len(src, in, n, &mlen)) < 0 ) return -1;
+        mlen += CLZ_MIN_MATCH;
+        if( offset == 0 || offset > out || mlen > max - out ) return -1;
+
+        /* byte by byte: the match may overlap the bytes it produces */
+        int i;
+        for( i = 0; i < mlen; i++ ) {
+            dst[out + i] = dst[out - offset + i];
+        }
+        out += mlen;
+    }
+
+    return out;
+}
+
+#endif // SQLITE_OS_OTHER
@@ -1,122 +1,1062 @@
-
 #if SQLITE_OS_OTHER
 
 #include "os_composite.h"
+#include <string.h> /* for memset(), strchr(), strrchr() and strstr() */
 
-static char* _malloc_region(int sz);
-static void _free_region(char* region);
-
-static inline sqlite3_int64 max(sqlite3_int64 a, int b) {
-    sqlite3_int64 c = (sqlite3_int64)b;
-    return (a > c) ? a : c;
-}
-
-static char* _get_region(void* mem_allocation) {
-    return ((char*)mem_allocation) - sizeof(int);
-}
-
-static void* _get_memory(char* region_start) {
-    return (void*)(region_start + sizeof(int));
-}
+static void* _malloc_region(int sz);
+static void _free_region(void* mem);
+static int _region_size(void* mem);
+static int _region_roundup(int sz);
 
-static int _get_memory_size(void* mem_allocation) {
-    char* region_start = _get_region(mem_allocation);
-    const int sz = *((int*)region_start);
-    return sz;
-}
+/* guards the allocator's state. this is our own mutex rather than SQLITE_MUTEX_STATIC_MEM, which
+ * SQLite may already hold when it calls us. malloc() is thread-safe on its own, so SQLITE_MEM_USE_MALLOC
+ * builds don't take it.
+ */
+#if SQLITE_THREADSAFE && !SQLITE_MEM_USE_MALLOC
+static struct cMutex _mem_mutex; /* zero-initialized: an unlocked SQLITE_MUTEX_FAST */
+#define CMEM_MUTEX_ENTER() cMutexEnter( (sqlite3_mutex*)&_mem_mutex )
+#define CMEM_MUTEX_LEAVE() cMutexLeave( (sqlite3_mutex*)&_mem_mutex )
+#else
+#define CMEM_MUTEX_ENTER()
+#define CMEM_MUTEX_LEAVE()
+#endif
 
 #if SQLITE_MEM_USE_MALLOC
     #include <stdlib.h> /* for malloc() and free() */
 
-    static char* _malloc_region(int sz) {
-        char* region_start = malloc(sz + sizeof(int));
+    /* each allocation is preceded by a header holding its size; the header is 8 bytes so that
+     * the memory we hand out keeps malloc()'s 8-byte alignment
+     */
+    #define REGION_HEADER_SIZE 8
+
+    static void* _malloc_region(int sz) {
+        char* region_start = malloc(sz + REGION_HEADER_SIZE);
+        if( region_start == 0 ) return 0;
+
         *((int*)region_start) = sz;
-        composite_mem_app_data.outstanding_memory += sz + sizeof(int);
-        composite_mem_app_data.max_memory = max( composite_mem_app_data.outstanding_memory, composite_mem_app_data.max_memory );
-        return region_start;
+        return region_start + REGION_HEADER_SIZE;
+    }
+
+    static void _free_region(void* mem) {
+        free( ((char*)mem) - REGION_HEADER_SIZE );
+    }
+
+    static int _region_size(void* mem) {
+        return *((int*)(((char*)mem) - REGION_HEADER_SIZE));
+    }
+
+    /* the bytes an allocation counts against outstanding_memory */
+    static int _region_footprint(void* mem) {
+        return _region_size(mem) + REGION_HEADER_SIZE;
+    }
+
+    static int _region_roundup(int sz) {
+        return (sz + 7) & ~7;
+    }
+
+    static void _region_stats(struct composite_mem_stats* pStats) {
+        /* the system allocator's arena isn't ours to look at */
+    }
+
+    static int _region_init() {
+        return 1;
+    }
+
+    static void _region_trim() {
     }
 
-    static void _free_region(char* region) {
-        const int sz = *((int*)region);
-        composite_mem_app_data.outstanding_memory -= sz + sizeof(int);
-        free(region);
+    static void _region_set_budget(sqlite3_int64 nBytes) {
+        /* malloc() has no budget of ours */
     }
 #else
-    #define MEMORY_ARENA_SIZE (1024*1024*4) //4MB
-    static char memory_arena[MEMORY_ARENA_SIZE];
+    /* a size-class slab allocator
+     *
+     * the arena is split into SLAB_SIZE slabs. a slab is either free, holds objects of a single size
+     * class, or is part of a run of slabs holding one large allocation. metadata lives in _slabs[],
+     * a side table indexed by slab number, so allocations carry no header: the size of an allocation
+     * is found from the slab it lives in.
+     *
+     * each slab of small objects has its own free list. slabs with free objects are kept on a
+     * per-class list, so malloc() and free() of small objects are O(1). a slab whose objects have
+     * all been freed goes back to the free slab list, where any class (or a large allocation) can reuse it.
+     *
+     * the arena, and _slabs[] and the bitmap alongside it, is a range of address space that's reserved when the allocator is
+     * initialized, but not backed by memory: slabs are made usable CMEM_COMMIT_SLABS at a time as the arena grows.
+     * once more than CMEM_RETAIN_SLABS slabs are free, the pages of the slabs that are freed after that are handed
+     * back to the kernel, so the process's resident memory follows what's allocated rather than its peak. the free
+     * slab list keeps the resident slabs at its head and the given-back ones at its tail, so the retained slabs are
+     * the ones reused first. a bitmap of the same free slabs, a bit per slab, lets a large allocation find a run of
+     * them a word at a time.
+     * the budget (see composite_mem_set_budget()) caps the slabs in use, not how far into the arena they are.
+     */
+    #include <fcntl.h> /* for open() */
+    #include <stdlib.h> /* for strtoll() */
+    #include <unistd.h> /* for read(), close() and sysconf() */
+    #include <sys/mman.h> /* for mmap(), mprotect() and madvise() */
 
-    static char* _free_memory = &memory_arena[0];
+    #ifndef CMEM_ARENA_RESERVE
+    #define CMEM_ARENA_RESERVE ((sqlite3_int64)256 << 30) /* 256GB of address space; less if the system won't reserve that */
+    #endif
+    #define CMEM_COMMIT_SLABS 64 /* 1MB */
+    #define CMEM_RETAIN_SLABS 64
 
-    static char* _malloc_region(int sz) {
-        /* make sure that we have enough memory left */
-        const char* _memory_extent = &memory_arena[0] + MEMORY_ARENA_SIZE;
-        sqlite3_int64 mem_remaining = (_memory_extent - _free_memory);
-        if( _free_memory + sz >= _memory_extent ) return 0;
+    #define SLAB_SIZE (16*1024)
+    #define SLAB_NONE (-1)
 
-        char* region_start = _free_memory;
-        _free_memory += sz;
+    #define SIZE_CLASS_COUNT 32 /* 16..128 in steps of 16, then 4 classes per power of two up to 8192 */
+    #define SIZE_CLASS_MAX 8192 /* anything larger is a large allocation */
 
-        *((int*)region_start) = sz;
-        composite_mem_app_data.outstanding_memory += sz + sizeof(int);
-        composite_mem_app_data.max_memory = max( composite_mem_app_data.outstanding_memory, composite_mem_app_data.max_memory );
-        return region_start;
+    #define SLAB_FREE 0
+    #define SLAB_SMALL 1 /* holds objects of a single size class */
+    #define SLAB_LARGE 2 /* the first slab of a large allocation */
+    #define SLAB_LARGE_TAIL 3 /* the remaining slabs of a large allocation */
+
+    struct slab {
+        int kind; /* one of SLAB_* */
+        int cls; /* SLAB_SMALL: the size class of the objects in this slab */
+        int nSlabs; /* SLAB_LARGE: the number of slabs in the run */
+        int nUsed; /* SLAB_SMALL: the number of objects that are allocated */
+        int nCarved; /* SLAB_SMALL: objects [0, nCarved) have been handed out at least once */
+        void* freeList; /* SLAB_SMALL: objects that have been freed, linked through their first word */
+        int prev; /* links on the class's partial list, or on the free slab list */
+        int next;
+        int resident; /* 1 if the slab's pages may be in memory; 0 if it's never been used, or they were given back */
+    };
+
+    static char* _arena = 0;
+    static struct slab* _slabs = 0;
+    static sqlite3_uint64* _slab_free_bits = 0; /* bit i is set if slab i is on the free slab list */
+    static int _slab_partial[SIZE_CLASS_COUNT]; /* per class, the slabs that have room for another object */
+    static int _slab_free_list = SLAB_NONE; /* slabs that were used and then released; resident ones first */
+    static int _slab_free_tail = SLAB_NONE;
+    static int _slab_top = 0; /* slabs [_slab_top, _slab_reserved) have never been used */
+    static int _slab_reserved = 0; /* the number of slabs the arena has room for */
+    static int _slab_committed = 0; /* slabs [0, _slab_committed), and their entries in _slabs[], are usable */
+    static int _slab_budget = 0; /* the most slabs that may be in use at once */
+    static int _slab_nInUse = 0;
+    static int _slab_nRetained = 0; /* free slabs that are still resident */
+    static sqlite3_int64 _cmem_budget = 0; /* from composite_mem_set_budget(); 0 for the default */
+    static int _slab_initialized = 0;
+
+    static char* _slab_base(int i) {
+        return _arena + (sqlite3_int64)i * SLAB_SIZE;
+    }
+
+    static int _slab_index(void* mem) {
+        return (int)( (((char*)mem) - _arena) / SLAB_SIZE );
+    }
+
+    /* returns the size class for an allocation of sz bytes; sz must be in [1, SIZE_CLASS_MAX] */
+    static int _size_class(int sz) {
+        if( sz <= 128 ) {
+            return (sz - 1) >> 4;
+        }
+
+        /* 2^p < sz <= 2^(p+1); the doubling is split into 4 steps of 2^(p-2) */
+        const int p = 31 - __builtin_clz( (unsigned int)(sz - 1) );
+        return 8 + (p - 7) * 4 + ( (sz - 1 - (1 << p)) >> (p - 2) );
+    }
+
+    static int _class_size(int cls) {
+        if( cls < 8 ) {
+            return (cls + 1) * 16;
+        }
+
+        const int p = 7 + (cls - 8) / 4;
+        return (1 << p) + ((cls - 8) % 4 + 1) * (1 << (p - 2));
+    }
+
+    /* reads a memory limit from a cgroup file; returns it, or 0 if there's no file or no limit */
+    static sqlite3_int64 _cgroup_limit(const char* zPath) {
+        char buf[32];
+        const int fd = open(zPath, O_RDONLY);
+        if( fd < 0 ) {
+            return 0;
+        }
+        const ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if( n <= 0 || buf[0] < '0' || buf[0] > '9' ) {
+            return 0; /* cgroup v2 says "max" for no limit */
+        }
+
+        buf[n] = 0;
+        const sqlite3_int64 limit = strtoll(buf, 0, 10);
+        return (limit >= ((sqlite3_int64)1 << 60)) ? 0 : limit; /* cgroup v1's "no limit" is just a very large number */
+    }
+
+    /* lowers *pBudget to the tightest limit of the cgroup at zDir (e.g. "/a/b") and its ancestors, whose
+     * hierarchy is mounted at zMount; zDir is cut down as we go
+     */
+    static void _cgroup_walk(const char* zMount, char* zDir, const char* zFile, sqlite3_int64* pBudget) {
+        char zPath[MAX_PATHNAME + 64];
+        for(;;) {
+            sqlite3_snprintf(sizeof(zPath), zPath, "%s%s/%s", zMount, (zDir[1] == 0) ? "" : zDir, zFile);
+            const sqlite3_int64 limit = _cgroup_limit(zPath);
+            if( limit > 0 && (*pBudget == 0 || limit < *pBudget) ) {
+                *pBudget = limit;
+            }
+
+            /* in a container, only the container's own part of the hierarchy may be mounted, which ends at the root */
+            char* zSlash = strrchr(zDir, '/');
+            if( zSlash == 0 || zDir[1] == 0 ) break;
+            zSlash[ (zSlash == zDir) ? 1 : 0 ] = 0;
+        }
+    }
+
+    /* the default budget: the tightest memory limit of the process's cgroup and its ancestors, under cgroup v2
+     * (memory.max) or v1 (memory.limit_in_bytes), or the physical memory if there's no limit
+     */
+    static sqlite3_int64 _cmem_default_budget() {
+        sqlite3_int64 budget = 0;
+
+        /* a cgroup v1 system lists a line per hierarchy, which can run past a single read */
+        char zCgroups[4096];
+        const int fd = open("/proc/self/cgroup", O_RDONLY);
+        size_t n = 0;
+        if( fd >= 0 ) {
+            ssize_t got;
+            while( n < sizeof(zCgroups) - 1 && (got = read(fd, zCgroups + n, sizeof(zCgroups) - 1 - n)) > 0 ) {
+                n += (size_t)got;
+            }
+            close(fd);
+        }
+        if( n == sizeof(zCgroups) - 1 ) {
+            while( n > 0 && zCgroups[n-1] != '\n' ) n--; /* a line cut off by a full buffer isn't walked */
+        }
+
+        /* one "id:controllers:/path" line per hierarchy; v2's is "0::/path" */
+        char* zLine = zCgroups;
+        zCgroups[n] = 0;
+        while( *zLine ) {
+            char* zEnd = strchr(zLine, '\n');
+            if( zEnd ) *zEnd = 0;
+
+            char* zControllers = strchr(zLine, ':');
+            char* zDir = zControllers ? strchr(zControllers + 1, ':') : 0;
+            if( zDir && zDir[1] == '/' ) {
+                *zDir++ = 0;
+                zControllers++;
+                if( zControllers[0] == 0 ) {
+                    _cgroup_walk("/sys/fs/cgroup", zDir, "memory.max", &budget);
+                } else if( strstr(zControllers, "memory") ) {
+                    _cgroup_walk("/sys/fs/cgroup/memory", zDir, "memory.limit_in_bytes", &budget);
+                }
+            }
+
+            if( zEnd == 0 ) break;
+            zLine = zEnd + 1;
+        }
+
+        if( budget == 0 ) {
+            budget = (sqlite3_int64)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+        }
+        return budget;
+    }
+
+    static void _slab_set_budget(sqlite3_int64 nBytes) {
+        const sqlite3_int64 nSlabs = nBytes / SLAB_SIZE;
+        _slab_budget = (nSlabs < _slab_reserved) ? (int)nSlabs : _slab_reserved;
+    }
+
+    /* reserves the arena; returns 1, or 0 if not even CMEM_COMMIT_SLABS slabs of address space can be reserved */
+    static int _slab_init() {
+        sqlite3_int64 nSlabs = CMEM_ARENA_RESERVE / SLAB_SIZE;
+        if( nSlabs > 0x7fffffff ) nSlabs = 0x7fffffff - CMEM_COMMIT_SLABS;
+        nSlabs -= nSlabs % CMEM_COMMIT_SLABS;
+
+        /* a system that limits address space (ulimit -v) may not allow the whole reservation */
+        for( ; nSlabs >= CMEM_COMMIT_SLABS; nSlabs = (nSlabs / 2) - (nSlabs / 2) % CMEM_COMMIT_SLABS ) {
+            void* arena = mmap(0, (size_t)nSlabs * SLAB_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if( arena == MAP_FAILED ) {
+                continue;
+            }
+            void* slabs = mmap(0, (size_t)nSlabs * sizeof(struct slab), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if( slabs == MAP_FAILED ) {
+                munmap(arena, (size_t)nSlabs * SLAB_SIZE);
+                continue;
+            }
+            void* bits = mmap(0, (size_t)nSlabs / 8, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if( bits == MAP_FAILED ) {
+                munmap(slabs, (size_t)nSlabs * sizeof(struct slab));
+                munmap(arena, (size_t)nSlabs * SLAB_SIZE);
+                continue;
+            }
+
+            _arena = (char*)arena;
+            _slabs = (struct slab*)slabs;
+            _slab_free_bits = (sqlite3_uint64*)bits;
+            break;
+        }
+        if( _arena == 0 ) {
+            return 0;
+        }
+
+        int i;
+        for( i = 0; i < SIZE_CLASS_COUNT; i++ ) {
+            _slab_partial[i] = SLAB_NONE;
+        }
+        _slab_free_list = SLAB_NONE;
+        _slab_free_tail = SLAB_NONE;
+        _slab_top = 0;
+        _slab_reserved = (int)nSlabs;
+        _slab_committed = 0;
+        _slab_set_budget( _cmem_budget ? _cmem_budget : _cmem_default_budget() );
+        _slab_initialized = 1;
+        return 1;
+    }
+
+    /* makes bytes [from, to) of a reserved side table usable; its pages are shared by neighbouring entries, so the
+     * range is widened to whole pages
+     */
+    static int _slab_commit_table(void* table, size_t from, size_t to) {
+        const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        from &= ~(page - 1);
+        to = (to + page - 1) & ~(page - 1);
+        return mprotect((char*)table + from, to - from, PROT_READ | PROT_WRITE) == 0;
+    }
+
+    /* makes slabs [0, nSlabs) usable; returns 1, or 0 if the system is out of memory to back them */
+    static int _slab_commit(int nSlabs) {
+        if( nSlabs <= _slab_committed ) {
+            return 1;
+        }
+
+        sqlite3_int64 target = nSlabs + CMEM_COMMIT_SLABS - 1;
+        target -= target % CMEM_COMMIT_SLABS;
+        if( target > _slab_reserved ) target = _slab_reserved;
+
+        if( !_slab_commit_table(_slabs, (size_t)_slab_committed * sizeof(struct slab), (size_t)target * sizeof(struct slab)) ) {
+            return 0;
+        }
+        if( !_slab_commit_table(_slab_free_bits, (size_t)_slab_committed / 8, (size_t)target / 8) ) {
+            return 0;
+        }
+        if( mprotect(_slab_base(_slab_committed), (size_t)(target - _slab_committed) * SLAB_SIZE, PROT_READ | PROT_WRITE) != 0 ) {
+            return 0;
+        }
+
+        _slab_committed = (int)target;
+        return 1;
+    }
+
+    /* counts slab i as in use */
+    static void _slab_claim(int i) {
+        if( _slabs[i].resident ) {
+            _slab_nRetained--;
+        }
+        _slabs[i].resident = 1;
+        _slab_nInUse++;
+    }
+
+    /* doubly-linked slab lists, threaded through _slabs[].prev/next */
+    static void _slab_list_push(int* head, int i) {
+        _slabs[i].prev = SLAB_NONE;
+        _slabs[i].next = *head;
+        if( *head != SLAB_NONE ) _slabs[*head].prev = i;
+        *head = i;
+    }
+
+    static void _slab_list_remove(int* head, int i) {
+        if( _slabs[i].prev != SLAB_NONE ) _slabs[ _slabs[i].prev ].next = _slabs[i].next;
+        else *head = _slabs[i].next;
+        if( _slabs[i].next != SLAB_NONE ) _slabs[ _slabs[i].next ].prev = _slabs[i].prev;
+    }
+
+    /* the free slab list also keeps its tail: a resident slab goes on at the head, one whose pages were given back
+     * at the tail. _slab_free_bits[] follows the list
+     */
+    static void _slab_free_push(int i) {
+        _slab_free_bits[i / 64] |= (sqlite3_uint64)1 << (i % 64);
+        if( _slabs[i].resident || _slab_free_list == SLAB_NONE ) {
+            _slab_list_push(&_slab_free_list, i);
+            if( _slab_free_tail == SLAB_NONE ) _slab_free_tail = i;
+        } else {
+            _slabs[i].prev = _slab_free_tail;
+            _slabs[i].next = SLAB_NONE;
+            _slabs[_slab_free_tail].next = i;
+            _slab_free_tail = i;
+        }
+    }
+
+    static void _slab_free_remove(int i) {
+        _slab_free_bits[i / 64] &= ~( (sqlite3_uint64)1 << (i % 64) );
+        if( _slab_free_tail == i ) _slab_free_tail = _slabs[i].prev;
+        _slab_list_remove(&_slab_free_list, i);
+    }
+
+    /* takes one slab off the free list, or from the untouched part of the arena; returns SLAB_NONE if there is none,
+     * or the budget is used up
+     */
+    static int _slab_acquire() {
+        if( _slab_nInUse >= _slab_budget ) {
+            return SLAB_NONE;
+        }
+
+        int i = SLAB_NONE;
+        if( _slab_free_list != SLAB_NONE ) {
+            i = _slab_free_list;
+            _slab_free_remove(i);
+        } else if( _slab_top < _slab_reserved && _slab_commit(_slab_top + 1) ) {
+            i = _slab_top++;
+        }
+
+        if( i != SLAB_NONE ) {
+            _slab_claim(i);
+        }
+        return i;
+    }
+
+    /* releases slabs [i, i + n); past the first CMEM_RETAIN_SLABS free slabs, their pages go back to the kernel */
+    static void _slab_release_run(int i, int n) {
+        int j;
+        const int bRetain = (_slab_nRetained + n <= CMEM_RETAIN_SLABS);
+        if( bRetain ) {
+            _slab_nRetained += n;
+        } else {
+            madvise(_slab_base(i), (size_t)n * SLAB_SIZE, MADV_DONTNEED);
+        }
+
+        for( j = i; j < i + n; j++ ) {
+            _slabs[j].kind = SLAB_FREE;
+            _slabs[j].resident = bRetain;
+            _slab_free_push(j);
+        }
+        _slab_nInUse -= n;
+    }
+
+    static void _slab_release(int i) {
+        _slab_release_run(i, 1);
+    }
+
+    /* looks for n contiguous released slabs, skipping a word of _slab_free_bits[] at a time where it's all set or all
+     * clear; returns the first, or SLAB_NONE. *pTail is set to the length of the run of released slabs that ends
+     * at _slab_top
+     */
+    static int _slab_find_run(int n, int* pTail) {
+        int i = 0, run = 0;
+        while( i < _slab_top ) {
+            int avail = 64 - i % 64;
+            if( avail > _slab_top - i ) avail = _slab_top - i;
+            sqlite3_uint64 bits = _slab_free_bits[i / 64] >> (i % 64);
+            if( avail < 64 ) bits &= ((sqlite3_uint64)1 << avail) - 1;
+
+            if( bits & 1 ) {
+                int ones = (~bits == 0) ? 64 : __builtin_ctzll(~bits);
+                if( ones > avail ) ones = avail;
+                run += ones;
+                i += ones;
+                if( run >= n ) return i - run;
+            } else {
+                run = 0;
+                i += (bits == 0) ? avail : __builtin_ctzll(bits);
+            }
+        }
+
+        *pTail = run;
+        return SLAB_NONE;
+    }
+
+    /* finds n contiguous free slabs for a large allocation; returns the first, or SLAB_NONE */
+    static int _slab_acquire_run(int n) {
+        int start, i, tail = 0;
+
+        if( _slab_nInUse + n > _slab_budget ) {
+            return SLAB_NONE;
+        }
+
+        /* released slabs: look for a run among them first, so the untouched part of the arena lasts */
+        start = _slab_find_run(n, &tail);
+        if( start != SLAB_NONE ) {
+            for( i = start; i < start + n; i++ ) {
+                _slab_free_remove(i);
+                _slab_claim(i);
+            }
+            return start;
+        }
+
+        /* a run can also end in the untouched part of the arena */
+        start = _slab_top - tail;
+        if( start + n > _slab_reserved || !_slab_commit(start + n) ) {
+            return SLAB_NONE;
+        }
+
+        for( i = start; i < _slab_top; i++ ) {
+            _slab_free_remove(i);
+        }
+        if( _slab_top < start + n ) {
+            _slab_top = start + n;
+        }
+        for( i = start; i < start + n; i++ ) {
+            _slab_claim(i);
+        }
+        return start;
+    }
+
+    /* hands the pages of every free slab back to the kernel */
+    static void _slab_trim() {
+        int i;
+        for( i = _slab_free_list; i != SLAB_NONE && _slab_nRetained > 0; i = _slabs[i].next ) {
+            if( _slabs[i].resident ) {
+                madvise(_slab_base(i), SLAB_SIZE, MADV_DONTNEED);
+                _slabs[i].resident = 0;
+                _slab_nRetained--;
+            }
+        }
+    }
+
+    static void* _malloc_small(int cls) {
+        int i = _slab_partial[cls];
+        if( i == SLAB_NONE ) {
+            i = _slab_acquire();
+            if( i == SLAB_NONE ) return 0;
+
+            _slabs[i].kind = SLAB_SMALL;
+            _slabs[i].cls = cls;
+            _slabs[i].nUsed = 0;
+            _slabs[i].nCarved = 0;
+            _slabs[i].freeList = 0;
+            _slab_list_push(&_slab_partial[cls], i);
+        }
+
+        struct slab* slab = &_slabs[i];
+        void* mem;
+        if( slab->freeList ) {
+            mem = slab->freeList;
+            slab->freeList = *((void**)mem);
+        } else {
+            mem = _slab_base(i) + slab->nCarved * _class_size(cls);
+            slab->nCarved++;
+        }
+
+        slab->nUsed++;
+        if( slab->nUsed == SLAB_SIZE / _class_size(cls) ) {
+            _slab_list_remove(&_slab_partial[cls], i); /* the slab is full */
+        }
+
+        return mem;
     }
 
-    static void _free_region(char* region) {
-        //Do nothing
+    static void _free_small(int i, void* mem) {
+        struct slab* slab = &_slabs[i];
+        const int cls = slab->cls;
+
+        if( slab->nUsed == SLAB_SIZE / _class_size(cls) ) {
+            _slab_list_push(&_slab_partial[cls], i); /* the slab was full; it has room again */
+        }
+
+        *((void**)mem) = slab->freeList;
+        slab->freeList = mem;
+        slab->nUsed--;
+
+        if( slab->nUsed == 0 ) {
+            _slab_list_remove(&_slab_partial[cls], i);
+            _slab_release(i);
+        }
+    }
+
+    static void* _malloc_region(int sz) {
+        if( !_slab_initialized && !_slab_init() ) return 0;
+        if( sz <= 0 ) sz = 1;
+
+        void* mem;
+        if( sz <= SIZE_CLASS_MAX ) {
+            mem = _malloc_small( _size_class(sz) );
+        } else {
+            const int n = (sz + SLAB_SIZE - 1) / SLAB_SIZE;
+            const int i = _slab_acquire_run(n);
+            mem = 0;
+            if( i != SLAB_NONE ) {
+                int j;
+                _slabs[i].kind = SLAB_LARGE;
+                _slabs[i].nSlabs = n;
+                for( j = i + 1; j < i + n; j++ ) {
+                    _slabs[j].kind = SLAB_LARGE_TAIL;
+                }
+                mem = _slab_base(i);
+            }
+        }
+
+        return mem;
+    }
+
+    static void _free_region(void* mem) {
+        const int i = _slab_index(mem);
+
+        if( _slabs[i].kind == SLAB_SMALL ) {
+            _free_small(i, mem);
+        } else {
+            _slab_release_run(i, _slabs[i].nSlabs);
+        }
+    }
+
+    static int _region_size(void* mem) {
+        const struct slab* slab = &_slabs[ _slab_index(mem) ];
+        if( slab->kind == SLAB_SMALL ) {
+            return _class_size(slab->cls);
+        }
+        return slab->nSlabs * SLAB_SIZE;
+    }
+
+    static int _region_footprint(void* mem) {
+        return _region_size(mem);
+    }
+
+    static int _region_roundup(int sz) {
+        if( sz <= 0 ) sz = 1;
+        if( sz <= SIZE_CLASS_MAX ) {
+            return _class_size( _size_class(sz) );
+        }
+        return ((sz + SLAB_SIZE - 1) / SLAB_SIZE) * SLAB_SIZE;
+    }
+
+    /* the arena's size is its budget; the free slabs are the ones the budget still allows */
+    static void _region_stats(struct composite_mem_stats* pStats) {
+        pStats->arena_size = (sqlite3_int64)_slab_budget * SLAB_SIZE;
+        pStats->arena_reserved = (sqlite3_int64)_slab_reserved * SLAB_SIZE;
+        pStats->arena_committed = (sqlite3_int64)_slab_committed * SLAB_SIZE;
+        pStats->retained_bytes = (sqlite3_int64)_slab_nRetained * SLAB_SIZE;
+        pStats->nSlab = _slab_budget;
+        pStats->nSlabTouched = _slab_top;
+        pStats->nSlabFree = (_slab_budget > _slab_nInUse) ? _slab_budget - _slab_nInUse : 0;
+
+        /* the untouched part of the arena continues the run of free slabs at its end */
+        int i, run = 0;
+        for( i = 0; i <= _slab_top; i++ ) {
+            const int kind = (i < _slab_top) ? _slabs[i].kind : SLAB_FREE;
+            if( kind == SLAB_FREE ) {
+                run += (i < _slab_top) ? 1 : _slab_reserved - _slab_top;
+                if( run > pStats->nLargestFreeRun ) pStats->nLargestFreeRun = run;
+                continue;
+            }
+
+            run = 0;
+            if( kind == SLAB_SMALL ) {
+                pStats->nSlabSmall++;
+                pStats->small_bytes += (sqlite3_int64)_slabs[i].nUsed * _class_size(_slabs[i].cls);
+            } else {
+                pStats->nSlabLarge++;
+            }
+        }
+        if( pStats->nLargestFreeRun > pStats->nSlabFree ) {
+            pStats->nLargestFreeRun = pStats->nSlabFree;
+        }
+    }
+
+    static int _region_init() {
+        return _slab_initialized || _slab_init();
+    }
+
+    static void _region_trim() {
+        if( _slab_initialized ) _slab_trim();
+    }
+
+    static void _region_set_budget(sqlite3_int64 nBytes) {
+        _cmem_budget = nBytes;
+        if( _slab_initialized ) {
+            _slab_set_budget( nBytes ? nBytes : _cmem_default_budget() );
+        }
+    }
+#endif
+
+/* thread caches
+ *
+ * every thread that allocates gets a struct cmem_thread of its own. it counts the thread's allocations and frees
+ * in 'pending', which the thread folds into composite_mem_app_data only once it has drifted by CMEM_COUNTER_BATCH
+ * bytes, so the shared counters' cache line isn't written on every call; cMemStats() sums the rest lazily.
+ *
+ * in slab builds it also holds a magazine per size class: a stack of small objects the thread can hand out and take
+ * back without the allocator's mutex. an empty magazine is refilled with half its capacity of objects, and a full
+ * one flushes the older half back to the slabs, in one mutex acquisition each. objects freed by another thread than
+ * the one that allocated them simply go into the freeing thread's magazine, and flow back to the slabs from there.
+ *
+ * the caches come from the system allocator and are never freed, so cMemStats() can always walk them. when a thread
+ * exits, its magazines are flushed and its cache is handed on to the next new thread.
+ */
+#if SQLITE_THREADSAFE
+    #include <pthread.h> /* for the thread-exit hook */
+    #include <stdlib.h> /* for calloc() */
+
+    #ifndef CMEM_MAGAZINE_SIZE
+    #define CMEM_MAGAZINE_SIZE 32 /* the most objects of one size class a thread keeps; 0 turns the magazines off */
+    #endif
+    #define CMEM_MAGAZINE_BYTES (16*1024) /* ... and the most bytes, so the larger classes keep fewer */
+    #define CMEM_COUNTER_BATCH (64*1024)
+
+    #define CMEM_MAGAZINES ( !SQLITE_MEM_USE_MALLOC && CMEM_MAGAZINE_SIZE > 0 )
+
+    #if CMEM_MAGAZINES
+    struct cmem_magazine {
+        int n; /* objs[0, n) are cached; only the owning thread writes it */
+        void* objs[CMEM_MAGAZINE_SIZE];
+    };
+    #endif
+
+    struct cmem_thread {
+        struct cmem_thread* next; /* every cache that has been created, newest first */
+        int inUse; /* 1 while a thread owns the cache */
+
+        /* only the owning thread writes these; they're stored atomically so that cMemStats() can read them */
+        sqlite3_int64 pending; /* bytes allocated minus bytes freed, not yet in composite_mem_app_data */
+        sqlite3_uint64 nHit; /* allocations served from a magazine */
+        sqlite3_uint64 nRefill;
+        sqlite3_uint64 nFlush;
+
+        #if CMEM_MAGAZINES
+        struct cmem_magazine mags[SIZE_CLASS_COUNT];
+        #endif
+    };
+
+    static struct cmem_thread* _cmem_threads = 0;
+    static __thread struct cmem_thread* _cmem_self = 0;
+    static __thread int _cmem_exited = 0; /* the thread is exiting, and has given up its cache */
+    static pthread_key_t _cmem_key;
+    static pthread_once_t _cmem_key_once = PTHREAD_ONCE_INIT;
+    static int _cmem_key_ok = 0;
+
+    #if CMEM_MAGAZINES
+    static void _cmem_store(sqlite3_uint64* counter, sqlite3_uint64 value) {
+        __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+    }
+
+    static int _cmem_magazine_capacity(int cls) {
+        const int n = CMEM_MAGAZINE_BYTES / _class_size(cls);
+        return (n < CMEM_MAGAZINE_SIZE) ? n : CMEM_MAGAZINE_SIZE;
+    }
+
+    /* takes half a magazine's worth of objects of class cls from the slabs; returns how many it got */
+    static int _cmem_refill(struct cmem_thread* t, int cls) {
+        struct cmem_magazine* mag = &t->mags[cls];
+        const int want = (_cmem_magazine_capacity(cls) + 1) / 2;
+        int n = mag->n;
+
+        CMEM_MUTEX_ENTER();
+        while( n < want && _region_init() ) {
+            void* mem = _malloc_small(cls);
+            if( mem == 0 ) break;
+            mag->objs[n++] = mem;
+        }
+        CMEM_MUTEX_LEAVE();
+
+        const int got = n - mag->n;
+        __atomic_store_n(&mag->n, n, __ATOMIC_RELAXED);
+        _cmem_store(&t->nRefill, t->nRefill + 1);
+        return got;
+    }
+
+    /* returns the oldest nFlush objects of class cls to the slabs; the mutex must be held */
+    static void _cmem_flush_locked(struct cmem_thread* t, int cls, int nFlush) {
+        struct cmem_magazine* mag = &t->mags[cls];
+        int i;
+        for( i = 0; i < nFlush; i++ ) {
+            _free_small(_slab_index(mag->objs[i]), mag->objs[i]);
+        }
+        for( i = nFlush; i < mag->n; i++ ) {
+            mag->objs[i - nFlush] = mag->objs[i];
+        }
+        __atomic_store_n(&mag->n, mag->n - nFlush, __ATOMIC_RELAXED);
+    }
+
+    static void _cmem_flush(struct cmem_thread* t, int cls, int nFlush) {
+        CMEM_MUTEX_ENTER();
+        _cmem_flush_locked(t, cls, nFlush);
+        CMEM_MUTEX_LEAVE();
+        _cmem_store(&t->nFlush, t->nFlush + 1);
+    }
+    #endif
+
+    /* returns every object in the thread's magazines to the slabs */
+    static void _cmem_flush_all(struct cmem_thread* t) {
+        #if CMEM_MAGAZINES
+            int cls;
+            CMEM_MUTEX_ENTER();
+            for( cls = 0; cls < SIZE_CLASS_COUNT; cls++ ) {
+                if( t->mags[cls].n > 0 ) {
+                    _cmem_flush_locked(t, cls, t->mags[cls].n);
+                }
+            }
+            CMEM_MUTEX_LEAVE();
+        #endif
+    }
+
+    /* adds delta to the shared counters */
+    static void _cmem_fold(sqlite3_int64 delta) {
+        const sqlite3_int64 outstanding = __atomic_add_fetch(&composite_mem_app_data.outstanding_memory, delta, __ATOMIC_RELAXED);
+        sqlite3_int64 peak = __atomic_load_n(&composite_mem_app_data.max_memory, __ATOMIC_RELAXED);
+        while( outstanding > peak
+            && !__atomic_compare_exchange_n(&composite_mem_app_data.max_memory, &peak, outstanding, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {}
+    }
+
+    static void _cmem_count(struct cmem_thread* t, sqlite3_int64 delta) {
+        if( t == 0 ) {
+            _cmem_fold(delta);
+            return;
+        }
+
+        sqlite3_int64 pending = t->pending + delta;
+        if( pending >= CMEM_COUNTER_BATCH || pending <= -CMEM_COUNTER_BATCH ) {
+            _cmem_fold(pending);
+            pending = 0;
+        }
+        __atomic_store_n(&t->pending, pending, __ATOMIC_RELAXED);
+    }
+
+    /* runs when a thread that has a cache exits */
+    static void _cmem_thread_exit(void* p) {
+        struct cmem_thread* t = (struct cmem_thread*)p;
+        _cmem_self = 0;
+        _cmem_exited = 1; /* anything the thread still frees goes straight to the slabs */
+
+        _cmem_flush_all(t);
+        _cmem_fold(t->pending);
+        __atomic_store_n(&t->pending, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&t->inUse, 0, __ATOMIC_RELEASE);
+    }
+
+    static void _cmem_key_create() {
+        _cmem_key_ok = ( pthread_key_create(&_cmem_key, _cmem_thread_exit) == 0 );
+    }
+
+    /* gives the calling thread a cache: one a thread left behind if there is one, or a new one; returns 0 if
+     * there's neither, and then the thread goes without
+     */
+    static struct cmem_thread* _cmem_thread_attach() {
+        pthread_once(&_cmem_key_once, _cmem_key_create);
+        if( !_cmem_key_ok ) {
+            return 0;
+        }
+
+        struct cmem_thread* t;
+        for( t = __atomic_load_n(&_cmem_threads, __ATOMIC_ACQUIRE); t; t = t->next ) {
+            int unused = 0;
+            if( __atomic_compare_exchange_n(&t->inUse, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) {
+                break;
+            }
+        }
+
+        if( t == 0 ) {
+            t = calloc(1, sizeof(struct cmem_thread));
+            if( t == 0 ) {
+                return 0;
+            }
+            t->inUse = 1;
+
+            t->next = __atomic_load_n(&_cmem_threads, __ATOMIC_RELAXED);
+            while( !__atomic_compare_exchange_n(&_cmem_threads, &t->next, t, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) {}
+        }
+
+        if( pthread_setspecific(_cmem_key, t) != 0 ) {
+            __atomic_store_n(&t->inUse, 0, __ATOMIC_RELEASE);
+            return 0;
+        }
+        _cmem_self = t;
+        return t;
+    }
+
+    static struct cmem_thread* _cmem_thread() {
+        struct cmem_thread* t = _cmem_self;
+        if( t == 0 && !_cmem_exited ) {
+            t = _cmem_thread_attach();
+        }
+        return t;
+    }
+#else
+    #define CMEM_MAGAZINES 0
+
+    struct cmem_thread;
+
+    static struct cmem_thread* _cmem_thread() {
+        return 0;
+    }
+
+    static void _cmem_flush_all(struct cmem_thread* t) {
+    }
+
+    static void _cmem_count(struct cmem_thread* t, sqlite3_int64 delta) {
+        composite_mem_app_data.outstanding_memory += delta;
+        if( composite_mem_app_data.outstanding_memory > composite_mem_app_data.max_memory ) {
+            composite_mem_app_data.max_memory = composite_mem_app_data.outstanding_memory;
+        }
     }
 #endif
 
+/* allocates from the shared allocator; if it's out of memory, the objects the thread has cached may be enough */
+static void* _cmem_malloc_shared(struct cmem_thread* t, int sz) {
+    CMEM_MUTEX_ENTER();
+    void* mem = _malloc_region(sz);
+    CMEM_MUTEX_LEAVE();
+
+    if( mem == 0 && CMEM_MAGAZINES && t ) {
+        _cmem_flush_all(t);
+        CMEM_MUTEX_ENTER();
+        mem = _malloc_region(sz);
+        CMEM_MUTEX_LEAVE();
+    }
+    return mem;
+}
+
 /* Memory allocation function */
 void* cMemMalloc(int sz) {
-    char* region_start = _malloc_region(sz);
-    if( region_start == 0 ) return 0;
+    struct cmem_thread* t = _cmem_thread();
+    void* mem = 0;
 
-    return _get_memory(region_start);
+    #if CMEM_MAGAZINES
+        if( t && sz <= SIZE_CLASS_MAX ) {
+            const int cls = _size_class( (sz > 0) ? sz : 1 );
+            struct cmem_magazine* mag = &t->mags[cls];
+            if( mag->n > 0 || _cmem_refill(t, cls) > 0 ) {
+                mem = mag->objs[ mag->n - 1 ];
+                __atomic_store_n(&mag->n, mag->n - 1, __ATOMIC_RELAXED);
+                _cmem_store(&t->nHit, t->nHit + 1);
+            }
+        }
+    #endif
+
+    if( mem == 0 ) {
+        mem = _cmem_malloc_shared(t, sz);
+        if( mem == 0 ) return 0;
+    }
+
+    _cmem_count(t, _region_footprint(mem));
+    return mem;
 }
 
 /* Free a prior allocation */
 void cMemFree(void* mem) {
     if( mem == 0 ) return;
-    
-    char* region = _get_region(mem);
-    free(region);
+
+    struct cmem_thread* t = _cmem_thread();
+    _cmem_count(t, -_region_footprint(mem));
+
+    #if CMEM_MAGAZINES
+        /* the object is ours until it's freed, so its slab's kind and class can't change under us */
+        const struct slab* slab = &_slabs[ _slab_index(mem) ];
+        if( t && slab->kind == SLAB_SMALL ) {
+            const int cls = slab->cls;
+            const int capacity = _cmem_magazine_capacity(cls);
+            struct cmem_magazine* mag = &t->mags[cls];
+            if( mag->n == capacity ) {
+                _cmem_flush(t, cls, capacity - capacity / 2);
+            }
+            mag->objs[ mag->n ] = mem;
+            __atomic_store_n(&mag->n, mag->n + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    #endif
+
+    CMEM_MUTEX_ENTER();
+    _free_region(mem);
+    CMEM_MUTEX_LEAVE();
 }
 
 /* Resize an allocation */
 void* cMemRealloc(void* mem, int newSize) {
-    char* old_region = _get_region(mem);
-    size_t old_sz = _get_memory_size(mem);
+    if( mem == 0 ) return cMemMalloc(newSize);
+
+    const int old_sz = _region_size(mem);
+    if( newSize <= old_sz && _region_roundup(newSize) == old_sz ) {
+        return mem; /* the allocation already has the right size */
+    }
 
-    char* new_region = _malloc_region(newSize);
-    if( new_region == 0 ) return 0;
+    char* new_mem = cMemMalloc(newSize);
+    if( new_mem == 0 ) return 0;
 
-    int i = 0;
-    for( i = 0; i < old_sz; i++ )
-        new_region[i + sizeof(int)] = old_region[i + sizeof(int)];
-    
-    _free_region(old_region);
+    const int copy_sz = (old_sz < newSize) ? old_sz : newSize;
+    cCopy(new_mem, mem, (size_t)copy_sz);
 
-    return _get_memory(new_region);
+    cMemFree(mem);
+    return new_mem;
 }
 
 /* Return the size of an allocation */
 int cMemSize(void* mem) {
-    return (int)_get_memory_size(mem);
+    if( mem == 0 ) return 0;
+    return _region_size(mem);
 }
 
 /* Round up request size to allocation size */
 int cMemRoundup(int sz) {
-    return sz;
+    return _region_roundup(sz);
 }
 
-/* Initialize the memory allocator */
+/* Initialize the memory allocator: reserves the arena */
 int cMemInit(void* pAppData) {
-    return SQLITE_OK;
+    CMEM_MUTEX_ENTER();
+    const int ok = _region_init();
+    CMEM_MUTEX_LEAVE();
+    return ok ? SQLITE_OK : SQLITE_NOMEM;
 }
 
-/* Deinitialize the memory allocator */
+/* Deinitialize the memory allocator. other threads' caches are theirs to flush (when they exit), but the calling
+ * thread's objects go back to the slabs now, and every free slab's pages go back to the kernel. the arena stays
+ * reserved, for the next sqlite3_initialize().
+ */
 void cMemShutdown(void* pAppData) {
+    #if SQLITE_THREADSAFE
+        if( _cmem_self ) {
+            _cmem_flush_all(_cmem_self);
+        }
+    #endif
+
+    CMEM_MUTEX_ENTER();
+    _region_trim();
+    CMEM_MUTEX_LEAVE();
+}
+
+int composite_mem_set_budget(sqlite3_int64 nBytes) {
+    if( nBytes < 0 ) {
+        return SQLITE_RANGE;
+    }
+
+    CMEM_MUTEX_ENTER();
+    _region_set_budget(nBytes);
+    CMEM_MUTEX_LEAVE();
+    return SQLITE_OK;
+}
+
+/* takes a snapshot of the allocator's state. other threads may be allocating while we read their counters, so
+ * outstanding_memory may be off by their calls in flight; max_memory only sees the totals the threads have folded
+ * in, so it may miss a peak by up to CMEM_COUNTER_BATCH bytes per thread.
+ */
+void cMemStats(struct composite_mem_stats* pStats) {
+    memset(pStats, 0, sizeof(*pStats));
+
+    #if SQLITE_THREADSAFE
+        pStats->outstanding_memory = __atomic_load_n(&composite_mem_app_data.outstanding_memory, __ATOMIC_RELAXED);
+        pStats->max_memory = __atomic_load_n(&composite_mem_app_data.max_memory, __ATOMIC_RELAXED);
+
+        const struct cmem_thread* t;
+        for( t = __atomic_load_n(&_cmem_threads, __ATOMIC_ACQUIRE); t; t = t->next ) {
+            pStats->outstanding_memory += __atomic_load_n(&t->pending, __ATOMIC_RELAXED);
+            pStats->nCacheHit += __atomic_load_n(&t->nHit, __ATOMIC_RELAXED);
+            pStats->nCacheRefill += __atomic_load_n(&t->nRefill, __ATOMIC_RELAXED);
+            pStats->nCacheFlush += __atomic_load_n(&t->nFlush, __ATOMIC_RELAXED);
+            if( __atomic_load_n(&t->inUse, __ATOMIC_RELAXED) ) {
+                pStats->nThreadCache++;
+            }
+
+            #if CMEM_MAGAZINES
+                int cls;
+                for( cls = 0; cls < SIZE_CLASS_COUNT; cls++ ) {
+                    pStats->cached_bytes += (sqlite3_int64)__atomic_load_n(&t->mags[cls].n, __ATOMIC_RELAXED) * _class_size(cls);
+                }
+            #endif
+        }
+
+        if( pStats->outstanding_memory > pStats->max_memory ) {
+            pStats->max_memory = pStats->outstanding_memory;
+        }
+    #else
+        pStats->outstanding_memory = composite_mem_app_data.outstanding_memory;
+        pStats->max_memory = composite_mem_app_data.max_memory;
+    #endif
+
+    CMEM_MUTEX_ENTER();
+    _region_stats(pStats);
+    CMEM_MUTEX_LEAVE();
+
+    #if SQLITE_THREADSAFE && !SQLITE_MEM_USE_MALLOC
+        cMutexCounters( (sqlite3_mutex*)&_mem_mutex, &pStats->nMutexEnter, &pStats->nMutexContended );
+    #endif
 }
 
 #endif // SQLITE_OS_OTHER
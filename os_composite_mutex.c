@@ -1,13 +1,78 @@
-
 #if SQLITE_OS_OTHER && SQLITE_THREADSAFE
 
 #include "os_composite.h"
 
+#include <unistd.h> /* for syscall() */
+#include <sys/syscall.h> /* for SYS_futex */
+#include <linux/futex.h> /* for FUTEX_WAIT_PRIVATE and FUTEX_WAKE_PRIVATE */
+
+/* a mutex's lock word is 0 when it's unlocked, 1 when it's locked, and 2 when it's locked and
+ * other threads may be sleeping on it. an uncontended enter or leave is a single atomic operation;
+ * we only make a futex() syscall to sleep, or to wake a sleeper on leave.
+ */
+#define CMUTEX_UNLOCKED 0
+#define CMUTEX_LOCKED 1
+#define CMUTEX_CONTENDED 2
+
+/* one mutex for each of SQLite's static mutex types, SQLITE_MUTEX_STATIC_MASTER through SQLITE_MUTEX_STATIC_VFS3 */
+#define CMUTEX_STATIC_COUNT (SQLITE_MUTEX_STATIC_VFS3 - SQLITE_MUTEX_STATIC_MASTER + 1)
+static struct cMutex _cMutex_static[CMUTEX_STATIC_COUNT];
+
+/* the counters of SQLITE_MUTEX_FAST and SQLITE_MUTEX_RECURSIVE mutexes that have been freed */
+static sqlite3_uint64 _cMutex_retired_enter[2];
+static sqlite3_uint64 _cMutex_retired_contended[2];
+
+/* 1 while SQLite is using these mutexes; other code may only look inside a sqlite3_mutex if it is */
+static int _cMutex_installed = 0;
+
+/* every thread that enters a mutex gets a small nonzero id the first time it does so */
+static int _cMutex_next_thread_id = 0;
+static __thread int _cMutex_thread_id = 0;
+
+static int _cMutexSelf() {
+    if( _cMutex_thread_id == 0 ) {
+        _cMutex_thread_id = __atomic_add_fetch(&_cMutex_next_thread_id, 1, __ATOMIC_RELAXED);
+    }
+    return _cMutex_thread_id;
+}
+
+static int _cMutexOwner(struct cMutex* mutex) {
+    return __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+}
+
+/* counts an acquisition by the (new) owner; the counters are stored atomically only so that
+ * cMutexCounters() can read them from another thread
+ */
+static void _cMutexCount(struct cMutex* mutex, int contended) {
+    __atomic_store_n(&mutex->nEnter, mutex->nEnter + 1, __ATOMIC_RELAXED);
+    if( contended ) {
+        __atomic_store_n(&mutex->nContended, mutex->nContended + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* sleeps until the lock word is no longer 'val' (or we're woken spuriously) */
+static void _cFutexWait(int* addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, 0, 0, 0);
+}
+
+static void _cFutexWake(int* addr, int nWaiters) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nWaiters, 0, 0, 0);
+}
+
+/* SQLite calls this every time a static mutex is allocated, not just once, so it must not touch
+ * state that may be in use: the static mutexes start out zeroed (unlocked) and only their ids are set here.
+ */
 int cMutexInit() {
+    int i;
+    for( i = 0; i < CMUTEX_STATIC_COUNT; i++ ) {
+        _cMutex_static[i].id = SQLITE_MUTEX_STATIC_MASTER + i;
+    }
+    _cMutex_installed = 1;
     return SQLITE_OK;
 }
 
 int cMutexEnd() {
+    _cMutex_installed = 0;
     return SQLITE_OK;
 }
 
@@ -16,16 +81,67 @@ int cMutexEnd() {
  * @return a pointer to a mutex, or NULL if it couldn't be created
  */
 sqlite3_mutex* cMutexAlloc(int mutexType) {
-    return 0;
+    if( mutexType == SQLITE_MUTEX_FAST || mutexType == SQLITE_MUTEX_RECURSIVE ) {
+        /* not sqlite3_malloc(): SQLite allocates its init mutex before its allocator is initialized */
+        struct cMutex* mutex = cMemMalloc( sizeof(struct cMutex) );
+        if( mutex == 0 ) {
+            return 0;
+        }
+
+        mutex->lock = CMUTEX_UNLOCKED;
+        mutex->id = mutexType;
+        mutex->owner = 0;
+        mutex->nRef = 0;
+        mutex->nEnter = 0;
+        mutex->nContended = 0;
+        return (sqlite3_mutex*)mutex;
+    }
+
+    if( mutexType < SQLITE_MUTEX_STATIC_MASTER || mutexType > SQLITE_MUTEX_STATIC_VFS3 ) {
+        return 0;
+    }
+
+    return (sqlite3_mutex*)&_cMutex_static[ mutexType - SQLITE_MUTEX_STATIC_MASTER ];
 }
 
 void cMutexFree(sqlite3_mutex *mutex) {
+    struct cMutex* m = (struct cMutex*)mutex;
+    if( m->id == SQLITE_MUTEX_FAST || m->id == SQLITE_MUTEX_RECURSIVE ) {
+        __atomic_add_fetch(&_cMutex_retired_enter[m->id], m->nEnter, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&_cMutex_retired_contended[m->id], m->nContended, __ATOMIC_RELAXED);
+        cMemFree(m);
+    }
 }
 
 /* tries to enter the given mutex.
  * if another thread is in the mutex, this method will block.
  */
 void cMutexEnter(sqlite3_mutex *mutex) {
+    struct cMutex* m = (struct cMutex*)mutex;
+    const int self = _cMutexSelf();
+
+    if( m->id == SQLITE_MUTEX_RECURSIVE && _cMutexOwner(m) == self ) {
+        m->nRef++;
+        return;
+    }
+
+    int c = CMUTEX_UNLOCKED;
+    const int contended = !__atomic_compare_exchange_n(&m->lock, &c, CMUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    if( contended ) {
+        /* the mutex is held; mark it contended so that the holder wakes us when it leaves */
+        if( c != CMUTEX_CONTENDED ) {
+            c = __atomic_exchange_n(&m->lock, CMUTEX_CONTENDED, __ATOMIC_ACQUIRE);
+        }
+
+        while( c != CMUTEX_UNLOCKED ) {
+            _cFutexWait(&m->lock, CMUTEX_CONTENDED);
+            c = __atomic_exchange_n(&m->lock, CMUTEX_CONTENDED, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    __atomic_store_n(&m->owner, self, __ATOMIC_RELAXED);
+    m->nRef = 1;
+    _cMutexCount(m, contended);
 }
 
 /* tries to enter the given mutex.
@@ -35,31 +151,97 @@ void cMutexEnter(sqlite3_mutex *mutex) {
  *  The SQLite core only ever uses sqlite3_mutex_try() as an optimization so this is acceptable behavior."
  */
 int cMutexTry(sqlite3_mutex *mutex) {
-    return SQLITE_BUSY;
+    struct cMutex* m = (struct cMutex*)mutex;
+    const int self = _cMutexSelf();
+
+    if( m->id == SQLITE_MUTEX_RECURSIVE && _cMutexOwner(m) == self ) {
+        m->nRef++;
+        return SQLITE_OK;
+    }
+
+    int c = CMUTEX_UNLOCKED;
+    if( !__atomic_compare_exchange_n(&m->lock, &c, CMUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) {
+        return SQLITE_BUSY;
+    }
+
+    __atomic_store_n(&m->owner, self, __ATOMIC_RELAXED);
+    m->nRef = 1;
+    _cMutexCount(m, 0);
+    return SQLITE_OK;
 }
 
 /* exits the given mutex.
  * behavior is undefined if the mutex wasn't entered by the calling thread
  */
 void cMutexLeave(sqlite3_mutex *mutex) {
+    struct cMutex* m = (struct cMutex*)mutex;
+
+    m->nRef--;
+    if( m->nRef > 0 ) {
+        return; /* a recursive mutex that's still entered */
+    }
+
+    __atomic_store_n(&m->owner, 0, __ATOMIC_RELAXED);
+    if( __atomic_fetch_sub(&m->lock, 1, __ATOMIC_RELEASE) != CMUTEX_LOCKED ) {
+        /* someone may be sleeping on the mutex */
+        __atomic_store_n(&m->lock, CMUTEX_UNLOCKED, __ATOMIC_RELEASE);
+        _cFutexWake(&m->lock, 1);
+    }
 }
 
 /* returns true if this mutex is held by the calling thread
  *
- * this is used only in SQLite assert()'s, so a working
- * implementation isn't really needed; this can just return TRUE
+ * this is used only in SQLite assert()'s
  */
 int cMutexHeld(sqlite3_mutex *mutex) {
-    return 1;
+    struct cMutex* m = (struct cMutex*)mutex;
+    return m == 0 || _cMutexOwner(m) == _cMutexSelf();
 }
 
 /* returns true if this mutex is NOT held by the calling thread
  *
- * this is used only in SQLite assert()'s, so a working
- * implementation isn't really needed; this can just return TRUE
+ * this is used only in SQLite assert()'s
  */
 int cMutexNotheld(sqlite3_mutex *mutex) {
-    return 1;
+    struct cMutex* m = (struct cMutex*)mutex;
+    return m == 0 || _cMutexOwner(m) != _cMutexSelf();
+}
+
+/* returns 1 if SQLite's mutexes are ours, so that any sqlite3_mutex is a struct cMutex */
+int cMutexInstalled() {
+    return _cMutex_installed;
+}
+
+/* reads a mutex's counters; they may be slightly behind if another thread is entering it */
+void cMutexCounters(sqlite3_mutex *mutex, sqlite3_uint64* pnEnter, sqlite3_uint64* pnContended) {
+    struct cMutex* m = (struct cMutex*)mutex;
+    *pnEnter = __atomic_load_n(&m->nEnter, __ATOMIC_RELAXED);
+    *pnContended = __atomic_load_n(&m->nContended, __ATOMIC_RELAXED);
+}
+
+/* reads the counters of a static mutex, or for SQLITE_MUTEX_FAST and SQLITE_MUTEX_RECURSIVE, the totals
+ * of every mutex of that type that has been freed.
+ * returns SQLITE_OK, SQLITE_RANGE for a bad type, or SQLITE_ERROR if these mutexes aren't installed
+ */
+int cMutexStats(int mutexType, sqlite3_uint64* pnEnter, sqlite3_uint64* pnContended) {
+    *pnEnter = 0;
+    *pnContended = 0;
+    if( !_cMutex_installed ) {
+        return SQLITE_ERROR;
+    }
+
+    if( mutexType == SQLITE_MUTEX_FAST || mutexType == SQLITE_MUTEX_RECURSIVE ) {
+        *pnEnter = __atomic_load_n(&_cMutex_retired_enter[mutexType], __ATOMIC_RELAXED);
+        *pnContended = __atomic_load_n(&_cMutex_retired_contended[mutexType], __ATOMIC_RELAXED);
+        return SQLITE_OK;
+    }
+
+    if( mutexType < SQLITE_MUTEX_STATIC_MASTER || mutexType > SQLITE_MUTEX_STATIC_VFS3 ) {
+        return SQLITE_RANGE;
+    }
+
+    cMutexCounters((sqlite3_mutex*)&_cMutex_static[ mutexType - SQLITE_MUTEX_STATIC_MASTER ], pnEnter, pnContended);
+    return SQLITE_OK;
 }
 
 #endif // SQLITE_OS_OTHER && SQLITE_THREADSAFE
@@ -0,0 +1,307 @@
+/* Contains a page cache (SQLITE_CONFIG_PCACHE2) sized for databases that live in the inmemfs
+ *
+ * SQLite's default page cache keeps up to cache_size clean pages around, which for us is a second copy
+ * of data that already lives in inmemfs. clean pages are served directly from inmemfs storage through
+ * xFetch() (see cFetch()), so this cache only has to hold the pages SQLite has pinned or dirtied, plus a
+ * few recently-unpinned clean pages; any other clean page can be brought back with a single cRead() copy.
+ */
+
+#if SQLITE_OS_OTHER
+
+#include "os_composite.h"
+
+#define PCACHE_INITIAL_BUCKETS 64 /* must be a power of two */
+
+/* the most unpinned (and therefore clean) pages a purgeable cache keeps around */
+#define PCACHE_MAX_UNPINNED 16
+
+struct cPage {
+    sqlite3_pcache_page base; /* must be first: SQLite sees pages as sqlite3_pcache_page* */
+    unsigned int key; /* the page number */
+    int pinned; /* 1 if SQLite holds the page; 0 if it's on the LRU list */
+    struct cPage* hashNext; /* the next page in the same hash bucket */
+    struct cPage* lruPrev; /* the LRU list; lruNext goes towards older pages */
+    struct cPage* lruNext;
+    /* followed by szPage bytes of page data, then szExtra bytes of extra data */
+};
+
+struct cPcache {
+    int szPage;
+    int szExtra;
+    int bPurgeable; /* if 0, every page must be kept until it's truncated or the cache is destroyed */
+    int nMax; /* the cache_size SQLite asked for */
+    struct cPage** buckets; /* a hash table of all pages, keyed on the page number */
+    int nBuckets; /* always a power of two */
+    int nPage; /* the number of pages in the cache, pinned or not */
+    int nUnpinned; /* the number of pages on the LRU list */
+    struct cPage* lruHead; /* the most recently unpinned page */
+    struct cPage* lruTail; /* the least recently unpinned page; the first to be recycled */
+};
+
+static struct cPage** _pcache_bucket(struct cPcache* cache, unsigned int key) {
+    return &cache->buckets[ key & (cache->nBuckets - 1) ];
+}
+
+static void _pcache_hash_insert(struct cPcache* cache, struct cPage* page) {
+    struct cPage** bucket = _pcache_bucket(cache, page->key);
+    page->hashNext = *bucket;
+    *bucket = page;
+}
+
+static void _pcache_hash_remove(struct cPcache* cache, struct cPage* page) {
+    struct cPage** pp = _pcache_bucket(cache, page->key);
+    while( *pp != page ) {
+        pp = &(*pp)->hashNext;
+    }
+    *pp = page->hashNext;
+}
+
+/* doubles the hash table once there's more than one page per bucket; a failure just leaves longer chains */
+static void _pcache_hash_grow(struct cPcache* cache) {
+    if( cache->nPage < cache->nBuckets ) {
+        return;
+    }
+
+    const int new_nBuckets = cache->nBuckets * 2;
+    struct cPage** new_buckets = sqlite3_malloc64( new_nBuckets * sizeof(struct cPage*) );
+    if( new_buckets == 0 ) {
+        return;
+    }
+
+    int i;
+    for( i = 0; i < new_nBuckets; i++ ) {
+        new_buckets[i] = 0;
+    }
+
+    struct cPage** old_buckets = cache->buckets;
+    const int old_nBuckets = cache->nBuckets;
+    cache->buckets = new_buckets;
+    cache->nBuckets = new_nBuckets;
+
+    for( i = 0; i < old_nBuckets; i++ ) {
+        struct cPage* page = old_buckets[i];
+        while( page ) {
+            struct cPage* next = page->hashNext;
+            _pcache_hash_insert(cache, page);
+            page = next;
+        }
+    }
+
+    sqlite3_free(old_buckets);
+}
+
+static void _pcache_lru_push(struct cPcache* cache, struct cPage* page) {
+    page->lruPrev = 0;
+    page->lruNext = cache->lruHead;
+    if( cache->lruHead ) cache->lruHead->lruPrev = page;
+    else cache->lruTail = page;
+    cache->lruHead = page;
+    cache->nUnpinned++;
+}
+
+static void _pcache_lru_remove(struct cPcache* cache, struct cPage* page) {
+    if( page->lruPrev ) page->lruPrev->lruNext = page->lruNext;
+    else cache->lruHead = page->lruNext;
+    if( page->lruNext ) page->lruNext->lruPrev = page->lruPrev;
+    else cache->lruTail = page->lruPrev;
+    cache->nUnpinned--;
+}
+
+/* removes the page from the cache and frees it */
+static void _pcache_page_free(struct cPcache* cache, struct cPage* page) {
+    if( !page->pinned ) {
+        _pcache_lru_remove(cache, page);
+    }
+    _pcache_hash_remove(cache, page);
+    cache->nPage--;
+    sqlite3_free(page);
+}
+
+/* the number of unpinned pages the cache may keep */
+static int _pcache_max_unpinned(struct cPcache* cache) {
+    return (cache->nMax < PCACHE_MAX_UNPINNED) ? cache->nMax : PCACHE_MAX_UNPINNED;
+}
+
+/* frees least recently used pages until at most nKeep are unpinned */
+static void _pcache_trim(struct cPcache* cache, int nKeep) {
+    if( !cache->bPurgeable ) {
+        return;
+    }
+
+    while( cache->nUnpinned > nKeep ) {
+        _pcache_page_free(cache, cache->lruTail);
+    }
+}
+
+int cPcacheInit(void* pArg) {
+    return SQLITE_OK;
+}
+
+void cPcacheShutdown(void* pArg) {
+}
+
+/* all of a cache's state lives in the cache itself, so xInit() isn't needed; this module can be
+ * installed after SQLite has already initialized its page cache subsystem.
+ */
+sqlite3_pcache* cPcacheCreate(int szPage, int szExtra, int bPurgeable) {
+    struct cPcache* cache = sqlite3_malloc64( sizeof(struct cPcache) );
+    if( cache == 0 ) {
+        return 0;
+    }
+
+    cache->buckets = sqlite3_malloc64( PCACHE_INITIAL_BUCKETS * sizeof(struct cPage*) );
+    if( cache->buckets == 0 ) {
+        sqlite3_free(cache);
+        return 0;
+    }
+
+    int i;
+    for( i = 0; i < PCACHE_INITIAL_BUCKETS; i++ ) {
+        cache->buckets[i] = 0;
+    }
+
+    cache->szPage = szPage;
+    cache->szExtra = szExtra;
+    cache->bPurgeable = bPurgeable;
+    cache->nMax = 0;
+    cache->nBuckets = PCACHE_INITIAL_BUCKETS;
+    cache->nPage = 0;
+    cache->nUnpinned = 0;
+    cache->lruHead = 0;
+    cache->lruTail = 0;
+
+    return (sqlite3_pcache*)cache;
+}
+
+void cPcacheCachesize(sqlite3_pcache* pCache, int nCachesize) {
+    struct cPcache* cache = (struct cPcache*)pCache;
+    cache->nMax = nCachesize;
+    _pcache_trim(cache, _pcache_max_unpinned(cache));
+}
+
+int cPcachePagecount(sqlite3_pcache* pCache) {
+    struct cPcache* cache = (struct cPcache*)pCache;
+    return cache->nPage;
+}
+
+/* looks up a page, creating it if createFlag allows.
+ * createFlag 0: only return an existing page.
+ * createFlag 1: create the page if that's cheap; we decline once the cache is at cache_size with nothing
+ *               to recycle, so that SQLite spills dirty pages first.
+ * createFlag 2: create the page if at all possible.
+ */
+sqlite3_pcache_page* cPcacheFetch(sqlite3_pcache* pCache, unsigned int key, int createFlag) {
+    struct cPcache* cache = (struct cPcache*)pCache;
+
+    struct cPage* page = *_pcache_bucket(cache, key);
+    while( page && page->key != key ) {
+        page = page->hashNext;
+    }
+
+    if( page ) {
+        if( !page->pinned ) {
+            _pcache_lru_remove(cache, page);
+            page->pinned = 1;
+        }
+        return &page->base;
+    }
+
+    if( createFlag == 0 ) {
+        return 0;
+    }
+
+    /* recycle the least recently used page if we're at our limit */
+    const int bFull = cache->nPage >= cache->nMax || cache->nUnpinned >= _pcache_max_unpinned(cache);
+    if( cache->bPurgeable && cache->lruTail && bFull ) {
+        page = cache->lruTail;
+        _pcache_lru_remove(cache, page);
+        _pcache_hash_remove(cache, page);
+        cache->nPage--;
+    } else if( createFlag == 1 && cache->bPurgeable && cache->nPage >= cache->nMax ) {
+        return 0;
+    }
+
+    if( page == 0 ) {
+        page = sqlite3_malloc64( sizeof(struct cPage) + cache->szPage + cache->szExtra );
+        if( page == 0 ) {
+            return 0;
+        }
+        page->base.pBuf = (void*)(page + 1);
+        page->base.pExtra = (void*)( ((char*)(page + 1)) + cache->szPage );
+    }
+
+    *((void**)page->base.pExtra) = 0; /* SQLite initializes a page whose first extra pointer is 0 */
+    page->key = key;
+    page->pinned = 1;
+
+    _pcache_hash_insert(cache, page);
+    cache->nPage++;
+    _pcache_hash_grow(cache);
+
+    return &page->base;
+}
+
+void cPcacheUnpin(sqlite3_pcache* pCache, sqlite3_pcache_page* pPage, int discard) {
+    struct cPcache* cache = (struct cPcache*)pCache;
+    struct cPage* page = (struct cPage*)pPage;
+
+    if( discard ) {
+        _pcache_page_free(cache, page);
+        return;
+    }
+
+    /* SQLite only unpins clean pages, so keeping a few of them around is all we do here */
+    page->pinned = 0;
+    _pcache_lru_push(cache, page);
+    _pcache_trim(cache, _pcache_max_unpinned(cache));
+}
+
+void cPcacheRekey(sqlite3_pcache* pCache, sqlite3_pcache_page* pPage, unsigned int oldKey, unsigned int newKey) {
+    struct cPcache* cache = (struct cPcache*)pCache;
+    struct cPage* page = (struct cPage*)pPage;
+
+    _pcache_hash_remove(cache, page);
+    page->key = newKey;
+    _pcache_hash_insert(cache, page);
+}
+
+/* discards every page with a key >= iLimit */
+void cPcacheTruncate(sqlite3_pcache* pCache, unsigned int iLimit) {
+    struct cPcache* cache = (struct cPcache*)pCache;
+
+    int i;
+    for( i = 0; i < cache->nBuckets; i++ ) {
+        struct cPage* page = cache->buckets[i];
+        while( page ) {
+            struct cPage* next = page->hashNext;
+            if( page->key >= iLimit ) {
+                _pcache_page_free(cache, page);
+            }
+            page = next;
+        }
+    }
+}
+
+void cPcacheDestroy(sqlite3_pcache* pCache) {
+    struct cPcache* cache = (struct cPcache*)pCache;
+
+    int i;
+    for( i = 0; i < cache->nBuckets; i++ ) {
+        struct cPage* page = cache->buckets[i];
+        while( page ) {
+            struct cPage* next = page->hashNext;
+            sqlite3_free(page);
+            page = next;
+        }
+    }
+
+    sqlite3_free(cache->buckets);
+    sqlite3_free(cache);
+}
+
+void cPcacheShrink(sqlite3_pcache* pCache) {
+    struct cPcache* cache = (struct cPcache*)pCache;
+    _pcache_trim(cache, 0);
+}
+
+#endif // SQLITE_OS_OTHER
@@ -0,0 +1,395 @@
+/* Contains the buddy allocator that holds inmemfs file data
+ *
+ * page buffers, their compressed copies and page directories come from one of two pools (COMPOSITE_FS_POOL_*)
+ * rather than from the SQLite heap (os_composite_mem.c), so a growing file can't fragment the heap or starve the
+ * page cache, and temporary files can't take the memory the main databases need. each pool has its own budget
+ * and its own mutex.
+ *
+ * a pool's memory is mapped in chunks of CPOOL_CHUNK_SIZE bytes, aligned to their size, so the chunk a block
+ * belongs to is found by masking its address. a chunk starts with its header and a map with one byte for each
+ * CPOOL_MIN_SIZE bytes, which holds the order (and whether it's in use) of the block that starts there; the rest
+ * is split into power-of-two blocks, from CPOOL_MIN_SIZE up to half the chunk. a freed block is merged with its
+ * buddy whenever the buddy is free too. the pool's free blocks of each order are kept on a list, linked through
+ * the blocks themselves, so allocating and freeing are O(number of orders).
+ *
+ * anything larger than the largest block (a page directory for a file of more than a few hundred MB) is mapped
+ * as an extent of its own, with its header on the page before the memory that's handed out.
+ */
+
+#if SQLITE_OS_OTHER
+
+#include "os_composite.h"
+
+#include <sys/mman.h> /* for mmap(), munmap() and madvise() */
+
+#define CPOOL_CHUNK_SHIFT 22
+#define CPOOL_CHUNK_SIZE ( (size_t)1 << CPOOL_CHUNK_SHIFT ) /* 4MB */
+#define CPOOL_MIN_SHIFT 8
+#define CPOOL_MIN_SIZE ( 1 << CPOOL_MIN_SHIFT ) /* 256 bytes: a page's compressed copy is rarely smaller */
+#define CPOOL_ORDERS ( CPOOL_CHUNK_SHIFT - CPOOL_MIN_SHIFT ) /* block sizes CPOOL_MIN_SIZE << [0, CPOOL_ORDERS) */
+#define CPOOL_MAX_BLOCK ( CPOOL_MIN_SIZE << (CPOOL_ORDERS - 1) ) /* 2MB */
+#define CPOOL_MAP_LEN ( CPOOL_CHUNK_SIZE >> CPOOL_MIN_SHIFT )
+
+/* a chunk's header and map take up its first block, of order CPOOL_HEADER_ORDER */
+#define CPOOL_HEADER_ORDER 7 /* 32KB */
+
+/* freed blocks at least this large are handed back to the OS, all but the page that holds their links */
+#define CPOOL_DONTNEED_SIZE ( 16 * FS_PAGE_SIZE )
+
+/* map entries */
+#define CPOOL_USED 0x80 /* or'd with the order of a block that's in use */
+#define CPOOL_NOT_A_BLOCK 0xff /* nothing starts here: the block was merged into the one before it */
+
+#define CPOOL_KIND_CHUNK 0
+#define CPOOL_KIND_EXTENT 1
+
+struct cpool_chunk {
+    int kind; /* one of CPOOL_KIND_* */
+    int pool; /* one of COMPOSITE_FS_POOL_* */
+    size_t size; /* the size of the mapping */
+    int nUsed; /* CPOOL_KIND_CHUNK: the number of blocks in use, not counting the header */
+    struct cpool_chunk* prev; /* the pool's chunks, or its extents */
+    struct cpool_chunk* next;
+    unsigned char map[CPOOL_MAP_LEN]; /* CPOOL_KIND_CHUNK only; an extent's header is a single page */
+};
+
+/* a free block's first bytes */
+struct cpool_free {
+    struct cpool_free* prev;
+    struct cpool_free* next;
+};
+
+struct cpool {
+    #if SQLITE_THREADSAFE
+        struct cMutex mutex; /* zero-initialized: an unlocked SQLITE_MUTEX_FAST */
+    #endif
+    struct cpool_free* aFree[CPOOL_ORDERS]; /* per order, the free blocks of every chunk */
+    struct cpool_chunk* chunks;
+    struct cpool_chunk* extents;
+    int nChunk;
+    int nExtent;
+    sqlite3_int64 used; /* the bytes of blocks and extents handed out */
+    sqlite3_int64 peak; /* the most 'used' has been */
+    sqlite3_int64 mapped; /* the bytes of chunks and extents mapped */
+    sqlite3_int64 budget; /* the most 'used' may be, or 0 for no limit */
+    sqlite3_uint64 nAlloc; /* the number of allocations */
+    sqlite3_uint64 nFail; /* how many of those failed, for the budget or for want of memory */
+};
+
+static struct cpool _cpool[COMPOSITE_FS_POOL_COUNT];
+
+#if SQLITE_THREADSAFE
+#define CPOOL_ENTER(pool) cMutexEnter( (sqlite3_mutex*)&(pool)->mutex )
+#define CPOOL_LEAVE(pool) cMutexLeave( (sqlite3_mutex*)&(pool)->mutex )
+#else
+#define CPOOL_ENTER(pool)
+#define CPOOL_LEAVE(pool)
+#endif
+
+_Static_assert( sizeof(struct cpool_chunk) <= (CPOOL_MIN_SIZE << CPOOL_HEADER_ORDER), "a chunk's header must fit in its first block" );
+_Static_assert( sizeof(struct cpool_chunk) - CPOOL_MAP_LEN <= FS_PAGE_SIZE, "an extent's header must fit in a page" );
+
+static struct cpool_chunk* _cpool_chunk_of(const void* mem) {
+    return (struct cpool_chunk*)( (size_t)mem & ~(CPOOL_CHUNK_SIZE - 1) );
+}
+
+/* returns the smallest order whose blocks hold sz bytes; sz must be at most CPOOL_MAX_BLOCK */
+static int _cpool_order(int sz) {
+    if( sz <= CPOOL_MIN_SIZE ) {
+        return 0;
+    }
+    return (32 - __builtin_clz( (unsigned int)(sz - 1) )) - CPOOL_MIN_SHIFT;
+}
+
+/* maps size bytes, aligned to CPOOL_CHUNK_SIZE; returns 0 if the OS is out of memory */
+static void* _cpool_map(size_t size) {
+    /* map enough to find an aligned start in, then unmap what's left on either side */
+    const size_t len = size + CPOOL_CHUNK_SIZE;
+    char* p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if( p == MAP_FAILED ) {
+        return 0;
+    }
+
+    char* start = (char*)( ((size_t)p + CPOOL_CHUNK_SIZE - 1) & ~(CPOOL_CHUNK_SIZE - 1) );
+    if( start > p ) {
+        munmap(p, (size_t)(start - p));
+    }
+    const size_t after = (size_t)( (p + len) - (start + size) );
+    if( after > 0 ) {
+        munmap(start + size, after);
+    }
+    return start;
+}
+
+static void _cpool_list_push(struct cpool_chunk** head, struct cpool_chunk* chunk) {
+    chunk->prev = 0;
+    chunk->next = *head;
+    if( *head ) (*head)->prev = chunk;
+    *head = chunk;
+}
+
+static void _cpool_list_remove(struct cpool_chunk** head, struct cpool_chunk* chunk) {
+    if( chunk->prev ) chunk->prev->next = chunk->next;
+    else *head = chunk->next;
+    if( chunk->next ) chunk->next->prev = chunk->prev;
+}
+
+static void _cpool_free_push(struct cpool* pool, int order, struct cpool_free* block) {
+    block->prev = 0;
+    block->next = pool->aFree[order];
+    if( block->next ) block->next->prev = block;
+    pool->aFree[order] = block;
+}
+
+static void _cpool_free_remove(struct cpool* pool, int order, struct cpool_free* block) {
+    if( block->prev ) block->prev->next = block->next;
+    else pool->aFree[order] = block->next;
+    if( block->next ) block->next->prev = block->prev;
+}
+
+/* maps a new chunk and puts its blocks on the free lists: after the header, one block of each order from
+ * CPOOL_HEADER_ORDER up. returns 1 on success, 0 if the OS is out of memory
+ */
+static int _cpool_chunk_add(struct cpool* pool, int iPool) {
+    struct cpool_chunk* chunk = _cpool_map(CPOOL_CHUNK_SIZE);
+    if( chunk == 0 ) {
+        return 0;
+    }
+
+    chunk->kind = CPOOL_KIND_CHUNK;
+    chunk->pool = iPool;
+    chunk->size = CPOOL_CHUNK_SIZE;
+    chunk->nUsed = 0;
+    _cpool_list_push(&pool->chunks, chunk);
+    pool->nChunk++;
+    pool->mapped += CPOOL_CHUNK_SIZE;
+
+    /* the rest of the map is never read before it's written; the mapping starts out zeroed anyway */
+    chunk->map[0] = CPOOL_HEADER_ORDER | CPOOL_USED;
+
+    int order;
+    for( order = CPOOL_HEADER_ORDER; order < CPOOL_ORDERS; order++ ) {
+        const size_t offset = (size_t)CPOOL_MIN_SIZE << order;
+        chunk->map[ offset >> CPOOL_MIN_SHIFT ] = (unsigned char)order;
+        _cpool_free_push(pool, order, (struct cpool_free*)( (char*)chunk + offset ));
+    }
+    return 1;
+}
+
+/* unmaps a chunk none of whose blocks are in use; they're all back on the free lists, merged as far as they go */
+static void _cpool_chunk_release(struct cpool* pool, struct cpool_chunk* chunk) {
+    int order;
+    for( order = CPOOL_HEADER_ORDER; order < CPOOL_ORDERS; order++ ) {
+        const size_t offset = (size_t)CPOOL_MIN_SIZE << order;
+        _cpool_free_remove(pool, order, (struct cpool_free*)( (char*)chunk + offset ));
+    }
+
+    _cpool_list_remove(&pool->chunks, chunk);
+    pool->nChunk--;
+    pool->mapped -= CPOOL_CHUNK_SIZE;
+    munmap(chunk, CPOOL_CHUNK_SIZE);
+}
+
+static void* _cpool_alloc_block(struct cpool* pool, int iPool, int order) {
+    int j = order;
+    while( j < CPOOL_ORDERS && pool->aFree[j] == 0 ) {
+        j++;
+    }
+    if( j == CPOOL_ORDERS ) {
+        if( _cpool_chunk_add(pool, iPool) == 0 ) {
+            return 0;
+        }
+        for( j = order; pool->aFree[j] == 0; j++ ) {}
+    }
+
+    struct cpool_free* block = pool->aFree[j];
+    _cpool_free_remove(pool, j, block);
+
+    struct cpool_chunk* chunk = _cpool_chunk_of(block);
+    const size_t offset = (size_t)( (char*)block - (char*)chunk );
+
+    /* split it down to the order we need; the upper halves go back on the free lists */
+    while( j > order ) {
+        j--;
+        const size_t buddy = offset + ((size_t)CPOOL_MIN_SIZE << j);
+        chunk->map[ buddy >> CPOOL_MIN_SHIFT ] = (unsigned char)j;
+        _cpool_free_push(pool, j, (struct cpool_free*)( (char*)chunk + buddy ));
+    }
+
+    chunk->map[ offset >> CPOOL_MIN_SHIFT ] = (unsigned char)(order | CPOOL_USED);
+    chunk->nUsed++;
+    return block;
+}
+
+static void _cpool_free_block(struct cpool* pool, struct cpool_chunk* chunk, void* mem) {
+    size_t offset = (size_t)( (char*)mem - (char*)chunk );
+    int order = chunk->map[ offset >> CPOOL_MIN_SHIFT ] & ~CPOOL_USED;
+    pool->used -= (sqlite3_int64)CPOOL_MIN_SIZE << order;
+
+    /* merge with the buddy for as long as it's free; the header's block is never free, so this stops below it */
+    while( order < CPOOL_ORDERS - 1 ) {
+        const size_t buddy = offset ^ ((size_t)CPOOL_MIN_SIZE << order);
+        if( chunk->map[ buddy >> CPOOL_MIN_SHIFT ] != order ) {
+            break;
+        }
+
+        _cpool_free_remove(pool, order, (struct cpool_free*)( (char*)chunk + buddy ));
+        chunk->map[ (offset > buddy ? offset : buddy) >> CPOOL_MIN_SHIFT ] = CPOOL_NOT_A_BLOCK;
+        offset = (offset < buddy) ? offset : buddy;
+        order++;
+    }
+
+    const size_t size = (size_t)CPOOL_MIN_SIZE << order;
+    if( size >= CPOOL_DONTNEED_SIZE ) {
+        madvise((char*)chunk + offset + FS_PAGE_SIZE, size - FS_PAGE_SIZE, MADV_DONTNEED);
+    }
+
+    chunk->map[ offset >> CPOOL_MIN_SHIFT ] = (unsigned char)order;
+    _cpool_free_push(pool, order, (struct cpool_free*)( (char*)chunk + offset ));
+
+    /* keep one chunk mapped, so a pool that empties and refills doesn't map and unmap it each time */
+    chunk->nUsed--;
+    if( chunk->nUsed == 0 && pool->nChunk > 1 ) {
+        _cpool_chunk_release(pool, chunk);
+    }
+}
+
+/* allocates sz bytes from pool iPool (one of COMPOSITE_FS_POOL_*); returns 0 if that would exceed the pool's
+ * budget, or the OS is out of memory
+ */
+void* cPoolMalloc(int iPool, int sz) {
+    struct cpool* pool = &_cpool[iPool];
+    if( sz <= 0 ) sz = 1;
+
+    const sqlite3_int64 size = (sz > CPOOL_MAX_BLOCK) ? ((sqlite3_int64)sz + FS_PAGE_SIZE - 1) & ~(sqlite3_int64)(FS_PAGE_SIZE - 1)
+                                                      : (sqlite3_int64)CPOOL_MIN_SIZE << _cpool_order(sz);
+    void* mem = 0;
+
+    CPOOL_ENTER(pool);
+    pool->nAlloc++;
+    if( pool->budget == 0 || pool->used + size <= pool->budget ) {
+        if( sz <= CPOOL_MAX_BLOCK ) {
+            mem = _cpool_alloc_block(pool, iPool, _cpool_order(sz));
+        } else {
+            /* an extent of its own, with the header on the page before it */
+            struct cpool_chunk* extent = _cpool_map( (size_t)size + FS_PAGE_SIZE );
+            if( extent ) {
+                extent->kind = CPOOL_KIND_EXTENT;
+                extent->pool = iPool;
+                extent->size = (size_t)size + FS_PAGE_SIZE;
+                _cpool_list_push(&pool->extents, extent);
+                pool->nExtent++;
+                pool->mapped += (sqlite3_int64)extent->size;
+                mem = (char*)extent + FS_PAGE_SIZE;
+            }
+        }
+    }
+
+    if( mem ) {
+        pool->used += size;
+        if( pool->used > pool->peak ) pool->peak = pool->used;
+    } else {
+        pool->nFail++;
+    }
+    CPOOL_LEAVE(pool);
+
+    return mem;
+}
+
+/* frees memory from cPoolMalloc(), back to the pool it came from */
+void cPoolFree(void* mem) {
+    if( mem == 0 ) return;
+
+    struct cpool_chunk* chunk = _cpool_chunk_of(mem);
+    struct cpool* pool = &_cpool[ chunk->pool ];
+
+    CPOOL_ENTER(pool);
+    if( chunk->kind == CPOOL_KIND_EXTENT ) {
+        pool->used -= (sqlite3_int64)(chunk->size - FS_PAGE_SIZE);
+        pool->mapped -= (sqlite3_int64)chunk->size;
+        pool->nExtent--;
+        _cpool_list_remove(&pool->extents, chunk);
+        munmap(chunk, chunk->size);
+    } else {
+        _cpool_free_block(pool, chunk, mem);
+    }
+    CPOOL_LEAVE(pool);
+}
+
+/* returns the usable size of memory from cPoolMalloc() */
+int cPoolSize(void* mem) {
+    const struct cpool_chunk* chunk = _cpool_chunk_of(mem);
+    if( chunk->kind == CPOOL_KIND_EXTENT ) {
+        return (int)(chunk->size - FS_PAGE_SIZE);
+    }
+
+    const size_t offset = (size_t)( (char*)mem - (char*)chunk );
+    return CPOOL_MIN_SIZE << (chunk->map[ offset >> CPOOL_MIN_SHIFT ] & ~CPOOL_USED);
+}
+
+/* resizes memory from cPoolMalloc(), moving it to pool iPool if it moves; returns 0, and leaves mem alone, on failure */
+void* cPoolRealloc(int iPool, void* mem, int newSize) {
+    if( mem == 0 ) return cPoolMalloc(iPool, newSize);
+
+    /* a block that's less than twice too large is kept */
+    const int old_sz = cPoolSize(mem);
+    if( newSize <= old_sz && (newSize > old_sz / 2 || old_sz == CPOOL_MIN_SIZE) ) {
+        return mem;
+    }
+
+    char* new_mem = cPoolMalloc(iPool, newSize);
+    if( new_mem == 0 ) return 0;
+
+    cCopy(new_mem, mem, (size_t)( (old_sz < newSize) ? old_sz : newSize ));
+    cPoolFree(mem);
+    return new_mem;
+}
+
+/* sets the budget of pool iPool, in bytes, or no limit if nBytes is 0; allocations already made are left alone */
+void cPoolSetBudget(int iPool, sqlite3_int64 nBytes) {
+    struct cpool* pool = &_cpool[iPool];
+    CPOOL_ENTER(pool);
+    pool->budget = (nBytes > 0) ? nBytes : 0;
+    CPOOL_LEAVE(pool);
+}
+
+/* takes a snapshot of pool iPool's state */
+void cPoolStats(int iPool, struct composite_pool_stats* pStats) {
+    struct cpool* pool = &_cpool[iPool];
+    CPOOL_ENTER(pool);
+    pStats->used = pool->used;
+    pStats->peak = pool->peak;
+    pStats->mapped = pool->mapped;
+    pStats->budget = pool->budget;
+    pStats->nChunk = pool->nChunk;
+    pStats->nExtent = pool->nExtent;
+    pStats->nAlloc = pool->nAlloc;
+    pStats->nFail = pool->nFail;
+    CPOOL_LEAVE(pool);
+
+    pStats->nMutexEnter = 0;
+    pStats->nMutexContended = 0;
+    #if SQLITE_THREADSAFE
+        cMutexCounters( (sqlite3_mutex*)&pool->mutex, &pStats->nMutexEnter, &pStats->nMutexContended );
+    #endif
+}
+
+/* unmaps every pool's chunks once nothing is allocated from them; called when the inmemfs is torn down */
+void cPoolShutdown(void) {
+    int i;
+    for( i = 0; i < COMPOSITE_FS_POOL_COUNT; i++ ) {
+        struct cpool* pool = &_cpool[i];
+        CPOOL_ENTER(pool);
+        struct cpool_chunk* chunk = pool->chunks;
+        while( chunk ) {
+            struct cpool_chunk* next = chunk->next;
+            if( chunk->nUsed == 0 ) {
+                _cpool_chunk_release(pool, chunk);
+            }
+            chunk = next;
+        }
+        CPOOL_LEAVE(pool);
+    }
+}
+
+#endif // SQLITE_OS_OTHER
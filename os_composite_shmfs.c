@@ -0,0 +1,791 @@
+/* Contains the shared inmemfs: a namespace of files, with their pages and lock state, in a shared memory region
+ * that several processes can map at once. it's registered as its own VFS; see composite_shmfs_attach().
+ *
+ * the region starts with a struct shmfs_region, followed by FS_PAGE_SIZE pages that are handed out to files as
+ * data pages or directory pages. every reference inside the region is an offset from its start.
+ *
+ * locking: a file's mutex guards its data and its SQLite lock state; the region's mutex guards the page allocator
+ * and the namespace. a file's mutex may be held while the region's is taken, never the other way around. both are
+ * robust, process-shared pthread mutexes, so the region doesn't depend on SQLITE_THREADSAFE, and a process that
+ * dies holding one doesn't leave the others waiting for it.
+ *
+ * each file also records, per process, the cFile's that process has open and the SQLite locks they hold. when a
+ * lock would be BUSY, or a file has no slot left for another process, the slots of processes that no longer exist
+ * are taken back first.
+ */
+
+#if SQLITE_OS_OTHER
+
+#include "os_composite.h"
+
+#include <errno.h> /* for errno */
+#include <signal.h> /* for kill() */
+#include <string.h> /* for memcpy(), memset(), strcmp() and strlen() */
+#include <unistd.h> /* for syscall(), ftruncate(), getpid(), usleep() and close() */
+#include <fcntl.h> /* for O_* */
+#include <sched.h> /* for sched_yield() */
+#include <sys/mman.h> /* for shm_open(), shm_unlink() and mmap() */
+#include <sys/stat.h> /* for fstat() */
+#include <sys/syscall.h> /* for SYS_memfd_create */
+#include <linux/memfd.h> /* for MFD_CLOEXEC */
+
+#define SHMFS_MAGIC "cshmfs\0"
+#define SHMFS_VERSION 2
+
+#define SHMFS_STATE_EMPTY 0 /* a new region is all zeroes */
+#define SHMFS_STATE_READY 1
+
+#define SHMFS_SIZE_WAIT_MS 1000 /* how long to wait for the creator of a shared memory object to size it */
+
+/* the header takes up the first pages of the region */
+#define SHMFS_HEADER_SIZE ( (sizeof(struct shmfs_region) + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE * FS_PAGE_SIZE )
+#define SHMFS_MIN_SIZE ( SHMFS_HEADER_SIZE + 16 * FS_PAGE_SIZE )
+#define SHMFS_MAX_PAGES ( (sqlite3_int64)SHMFS_DIR_ENTRIES * SHMFS_DIR_ENTRIES )
+
+/* the process's mapping of the region; 0 if it hasn't attached one */
+static struct shmfs_region* _shmfs_region = 0;
+static sqlite3_int64 _shmfs_size = 0; /* the size of the mapping */
+static int _shmfs_fd = -1;
+static int _shmfs_nOpen = 0; /* the number of files this process has open in the region */
+
+#define _SHMFS_PTR(region, offset) ( (char*)(region) + (offset) )
+
+static void _shmfs_mutex_init(pthread_mutex_t* lock) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* if the mutex's owner died holding it, we get it with EOWNERDEAD. what it guarded may have been left half-updated:
+ * a write may be torn, which SQLite's journal is there for, and a page may be lost to the allocator. the SQLite
+ * locks the process held are taken back by _shmfs_reclaim().
+ */
+static void _shmfs_lock(pthread_mutex_t* lock) {
+    if( pthread_mutex_lock(lock) == EOWNERDEAD ) {
+        pthread_mutex_consistent(lock);
+    }
+}
+
+static void _shmfs_unlock(pthread_mutex_t* lock) {
+    pthread_mutex_unlock(lock);
+}
+
+/* returns 1 if there's no process pid */
+static int _shmfs_pid_dead(int pid) {
+    return pid != 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/* allocates a zeroed page; returns its offset, or 0 if the region is full.
+ * the caller must not hold the region's lock.
+ */
+static sqlite3_uint64 _shmfs_page_alloc(struct shmfs_region* r) {
+    sqlite3_uint64 offset = 0;
+    int reused = 0;
+
+    _shmfs_lock(&r->lock);
+    if( r->freePages != 0 ) {
+        offset = r->freePages;
+        r->freePages = *(sqlite3_uint64*)_SHMFS_PTR(r, offset);
+        r->nFree--;
+        reused = 1;
+    } else if( r->nextPage + FS_PAGE_SIZE <= r->size ) {
+        offset = r->nextPage; /* the region was created zeroed, so pages that were never used still are */
+        r->nextPage += FS_PAGE_SIZE;
+    }
+    _shmfs_unlock(&r->lock);
+
+    if( reused ) {
+        memset(_SHMFS_PTR(r, offset), 0, FS_PAGE_SIZE);
+    }
+    return offset;
+}
+
+/* puts a page back on the free list; the caller must hold the region's lock */
+static void _shmfs_page_free(struct shmfs_region* r, sqlite3_uint64 offset) {
+    *(sqlite3_uint64*)_SHMFS_PTR(r, offset) = r->freePages;
+    r->freePages = offset;
+    r->nFree++;
+}
+
+/* returns the directory entry that holds the offset of page iPage of f, or 0 if there isn't one. if bCreate is
+ * set, missing directory pages are allocated, and 0 is only returned if the region is full.
+ * the caller must hold f's lock.
+ */
+static sqlite3_uint64* _shmfs_page_entry(struct shmfs_region* r, struct shmfs_file* f, sqlite3_int64 iPage, int bCreate) {
+    if( iPage >= SHMFS_MAX_PAGES ) {
+        return 0;
+    }
+
+    if( f->dir == 0 ) {
+        if( !bCreate || (f->dir = _shmfs_page_alloc(r)) == 0 ) return 0;
+    }
+
+    sqlite3_uint64* dir = (sqlite3_uint64*)_SHMFS_PTR(r, f->dir);
+    sqlite3_uint64* leaf = &dir[ iPage / SHMFS_DIR_ENTRIES ];
+    if( *leaf == 0 ) {
+        if( !bCreate || (*leaf = _shmfs_page_alloc(r)) == 0 ) return 0;
+    }
+
+    return &( (sqlite3_uint64*)_SHMFS_PTR(r, *leaf) )[ iPage % SHMFS_DIR_ENTRIES ];
+}
+
+/* frees every page of f from iFirst on, and the directory pages that no longer point at anything.
+ * the caller must hold the region's lock, and f's lock if f is open.
+ */
+static void _shmfs_release_pages(struct shmfs_region* r, struct shmfs_file* f, sqlite3_int64 iFirst) {
+    if( f->dir == 0 ) {
+        return;
+    }
+
+    sqlite3_uint64* dir = (sqlite3_uint64*)_SHMFS_PTR(r, f->dir);
+    int i, j, nLeaves = 0;
+    for( i = 0; i < SHMFS_DIR_ENTRIES; i++ ) {
+        if( dir[i] == 0 ) continue;
+
+        sqlite3_uint64* leaf = (sqlite3_uint64*)_SHMFS_PTR(r, dir[i]);
+        const sqlite3_int64 iBase = (sqlite3_int64)i * SHMFS_DIR_ENTRIES;
+        int nLeft = 0;
+        for( j = 0; j < SHMFS_DIR_ENTRIES; j++ ) {
+            if( leaf[j] == 0 ) continue;
+            if( iBase + j >= iFirst ) {
+                _shmfs_page_free(r, leaf[j]);
+                leaf[j] = 0;
+            } else {
+                nLeft++;
+            }
+        }
+
+        if( nLeft == 0 ) {
+            _shmfs_page_free(r, dir[i]);
+            dir[i] = 0;
+        } else {
+            nLeaves++;
+        }
+    }
+
+    if( nLeaves == 0 ) {
+        _shmfs_page_free(r, f->dir);
+        f->dir = 0;
+    }
+}
+
+/* returns the file named zName, or 0; the caller must hold the region's lock. a file that has been deleted while it
+ * was open no longer has a name, as with unlink()
+ */
+static struct shmfs_file* _shmfs_find(struct shmfs_region* r, const char* zName) {
+    int i;
+    for( i = 0; i < SHMFS_MAX_FILES; i++ ) {
+        if( r->files[i].used && !r->files[i].deleteOnClose && strcmp(r->files[i].zName, zName) == 0 ) {
+            return &r->files[i];
+        }
+    }
+    return 0;
+}
+
+/* the caller must hold the region's lock, and f must not be open */
+static void _shmfs_file_free(struct shmfs_region* r, struct shmfs_file* f) {
+    _shmfs_release_pages(r, f, 0);
+    f->used = 0;
+}
+
+/* returns process pid's slot in f, or 0 if it has none; if bClaim is set, a free slot is claimed for it if there is
+ * one. the caller must hold f's lock
+ */
+static struct shmfs_holder* _shmfs_holder(struct shmfs_file* f, int pid, int bClaim) {
+    struct shmfs_holder* pFree = 0;
+    int i;
+    for( i = 0; i < SHMFS_MAX_HOLDERS; i++ ) {
+        if( f->holders[i].pid == pid ) return &f->holders[i];
+        if( f->holders[i].pid == 0 && pFree == 0 ) pFree = &f->holders[i];
+    }
+
+    if( bClaim && pFree ) {
+        pFree->pid = pid;
+        pFree->nOpen = 0;
+        pFree->nShared = 0;
+        return pFree;
+    }
+    return 0;
+}
+
+/* takes back the references and locks held on f by processes that have died; returns the number of them.
+ * the caller must hold f's lock, and have f open itself, so that its last reference isn't dropped here
+ */
+static int _shmfs_reclaim(struct shmfs_region* r, struct shmfs_file* f) {
+    int i, nRef = 0, nDead = 0;
+    for( i = 0; i < SHMFS_MAX_HOLDERS; i++ ) {
+        struct shmfs_holder* h = &f->holders[i];
+        if( !_shmfs_pid_dead(h->pid) ) {
+            continue;
+        }
+
+        if( f->writerPid == h->pid ) {
+            f->writerPid = 0;
+            f->eLock = SQLITE_LOCK_SHARED;
+        }
+        f->nShared -= h->nShared;
+        nRef += h->nOpen;
+        h->pid = 0;
+        nDead++;
+    }
+    if( f->nShared == 0 ) {
+        f->eLock = SQLITE_LOCK_NONE;
+    }
+
+    if( nRef ) {
+        _shmfs_lock(&r->lock);
+        f->ref -= nRef;
+        _shmfs_unlock(&r->lock);
+    }
+    return nDead;
+}
+
+/* sqlite3_io_methods */
+static int cShmfsUnlock(sqlite3_file* baseFile, int lockType);
+
+static int cShmfsClose(sqlite3_file* baseFile) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_file* f = (struct shmfs_file*)file->fd;
+    struct shmfs_region* r = _shmfs_region;
+
+    if( file->eLock != SQLITE_LOCK_NONE ) {
+        cShmfsUnlock(baseFile, SQLITE_LOCK_NONE);
+    }
+
+    _shmfs_lock(&f->lock);
+    struct shmfs_holder* h = _shmfs_holder(f, getpid(), 0);
+    if( h && --h->nOpen == 0 ) {
+        h->pid = 0;
+    }
+    _shmfs_unlock(&f->lock);
+
+    _shmfs_lock(&r->lock);
+    f->ref--;
+    if( f->ref == 0 && f->deleteOnClose ) {
+        _shmfs_file_free(r, f);
+    }
+    _shmfs_unlock(&r->lock);
+
+    __atomic_sub_fetch(&_shmfs_nOpen, 1, __ATOMIC_RELAXED);
+    file->fd = 0;
+    return SQLITE_OK;
+}
+
+static int cShmfsRead(sqlite3_file* baseFile, void* buf, int iAmt, sqlite3_int64 iOfst) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_file* f = (struct shmfs_file*)file->fd;
+    struct shmfs_region* r = _shmfs_region;
+    char* dst = buf;
+    int rc = SQLITE_OK;
+
+    _shmfs_lock(&f->lock);
+    int n = iAmt;
+    if( iOfst >= f->len ) {
+        n = 0;
+    } else if( iOfst + iAmt > f->len ) {
+        n = (int)(f->len - iOfst);
+    }
+
+    int done = 0;
+    while( done < n ) {
+        const sqlite3_int64 pos = iOfst + done;
+        const int inPage = (int)(pos % FS_PAGE_SIZE);
+        const int chunk = (n - done < FS_PAGE_SIZE - inPage) ? n - done : FS_PAGE_SIZE - inPage;
+
+        const sqlite3_uint64* entry = _shmfs_page_entry(r, f, pos / FS_PAGE_SIZE, 0);
+        if( entry && *entry ) {
+            memcpy(&dst[done], _SHMFS_PTR(r, *entry) + inPage, chunk);
+        } else {
+            memset(&dst[done], 0, chunk); /* a hole */
+        }
+        done += chunk;
+    }
+    _shmfs_unlock(&f->lock);
+
+    if( n < iAmt ) {
+        /* if we do a short read, we have to fill the rest of the buffer with 0's */
+        memset(&dst[n], 0, iAmt - n);
+        rc = SQLITE_IOERR_SHORT_READ;
+    }
+    return rc;
+}
+
+static int cShmfsWrite(sqlite3_file* baseFile, const void* buf, int iAmt, sqlite3_int64 iOfst) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_file* f = (struct shmfs_file*)file->fd;
+    struct shmfs_region* r = _shmfs_region;
+    const char* src = buf;
+    int rc = SQLITE_OK;
+
+    _shmfs_lock(&f->lock);
+    int done = 0;
+    while( done < iAmt ) {
+        const sqlite3_int64 pos = iOfst + done;
+        const int inPage = (int)(pos % FS_PAGE_SIZE);
+        const int chunk = (iAmt - done < FS_PAGE_SIZE - inPage) ? iAmt - done : FS_PAGE_SIZE - inPage;
+
+        sqlite3_uint64* entry = _shmfs_page_entry(r, f, pos / FS_PAGE_SIZE, 1);
+        if( entry && *entry == 0 ) {
+            *entry = _shmfs_page_alloc(r);
+        }
+        if( entry == 0 || *entry == 0 ) {
+            rc = SQLITE_FULL; /* the region is out of pages, or the file is as large as a directory can address */
+            break;
+        }
+
+        memcpy(_SHMFS_PTR(r, *entry) + inPage, &src[done], chunk);
+        done += chunk;
+    }
+
+    if( iOfst + done > f->len ) {
+        f->len = iOfst + done;
+    }
+    _shmfs_unlock(&f->lock);
+
+    return rc;
+}
+
+static int cShmfsTruncate(sqlite3_file* baseFile, sqlite3_int64 size) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_file* f = (struct shmfs_file*)file->fd;
+    struct shmfs_region* r = _shmfs_region;
+
+    _shmfs_lock(&f->lock);
+    if( size < f->len ) {
+        /* zero the rest of the last page, so that it reads back as zeroes if the file grows again */
+        const int inPage = (int)(size % FS_PAGE_SIZE);
+        if( inPage != 0 ) {
+            const sqlite3_uint64* entry = _shmfs_page_entry(r, f, size / FS_PAGE_SIZE, 0);
+            if( entry && *entry ) {
+                memset(_SHMFS_PTR(r, *entry) + inPage, 0, FS_PAGE_SIZE - inPage);
+            }
+        }
+
+        _shmfs_lock(&r->lock);
+        _shmfs_release_pages(r, f, (size + FS_PAGE_SIZE - 1) / FS_PAGE_SIZE);
+        _shmfs_unlock(&r->lock);
+    }
+    f->len = size;
+    _shmfs_unlock(&f->lock);
+
+    return SQLITE_OK;
+}
+
+static int cShmfsSync(sqlite3_file* baseFile, int flags) {
+    /* this is a NOP -- the region is shared memory, so every process sees a write as soon as it's made */
+    return SQLITE_OK;
+}
+
+static int cShmfsFileSize(sqlite3_file* baseFile, sqlite3_int64 *pSize) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_file* f = (struct shmfs_file*)file->fd;
+
+    _shmfs_lock(&f->lock);
+    *pSize = f->len;
+    _shmfs_unlock(&f->lock);
+    return SQLITE_OK;
+}
+
+/* returns 1 if another connection keeps file from getting lockType on f at once */
+static int _shmfs_lock_busy(struct cFile* file, struct shmfs_file* f, int lockType) {
+    if( file->eLock != f->eLock && (f->eLock >= SQLITE_LOCK_PENDING || lockType > SQLITE_LOCK_SHARED) ) {
+        return 1;
+    }
+    return lockType == SQLITE_LOCK_EXCLUSIVE && f->nShared > 1;
+}
+
+/* the same locking as cLock(), with the file's lock state in the region instead of the process. the connection in
+ * the way of a lock may belong to a process that has died, so that's checked before returning SQLITE_BUSY
+ */
+static int cShmfsLock(sqlite3_file* baseFile, int lockType) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_file* f = (struct shmfs_file*)file->fd;
+    int rc = SQLITE_OK;
+
+    if( file->eLock >= lockType ) {
+        return SQLITE_OK;
+    }
+
+    _shmfs_lock(&f->lock);
+    if( _shmfs_lock_busy(file, f, lockType) ) {
+        _shmfs_reclaim(_shmfs_region, f);
+    }
+
+    if( file->eLock != f->eLock && (f->eLock >= SQLITE_LOCK_PENDING || lockType > SQLITE_LOCK_SHARED) ) {
+        rc = SQLITE_BUSY;
+    } else if( lockType == SQLITE_LOCK_SHARED ) {
+        if( f->eLock == SQLITE_LOCK_NONE ) {
+            f->eLock = SQLITE_LOCK_SHARED;
+        }
+        f->nShared++;
+        _shmfs_holder(f, getpid(), 0)->nShared++; /* cShmfsOpen() claimed the process's slot */
+        file->eLock = SQLITE_LOCK_SHARED;
+    } else if( lockType == SQLITE_LOCK_EXCLUSIVE && f->nShared > 1 ) {
+        f->eLock = SQLITE_LOCK_PENDING;
+        f->writerPid = getpid();
+        file->eLock = SQLITE_LOCK_PENDING;
+        rc = SQLITE_BUSY;
+    } else {
+        f->eLock = lockType;
+        f->writerPid = getpid();
+        file->eLock = lockType;
+    }
+    _shmfs_unlock(&f->lock);
+
+    return rc;
+}
+
+static int cShmfsUnlock(sqlite3_file* baseFile, int lockType) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_file* f = (struct shmfs_file*)file->fd;
+
+    if( file->eLock <= lockType ) {
+        return SQLITE_OK;
+    }
+
+    _shmfs_lock(&f->lock);
+    if( file->eLock > SQLITE_LOCK_SHARED ) {
+        f->eLock = SQLITE_LOCK_SHARED;
+        f->writerPid = 0;
+    }
+
+    if( lockType == SQLITE_LOCK_NONE ) {
+        f->nShared--;
+        _shmfs_holder(f, getpid(), 0)->nShared--;
+        if( f->nShared == 0 ) {
+            f->eLock = SQLITE_LOCK_NONE;
+        }
+    }
+
+    file->eLock = lockType;
+    _shmfs_unlock(&f->lock);
+
+    return SQLITE_OK;
+}
+
+/* a writer that died leaves its journal behind; its lock mustn't keep SQLite from seeing that the journal is hot */
+static int cShmfsCheckReservedLock(sqlite3_file* baseFile, int *pResOut) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_file* f = (struct shmfs_file*)file->fd;
+
+    int reserved = ( __atomic_load_n(&f->eLock, __ATOMIC_ACQUIRE) > SQLITE_LOCK_SHARED );
+    if( reserved ) {
+        _shmfs_lock(&f->lock);
+        _shmfs_reclaim(_shmfs_region, f);
+        reserved = ( f->eLock > SQLITE_LOCK_SHARED );
+        _shmfs_unlock(&f->lock);
+    }
+
+    if( pResOut ) *pResOut = reserved;
+    return SQLITE_OK;
+}
+
+static int cShmfsFileControl(sqlite3_file* baseFile, int op, void *pArg) {
+    return SQLITE_NOTFOUND;
+}
+
+/* version 1: there's no wal-index in the region, and pages can be freed and reused by another process at any time,
+ * so they can't be handed out with xFetch()
+ */
+static struct sqlite3_io_methods shmfs_io_methods = {
+    .iVersion = 1,
+    .xClose = cShmfsClose,
+    .xRead = cShmfsRead,
+    .xWrite = cShmfsWrite,
+    .xTruncate = cShmfsTruncate,
+    .xSync = cShmfsSync,
+    .xFileSize = cShmfsFileSize,
+    .xLock = cShmfsLock,
+    .xUnlock = cShmfsUnlock,
+    .xCheckReservedLock = cShmfsCheckReservedLock,
+    .xFileControl = cShmfsFileControl,
+    .xSectorSize = cSectorSize,
+    .xDeviceCharacteristics = cDeviceCharacteristics
+};
+
+/* sqlite_vfs */
+static int cShmfsOpen(sqlite3_vfs* vfs, const char *zName, sqlite3_file* baseFile, int flags, int *pOutFlags) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct shmfs_region* r = _shmfs_region;
+    file->composite_io_methods = 0;
+
+    /* temporary files belong to one connection, so there's no need to share them */
+    if( zName == 0 || (flags & (SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TEMP_JOURNAL | SQLITE_OPEN_TRANSIENT_DB | SQLITE_OPEN_SUBJOURNAL)) ) {
+        sqlite3_vfs* local = sqlite3_vfs_find(COMPOSITE_INMEMFS_VFS);
+        return local ? local->xOpen(local, zName, baseFile, flags, pOutFlags) : SQLITE_CANTOPEN;
+    }
+
+    if( strlen(zName) > MAX_PATHNAME ) {
+        return SQLITE_CANTOPEN;
+    }
+
+    if( pOutFlags ) *pOutFlags = flags;
+
+    _shmfs_lock(&r->lock);
+    struct shmfs_file* f = _shmfs_find(r, zName);
+    if( f && (flags & SQLITE_OPEN_CREATE) && (flags & SQLITE_OPEN_EXCLUSIVE) ) {
+        _shmfs_unlock(&r->lock);
+        return SQLITE_IOERR; /* the file already exists -- error! */
+    }
+
+    if( f == 0 ) {
+        int i;
+        for( i = 0; i < SHMFS_MAX_FILES && r->files[i].used; i++ ) {}
+        if( i == SHMFS_MAX_FILES ) {
+            _shmfs_unlock(&r->lock);
+            return SQLITE_CANTOPEN;
+        }
+
+        /* the entry's mutex was set up with the region, and nobody holds it: the entry is free */
+        f = &r->files[i];
+        strcpy(f->zName, zName);
+        f->id = ++r->nextId;
+        f->len = 0;
+        f->dir = 0;
+        f->eLock = SQLITE_LOCK_NONE;
+        f->nShared = 0;
+        f->writerPid = 0;
+        memset(f->holders, 0, sizeof(f->holders));
+        f->ref = 0;
+        f->deleteOnClose = 0;
+        f->used = 1;
+    }
+
+    f->ref++;
+    if( flags & SQLITE_OPEN_DELETEONCLOSE ) {
+        f->deleteOnClose = 1;
+    }
+    _shmfs_unlock(&r->lock);
+
+    /* the process needs a slot in the file, which may be held by processes that have died */
+    _shmfs_lock(&f->lock);
+    struct shmfs_holder* h = _shmfs_holder(f, getpid(), 1);
+    if( h == 0 && _shmfs_reclaim(r, f) ) {
+        h = _shmfs_holder(f, getpid(), 1);
+    }
+    if( h ) {
+        h->nOpen++;
+    }
+    _shmfs_unlock(&f->lock);
+
+    if( h == 0 ) {
+        _shmfs_lock(&r->lock);
+        f->ref--;
+        if( f->ref == 0 && f->deleteOnClose ) {
+            _shmfs_file_free(r, f);
+        }
+        _shmfs_unlock(&r->lock);
+        return SQLITE_CANTOPEN; /* SHMFS_MAX_HOLDERS processes have it open */
+    }
+    __atomic_add_fetch(&_shmfs_nOpen, 1, __ATOMIC_RELAXED);
+
+    memset(file, 0, sizeof(*file));
+    file->composite_io_methods = &shmfs_io_methods;
+    file->zName = f->zName;
+    file->fd = f;
+    file->fileId = f->id;
+    file->fileType = (flags & SQLITE_OPEN_MAIN_DB) ? CFILE_TYPE_MAIN_DB : (flags & SQLITE_OPEN_MAIN_JOURNAL) ? CFILE_TYPE_MAIN_JOURNAL : CFILE_TYPE_OTHER;
+    file->eLock = SQLITE_LOCK_NONE;
+    return SQLITE_OK;
+}
+
+static int cShmfsDelete(sqlite3_vfs* vfs, const char *zName, int syncDir) {
+    struct shmfs_region* r = _shmfs_region;
+
+    _shmfs_lock(&r->lock);
+    struct shmfs_file* f = _shmfs_find(r, zName);
+    if( f && f->ref == 0 ) {
+        _shmfs_file_free(r, f);
+        f = 0;
+    } else if( f ) {
+        f->deleteOnClose = 1; /* the file is open somewhere; it will be deleted when it's closed */
+        f->ref++; /* held while we look for references left by processes that have died */
+    }
+    _shmfs_unlock(&r->lock);
+
+    if( f ) {
+        _shmfs_lock(&f->lock);
+        _shmfs_reclaim(r, f);
+        _shmfs_unlock(&f->lock);
+
+        _shmfs_lock(&r->lock);
+        f->ref--;
+        if( f->ref == 0 ) {
+            _shmfs_file_free(r, f);
+        }
+        _shmfs_unlock(&r->lock);
+    }
+    return SQLITE_OK;
+}
+
+static int cShmfsAccess(sqlite3_vfs* vfs, const char *zName, int flags, int *pResOut) {
+    struct shmfs_region* r = _shmfs_region;
+
+    _shmfs_lock(&r->lock);
+    *pResOut = (_shmfs_find(r, zName) != 0);
+    _shmfs_unlock(&r->lock);
+    return SQLITE_OK;
+}
+
+static sqlite3_vfs shmfs_vfs = {
+    .iVersion = 2,
+    .szOsFile = sizeof(struct cFile),
+    .mxPathname = MAX_PATHNAME,
+    .pNext = 0,
+    .zName = COMPOSITE_SHMFS_VFS,
+    .pAppData = &composite_vfs_app_data,
+    .xOpen = cShmfsOpen,
+    .xDelete = cShmfsDelete,
+    .xAccess = cShmfsAccess,
+    .xFullPathname = cFullPathname,
+    .xDlOpen = 0,
+    .xDlError = 0,
+    .xDlSym = 0,
+    .xDlClose = 0,
+    .xRandomness = cRandomness,
+    .xSleep = cSleep,
+    .xCurrentTime = cCurrentTime,
+    .xGetLastError = cGetLastError,
+    .xCurrentTimeInt64 = cCurrentTimeInt64,
+    .xSetSystemCall = 0,
+    .xGetSystemCall = 0,
+    .xNextSystemCall = 0
+};
+
+/* sets up a new region, or waits for the process that's setting it up; returns 1 if it's a usable region.
+ * nothing else touches the region until it's READY, so if the process setting it up dies first, another process
+ * starts over in its place
+ */
+static int _shmfs_region_init(struct shmfs_region* r, sqlite3_int64 size) {
+    const int pid = getpid();
+    while( __atomic_load_n(&r->state, __ATOMIC_ACQUIRE) != SHMFS_STATE_READY ) {
+        int owner = 0;
+        if( !__atomic_compare_exchange_n(&r->initPid, &owner, pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+            && !(_shmfs_pid_dead(owner) && __atomic_compare_exchange_n(&r->initPid, &owner, pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) ) {
+            sched_yield();
+            continue;
+        }
+
+        int i;
+        memcpy(r->magic, SHMFS_MAGIC, sizeof(r->magic));
+        r->version = SHMFS_VERSION;
+        r->size = size;
+        _shmfs_mutex_init(&r->lock);
+        for( i = 0; i < SHMFS_MAX_FILES; i++ ) {
+            _shmfs_mutex_init(&r->files[i].lock);
+        }
+        r->nextPage = SHMFS_HEADER_SIZE;
+        __atomic_store_n(&r->state, SHMFS_STATE_READY, __ATOMIC_RELEASE);
+    }
+
+    return memcmp(r->magic, SHMFS_MAGIC, sizeof(r->magic)) == 0 && r->version == SHMFS_VERSION
+        && r->size == (sqlite3_uint64)size;
+}
+
+/* opens the shared memory object zName, creating it with a size of nBytes if it doesn't exist. only the process that
+ * creates it sizes it, so that two processes that get here at once can't both see it empty and each size it; the
+ * others wait until it has been sized, or size it themselves if the creator hasn't after SHMFS_SIZE_WAIT_MS, as it
+ * may have died. returns the descriptor, or -1; *pSize is set to the object's size.
+ */
+static int _shmfs_open(const char* zName, sqlite3_int64 nBytes, sqlite3_int64* pSize) {
+    struct stat st;
+    int fd = shm_open(zName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if( fd >= 0 ) {
+        if( ftruncate(fd, nBytes) != 0 ) {
+            close(fd);
+            shm_unlink(zName);
+            return -1;
+        }
+        *pSize = nBytes;
+        return fd;
+    }
+
+    if( errno != EEXIST || (fd = shm_open(zName, O_RDWR | O_CLOEXEC, 0600)) < 0 ) {
+        return -1;
+    }
+    int nWait;
+    for( nWait = 0; fstat(fd, &st) == 0; nWait++ ) {
+        if( st.st_size != 0 ) {
+            *pSize = st.st_size;
+            return fd;
+        }
+        if( nWait == SHMFS_SIZE_WAIT_MS && ftruncate(fd, nBytes) != 0 ) {
+            break;
+        }
+        usleep(1000); /* the creator hasn't sized it yet */
+    }
+
+    close(fd);
+    return -1;
+}
+
+int composite_shmfs_attach(const char* zName, sqlite3_int64 nBytes) {
+    nBytes -= nBytes % FS_PAGE_SIZE;
+    if( _shmfs_region != 0 || nBytes < (sqlite3_int64)SHMFS_MIN_SIZE ) {
+        return SQLITE_MISUSE;
+    }
+
+    /* sizing a new object leaves it zeroed, which is what _shmfs_region_init() expects */
+    sqlite3_int64 size = nBytes;
+    int fd;
+    if( zName ) {
+        fd = _shmfs_open(zName, nBytes, &size);
+    } else {
+        fd = (int)syscall(SYS_memfd_create, "composite-shm", MFD_CLOEXEC);
+        if( fd >= 0 && ftruncate(fd, nBytes) != 0 ) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if( fd < 0 ) {
+        return SQLITE_CANTOPEN;
+    }
+    if( size != nBytes ) {
+        close(fd);
+        return SQLITE_MISUSE; /* another process created it with a different size */
+    }
+
+    void* p = mmap(0, nBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if( p == MAP_FAILED ) {
+        close(fd);
+        return SQLITE_CANTOPEN;
+    }
+
+    if( !_shmfs_region_init((struct shmfs_region*)p, nBytes) ) {
+        munmap(p, nBytes);
+        close(fd);
+        return SQLITE_CORRUPT;
+    }
+
+    _shmfs_region = (struct shmfs_region*)p;
+    _shmfs_size = nBytes;
+    _shmfs_fd = fd;
+
+    const int rc = sqlite3_vfs_register(&shmfs_vfs, 0);
+    if( rc != SQLITE_OK ) {
+        composite_shmfs_detach();
+    }
+    return rc;
+}
+
+int composite_shmfs_detach(void) {
+    if( _shmfs_region == 0 ) {
+        return SQLITE_MISUSE;
+    }
+
+    if( __atomic_load_n(&_shmfs_nOpen, __ATOMIC_RELAXED) != 0 ) {
+        return SQLITE_BUSY;
+    }
+
+    sqlite3_vfs_unregister(&shmfs_vfs);
+    munmap(_shmfs_region, _shmfs_size);
+    close(_shmfs_fd);
+    _shmfs_region = 0;
+    _shmfs_fd = -1;
+    return SQLITE_OK;
+}
+
+#endif // SQLITE_OS_OTHER
@@ -0,0 +1,367 @@
+/* Contains the composite_stats and composite_files virtual tables
+ *
+ * both are eponymous-only, read-only tables, so any connection can query them without a CREATE VIRTUAL TABLE:
+ *
+ *   SELECT * FROM composite_stats;    -- one (name, value) row per allocator, mutex and filesystem counter
+ *   SELECT * FROM composite_files;    -- one row per inmemfs file, in any instance: size vs. capacity, I/O counts and bytes
+ *
+ * every scan takes a fresh snapshot, so polling them shows the live state of the process.
+ */
+
+#if SQLITE_OS_OTHER
+
+#include "os_composite.h"
+
+#include <string.h> /* for memset() */
+
+#define CSTATS_MAX_ROWS 96
+
+struct cstats_row {
+    const char* zName;
+    int isReal; /* 1 if the value is rValue, 0 if it's iValue */
+    sqlite3_int64 iValue;
+    double rValue;
+};
+
+struct cstats_vtab {
+    sqlite3_vtab base;
+    int isFiles; /* 1 for composite_files, 0 for composite_stats */
+};
+
+struct cstats_cursor {
+    sqlite3_vtab_cursor base;
+    int iRow;
+    int nRow;
+    struct cstats_row aStat[CSTATS_MAX_ROWS]; /* composite_stats */
+    struct fs_file_info* aFile; /* composite_files */
+};
+
+#if SQLITE_THREADSAFE
+/* SQLite's static mutexes, SQLITE_MUTEX_STATIC_MASTER through SQLITE_MUTEX_STATIC_VFS3 */
+static const char* const _cstats_mutex_names[][2] = {
+    { "mutex.static_master.enters", "mutex.static_master.contended" },
+    { "mutex.static_mem.enters", "mutex.static_mem.contended" },
+    { "mutex.static_open.enters", "mutex.static_open.contended" },
+    { "mutex.static_prng.enters", "mutex.static_prng.contended" },
+    { "mutex.static_lru.enters", "mutex.static_lru.contended" },
+    { "mutex.static_pmem.enters", "mutex.static_pmem.contended" },
+    { "mutex.static_app1.enters", "mutex.static_app1.contended" },
+    { "mutex.static_app2.enters", "mutex.static_app2.contended" },
+    { "mutex.static_app3.enters", "mutex.static_app3.contended" },
+    { "mutex.static_vfs1.enters", "mutex.static_vfs1.contended" },
+    { "mutex.static_vfs2.enters", "mutex.static_vfs2.contended" },
+    { "mutex.static_vfs3.enters", "mutex.static_vfs3.contended" }
+};
+#endif
+
+/* the inmemfs pools, COMPOSITE_FS_POOL_MAIN and COMPOSITE_FS_POOL_TEMP */
+static const char* const _cstats_pool_names[COMPOSITE_FS_POOL_COUNT][8] = {
+    { "pool.main.used", "pool.main.peak", "pool.main.mapped", "pool.main.budget", "pool.main.allocs", "pool.main.failures",
+      "mutex.pool_main.enters", "mutex.pool_main.contended" },
+    { "pool.temp.used", "pool.temp.peak", "pool.temp.mapped", "pool.temp.budget", "pool.temp.allocs", "pool.temp.failures",
+      "mutex.pool_temp.enters", "mutex.pool_temp.contended" }
+};
+
+#define CFILES_COLUMNS \
+    "CREATE TABLE x(name TEXT, id INTEGER, size INTEGER, capacity INTEGER, image_bytes INTEGER, shared_bytes INTEGER, hole_bytes INTEGER, refs INTEGER, delete_on_close INTEGER," \
+    " reads INTEGER, read_bytes INTEGER, writes INTEGER, write_bytes INTEGER, fetches INTEGER," \
+    " mutex_enters INTEGER, mutex_contended INTEGER," \
+    " compressed_bytes INTEGER, compressed_size INTEGER, compressions INTEGER, compress_ns INTEGER, decompressions INTEGER, decompress_ns INTEGER," \
+    " spilled_bytes INTEGER, spills INTEGER, faults INTEGER, fault_ns INTEGER, vfs TEXT)"
+
+static void _cstats_int(struct cstats_cursor* cur, const char* zName, sqlite3_int64 value) {
+    if( cur->nRow < CSTATS_MAX_ROWS ) {
+        struct cstats_row* row = &cur->aStat[ cur->nRow++ ];
+        row->zName = zName;
+        row->isReal = 0;
+        row->iValue = value;
+    }
+}
+
+static void _cstats_real(struct cstats_cursor* cur, const char* zName, double value) {
+    if( cur->nRow < CSTATS_MAX_ROWS ) {
+        struct cstats_row* row = &cur->aStat[ cur->nRow++ ];
+        row->zName = zName;
+        row->isReal = 1;
+        row->rValue = value;
+    }
+}
+
+/* fills the cursor with a snapshot of every counter; returns SQLITE_OK or SQLITE_NOMEM */
+static int _cstats_snapshot(struct cstats_cursor* cur) {
+    struct composite_mem_stats mem;
+    cMemStats(&mem);
+
+    const sqlite3_int64 small_capacity = (sqlite3_int64)mem.nSlabSmall * (mem.nSlab ? mem.arena_size / mem.nSlab : 0);
+
+    _cstats_int(cur, "memory.outstanding", mem.outstanding_memory);
+    _cstats_int(cur, "memory.max", mem.max_memory);
+    _cstats_int(cur, "arena.size", mem.arena_size);
+    _cstats_int(cur, "arena.reserved", mem.arena_reserved);
+    _cstats_int(cur, "arena.committed", mem.arena_committed);
+    _cstats_int(cur, "arena.retained", mem.retained_bytes);
+    _cstats_int(cur, "arena.slabs", mem.nSlab);
+    _cstats_int(cur, "arena.slabs_touched", mem.nSlabTouched);
+    _cstats_int(cur, "arena.slabs_free", mem.nSlabFree);
+    _cstats_int(cur, "arena.slabs_small", mem.nSlabSmall);
+    _cstats_int(cur, "arena.slabs_large", mem.nSlabLarge);
+    _cstats_int(cur, "arena.largest_free_run", mem.nLargestFreeRun);
+    _cstats_int(cur, "arena.small_bytes", mem.small_bytes);
+    _cstats_int(cur, "arena.small_capacity", small_capacity);
+    _cstats_int(cur, "arena.thread_caches", mem.nThreadCache);
+    _cstats_int(cur, "arena.cached_bytes", mem.cached_bytes);
+    _cstats_int(cur, "arena.cache_hits", (sqlite3_int64)mem.nCacheHit);
+    _cstats_int(cur, "arena.cache_refills", (sqlite3_int64)mem.nCacheRefill);
+    _cstats_int(cur, "arena.cache_flushes", (sqlite3_int64)mem.nCacheFlush);
+
+    /* internal: the share of small-object slabs that isn't handed out.
+     * external: the share of free slabs that can't be used by the largest allocation that would still fit.
+     */
+    _cstats_real(cur, "arena.internal_fragmentation", small_capacity ? 1.0 - (double)mem.small_bytes / (double)small_capacity : 0.0);
+    _cstats_real(cur, "arena.external_fragmentation", mem.nSlabFree ? 1.0 - (double)mem.nLargestFreeRun / (double)mem.nSlabFree : 0.0);
+
+    #if SQLITE_THREADSAFE
+        _cstats_int(cur, "mutex.allocator.enters", (sqlite3_int64)mem.nMutexEnter);
+        _cstats_int(cur, "mutex.allocator.contended", (sqlite3_int64)mem.nMutexContended);
+
+        sqlite3_uint64 nEnter, nContended;
+        int i;
+        for( i = SQLITE_MUTEX_STATIC_MASTER; i <= SQLITE_MUTEX_STATIC_VFS3; i++ ) {
+            if( cMutexStats(i, &nEnter, &nContended) == SQLITE_OK ) {
+                _cstats_int(cur, _cstats_mutex_names[ i - SQLITE_MUTEX_STATIC_MASTER ][0], (sqlite3_int64)nEnter);
+                _cstats_int(cur, _cstats_mutex_names[ i - SQLITE_MUTEX_STATIC_MASTER ][1], (sqlite3_int64)nContended);
+            }
+        }
+
+        /* mutexes that are still allocated (connections', files') only add to these once they're freed */
+        if( cMutexStats(SQLITE_MUTEX_FAST, &nEnter, &nContended) == SQLITE_OK ) {
+            _cstats_int(cur, "mutex.freed_fast.enters", (sqlite3_int64)nEnter);
+            _cstats_int(cur, "mutex.freed_fast.contended", (sqlite3_int64)nContended);
+        }
+        if( cMutexStats(SQLITE_MUTEX_RECURSIVE, &nEnter, &nContended) == SQLITE_OK ) {
+            _cstats_int(cur, "mutex.freed_recursive.enters", (sqlite3_int64)nEnter);
+            _cstats_int(cur, "mutex.freed_recursive.contended", (sqlite3_int64)nContended);
+        }
+    #endif
+
+    struct fs_file_info* aFile;
+    const int nFile = fs_list(&aFile);
+    if( nFile < 0 ) {
+        return SQLITE_NOMEM;
+    }
+
+    sqlite3_int64 size = 0, capacity = 0, holes = 0, compressed = 0, compressed_size = 0;
+    sqlite3_uint64 nDecompress = 0, nDecompressNs = 0;
+    int j;
+    for( j = 0; j < nFile; j++ ) {
+        size += aFile[j].size;
+        capacity += aFile[j].capacity;
+        holes += aFile[j].holes;
+        compressed += aFile[j].compressed;
+        compressed_size += aFile[j].compressed_size;
+        nDecompress += aFile[j].nDecompress;
+        nDecompressNs += aFile[j].nDecompressNs;
+    }
+    sqlite3_free(aFile);
+
+    _cstats_int(cur, "files.count", nFile);
+    _cstats_int(cur, "files.size", size);
+    _cstats_int(cur, "files.capacity", capacity);
+    _cstats_int(cur, "files.holes", holes);
+    _cstats_int(cur, "files.compressed", compressed);
+    _cstats_int(cur, "files.compressed_size", compressed_size);
+    _cstats_int(cur, "files.decompressions", (sqlite3_int64)nDecompress);
+    _cstats_real(cur, "files.decompress_avg_ns", nDecompress ? (double)nDecompressNs / (double)nDecompress : 0.0);
+
+    sqlite3_int64 resident, budget, spilled, spill_file;
+    fs_budget_stats(&resident, &budget, &spilled, &spill_file);
+    _cstats_int(cur, "files.resident", resident);
+    _cstats_int(cur, "files.budget", budget);
+    _cstats_int(cur, "files.spilled", spilled);
+    _cstats_int(cur, "files.spill_file_size", spill_file);
+
+    int iPool;
+    for( iPool = 0; iPool < COMPOSITE_FS_POOL_COUNT; iPool++ ) {
+        struct composite_pool_stats pool;
+        cPoolStats(iPool, &pool);
+
+        const char* const* azName = _cstats_pool_names[iPool];
+        _cstats_int(cur, azName[0], pool.used);
+        _cstats_int(cur, azName[1], pool.peak);
+        _cstats_int(cur, azName[2], pool.mapped);
+        _cstats_int(cur, azName[3], pool.budget);
+        _cstats_int(cur, azName[4], (sqlite3_int64)pool.nAlloc);
+        _cstats_int(cur, azName[5], (sqlite3_int64)pool.nFail);
+        #if SQLITE_THREADSAFE
+            _cstats_int(cur, azName[6], (sqlite3_int64)pool.nMutexEnter);
+            _cstats_int(cur, azName[7], (sqlite3_int64)pool.nMutexContended);
+        #endif
+    }
+
+    return SQLITE_OK;
+}
+
+static int _cstats_connect(sqlite3* db, void* pAux, int argc, const char* const* argv, sqlite3_vtab** ppVtab, char** pzErr) {
+    const int isFiles = (pAux != 0);
+    const int rc = sqlite3_declare_vtab(db, isFiles ? CFILES_COLUMNS : "CREATE TABLE x(name TEXT, value)");
+    if( rc != SQLITE_OK ) {
+        return rc;
+    }
+
+    struct cstats_vtab* vtab = sqlite3_malloc64( sizeof(struct cstats_vtab) );
+    if( vtab == 0 ) {
+        return SQLITE_NOMEM;
+    }
+
+    memset(vtab, 0, sizeof(*vtab));
+    vtab->isFiles = isFiles;
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int _cstats_disconnect(sqlite3_vtab* pVtab) {
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+/* every scan is a full scan of a small snapshot */
+static int _cstats_best_index(sqlite3_vtab* pVtab, sqlite3_index_info* pInfo) {
+    pInfo->estimatedCost = 100;
+    pInfo->estimatedRows = 50;
+    return SQLITE_OK;
+}
+
+static int _cstats_open(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
+    struct cstats_cursor* cur = sqlite3_malloc64( sizeof(struct cstats_cursor) );
+    if( cur == 0 ) {
+        return SQLITE_NOMEM;
+    }
+
+    memset(cur, 0, sizeof(*cur));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int _cstats_close(sqlite3_vtab_cursor* pCursor) {
+    struct cstats_cursor* cur = (struct cstats_cursor*)pCursor;
+    sqlite3_free(cur->aFile);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int _cstats_filter(sqlite3_vtab_cursor* pCursor, int idxNum, const char* idxStr, int argc, sqlite3_value** argv) {
+    struct cstats_cursor* cur = (struct cstats_cursor*)pCursor;
+    const struct cstats_vtab* vtab = (const struct cstats_vtab*)pCursor->pVtab;
+
+    sqlite3_free(cur->aFile);
+    cur->aFile = 0;
+    cur->iRow = 0;
+    cur->nRow = 0;
+
+    if( !vtab->isFiles ) {
+        return _cstats_snapshot(cur);
+    }
+
+    const int n = fs_list(&cur->aFile);
+    if( n < 0 ) {
+        return SQLITE_NOMEM;
+    }
+    cur->nRow = n;
+    return SQLITE_OK;
+}
+
+static int _cstats_next(sqlite3_vtab_cursor* pCursor) {
+    struct cstats_cursor* cur = (struct cstats_cursor*)pCursor;
+    cur->iRow++;
+    return SQLITE_OK;
+}
+
+static int _cstats_eof(sqlite3_vtab_cursor* pCursor) {
+    const struct cstats_cursor* cur = (const struct cstats_cursor*)pCursor;
+    return cur->iRow >= cur->nRow;
+}
+
+static void _cstats_file_column(const struct fs_file_info* info, sqlite3_context* ctx, int i) {
+    switch( i ) {
+        case 0: sqlite3_result_text(ctx, info->zName, -1, SQLITE_TRANSIENT); break;
+        case 1: sqlite3_result_int64(ctx, info->id); break;
+        case 2: sqlite3_result_int64(ctx, info->size); break;
+        case 3: sqlite3_result_int64(ctx, info->capacity); break;
+        case 4: sqlite3_result_int64(ctx, info->mapped); break;
+        case 5: sqlite3_result_int64(ctx, info->shared); break;
+        case 6: sqlite3_result_int64(ctx, info->holes); break;
+        case 7: sqlite3_result_int(ctx, info->ref); break;
+        case 8: sqlite3_result_int(ctx, info->deleteOnClose); break;
+        case 9: sqlite3_result_int64(ctx, (sqlite3_int64)info->nRead); break;
+        case 10: sqlite3_result_int64(ctx, (sqlite3_int64)info->nReadBytes); break;
+        case 11: sqlite3_result_int64(ctx, (sqlite3_int64)info->nWrite); break;
+        case 12: sqlite3_result_int64(ctx, (sqlite3_int64)info->nWriteBytes); break;
+        case 13: sqlite3_result_int64(ctx, (sqlite3_int64)info->nFetch); break;
+        case 14: sqlite3_result_int64(ctx, (sqlite3_int64)info->nMutexEnter); break;
+        case 15: sqlite3_result_int64(ctx, (sqlite3_int64)info->nMutexContended); break;
+        case 16: sqlite3_result_int64(ctx, info->compressed); break;
+        case 17: sqlite3_result_int64(ctx, info->compressed_size); break;
+        case 18: sqlite3_result_int64(ctx, (sqlite3_int64)info->nCompress); break;
+        case 19: sqlite3_result_int64(ctx, (sqlite3_int64)info->nCompressNs); break;
+        case 20: sqlite3_result_int64(ctx, (sqlite3_int64)info->nDecompress); break;
+        case 21: sqlite3_result_int64(ctx, (sqlite3_int64)info->nDecompressNs); break;
+        case 22: sqlite3_result_int64(ctx, info->spilled); break;
+        case 23: sqlite3_result_int64(ctx, (sqlite3_int64)info->nSpill); break;
+        case 24: sqlite3_result_int64(ctx, (sqlite3_int64)info->nFault); break;
+        case 25: sqlite3_result_int64(ctx, (sqlite3_int64)info->nFaultNs); break;
+        case 26: sqlite3_result_text(ctx, info->zVfs, -1, SQLITE_STATIC); break;
+    }
+}
+
+static int _cstats_column(sqlite3_vtab_cursor* pCursor, sqlite3_context* ctx, int i) {
+    const struct cstats_cursor* cur = (const struct cstats_cursor*)pCursor;
+    const struct cstats_vtab* vtab = (const struct cstats_vtab*)pCursor->pVtab;
+
+    if( vtab->isFiles ) {
+        _cstats_file_column(&cur->aFile[ cur->iRow ], ctx, i);
+        return SQLITE_OK;
+    }
+
+    const struct cstats_row* row = &cur->aStat[ cur->iRow ];
+    if( i == 0 ) {
+        sqlite3_result_text(ctx, row->zName, -1, SQLITE_STATIC);
+    } else if( row->isReal ) {
+        sqlite3_result_double(ctx, row->rValue);
+    } else {
+        sqlite3_result_int64(ctx, row->iValue);
+    }
+    return SQLITE_OK;
+}
+
+static int _cstats_rowid(sqlite3_vtab_cursor* pCursor, sqlite3_int64* pRowid) {
+    const struct cstats_cursor* cur = (const struct cstats_cursor*)pCursor;
+    *pRowid = cur->iRow;
+    return SQLITE_OK;
+}
+
+/* xCreate is 0, which makes the module eponymous-only: it can't be used in CREATE VIRTUAL TABLE */
+static sqlite3_module composite_stats_module = {
+    .iVersion = 0,
+    .xCreate = 0,
+    .xConnect = _cstats_connect,
+    .xBestIndex = _cstats_best_index,
+    .xDisconnect = _cstats_disconnect,
+    .xDestroy = _cstats_disconnect,
+    .xOpen = _cstats_open,
+    .xClose = _cstats_close,
+    .xFilter = _cstats_filter,
+    .xNext = _cstats_next,
+    .xEof = _cstats_eof,
+    .xColumn = _cstats_column,
+    .xRowid = _cstats_rowid
+};
+
+int composite_stats_init(sqlite3* db, char** pzErrMsg, const sqlite3_api_routines* pApi) {
+    int rc = sqlite3_create_module(db, "composite_stats", &composite_stats_module, 0);
+    if( rc == SQLITE_OK ) {
+        rc = sqlite3_create_module(db, "composite_files", &composite_stats_module, (void*)1);
+    }
+    return rc;
+}
+
+#endif // SQLITE_OS_OTHER
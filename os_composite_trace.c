@@ -0,0 +1,502 @@
+/* Contains the call probes behind SQLITE_COS_TRACE_BINARY and SQLITE_COS_HISTOGRAMS
+ *
+ * every _cXxx() wrapper reports its calls to cProbeRecord(), which feeds:
+ *
+ * the binary trace: every thread that makes a traced call gets its own ring buffer of fixed-size records,
+ * so recording a call is a timestamp read, a 40-byte store and an increment, with no locks or atomic
+ * read-modify-writes. when a ring fills up, the oldest records are overwritten, and when its thread exits,
+ * the next new thread takes it over. composite_trace_dump() writes every ring to a file, which
+ * tools/ctrace_decode turns into text or CSV.
+ *
+ * the latency histograms: per method (and, for file methods, per file type) counts of how long calls
+ * took, in log-scaled buckets. each thread has its own set of histograms, which are only summed when
+ * they're queried, so counting a call never touches a cache line another thread writes. like a ring, a
+ * thread's histograms are handed on to the next new thread when it exits.
+ */
+
+#if SQLITE_OS_OTHER
+
+#include "os_composite.h"
+
+#if SQLITE_COS_TRACE_BINARY || SQLITE_COS_HISTOGRAMS
+
+#include <stdio.h> /* for fopen(), fwrite() and printf() */
+#include <stdlib.h> /* for calloc() */
+#include <string.h> /* for memcpy() */
+#include <time.h> /* for clock_gettime() */
+#if SQLITE_THREADSAFE
+#include <pthread.h> /* for the thread-exit hooks */
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> /* for __rdtsc() */
+#endif
+
+/* a timestamp and wall-clock reading taken when probing started, to convert ticks to nanoseconds */
+static sqlite3_uint64 _cprobe_start_tsc = 0;
+static sqlite3_uint64 _cprobe_start_ns = 0;
+
+static sqlite3_uint64 _cprobe_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sqlite3_uint64)ts.tv_sec * 1000000000ull + (sqlite3_uint64)ts.tv_nsec;
+}
+
+/* returns the timestamp counter; where there isn't one, nanoseconds stand in for ticks */
+sqlite3_uint64 cProbeNow(void) {
+    #if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+    #else
+        return _cprobe_clock_ns();
+    #endif
+}
+
+/* takes the starting readings, the first time it's called */
+static void _cprobe_calibrate() {
+    sqlite3_uint64 expected = 0;
+    const sqlite3_uint64 now_ns = _cprobe_clock_ns();
+    if( __atomic_compare_exchange_n(&_cprobe_start_tsc, &expected, cProbeNow(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+        _cprobe_start_ns = now_ns;
+    }
+}
+
+/* returns the rate of the timestamp counter, or 0 if it isn't known yet */
+static double _cprobe_ticks_per_ns() {
+    const sqlite3_uint64 start_tsc = __atomic_load_n(&_cprobe_start_tsc, __ATOMIC_RELAXED);
+    const sqlite3_uint64 elapsed_ns = _cprobe_clock_ns() - _cprobe_start_ns;
+    if( start_tsc == 0 || elapsed_ns == 0 ) {
+        return 0;
+    }
+    return (double)(cProbeNow() - start_tsc) / (double)elapsed_ns;
+}
+
+#endif // SQLITE_COS_TRACE_BINARY || SQLITE_COS_HISTOGRAMS
+
+#if SQLITE_COS_TRACE_BINARY
+
+#define CTRACE_RING_RECORDS (1 << 15) /* records per thread; must be a power of two */
+
+struct ctrace_ring {
+    struct ctrace_ring* next; /* every ring that has been created, newest first */
+    int inUse; /* 1 while a thread owns the ring */
+    unsigned short thread;
+    sqlite3_uint64 head; /* the number of records ever written to the ring; only the owning thread writes it */
+    struct ctrace_record records[CTRACE_RING_RECORDS];
+};
+
+static struct ctrace_ring* _ctrace_rings = 0;
+static unsigned short _ctrace_next_thread = 0;
+static __thread struct ctrace_ring* _ctrace_ring = 0;
+static __thread int _ctrace_exited = 0; /* the thread is exiting, and has given up its ring */
+
+#if SQLITE_THREADSAFE
+static pthread_key_t _ctrace_key;
+static pthread_once_t _ctrace_key_once = PTHREAD_ONCE_INIT;
+static int _ctrace_key_ok = 0;
+
+/* runs when a thread that has a ring exits; the ring's records stay in it for the dump, and the next new
+ * thread carries on writing after them
+ */
+static void _ctrace_thread_exit(void* p) {
+    struct ctrace_ring* ring = (struct ctrace_ring*)p;
+    _ctrace_ring = 0;
+    _ctrace_exited = 1;
+    __atomic_store_n(&ring->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void _ctrace_key_create() {
+    _ctrace_key_ok = ( pthread_key_create(&_ctrace_key, _ctrace_thread_exit) == 0 );
+}
+#endif
+
+/* gives the calling thread a ring: one a thread left behind if there is one, or a new one; returns 0 if there's
+ * neither, and then the thread's calls aren't recorded
+ */
+static struct ctrace_ring* _ctrace_ring_attach() {
+    #if SQLITE_THREADSAFE
+        pthread_once(&_ctrace_key_once, _ctrace_key_create);
+        if( !_ctrace_key_ok ) {
+            return 0;
+        }
+    #endif
+
+    struct ctrace_ring* ring;
+    for( ring = __atomic_load_n(&_ctrace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next ) {
+        int unused = 0;
+        if( __atomic_compare_exchange_n(&ring->inUse, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) {
+            break;
+        }
+    }
+
+    if( ring == 0 ) {
+        /* the rings come from the system allocator, so tracing never shows up in our own allocator's numbers */
+        ring = calloc(1, sizeof(struct ctrace_ring));
+        if( ring == 0 ) {
+            return 0;
+        }
+        ring->inUse = 1;
+        _cprobe_calibrate();
+
+        /* rings are never freed, so a thread's records outlive it and still make it into the dump */
+        ring->next = __atomic_load_n(&_ctrace_rings, __ATOMIC_RELAXED);
+        while( !__atomic_compare_exchange_n(&_ctrace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) {}
+    }
+
+    /* every record carries its own thread number, so the ring's older records keep the one they were written with */
+    ring->thread = __atomic_add_fetch(&_ctrace_next_thread, 1, __ATOMIC_RELAXED);
+
+    #if SQLITE_THREADSAFE
+        if( pthread_setspecific(_ctrace_key, ring) != 0 ) {
+            __atomic_store_n(&ring->inUse, 0, __ATOMIC_RELEASE);
+            return 0;
+        }
+    #endif
+    _ctrace_ring = ring;
+    return ring;
+}
+
+static void _ctrace_append(int op, unsigned int file, sqlite3_int64 offset, int len, int result, sqlite3_uint64 start, sqlite3_uint64 end) {
+    struct ctrace_ring* ring = _ctrace_ring;
+    if( ring == 0 ) {
+        if( _ctrace_exited || (ring = _ctrace_ring_attach()) == 0 ) {
+            return;
+        }
+    }
+
+    struct ctrace_record* rec = &ring->records[ ring->head & (CTRACE_RING_RECORDS - 1) ];
+    rec->tsc = start;
+    rec->ticks = end - start;
+    rec->offset = offset;
+    rec->len = len;
+    rec->result = result;
+    rec->file = file;
+    rec->op = (uint16_t)op;
+    rec->thread = ring->thread;
+
+    /* publish the record; a concurrent dump reads head with acquire ordering */
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* records that are written while the dump is running may be missing or torn */
+int composite_trace_dump(const char* zPath) {
+    FILE* f = fopen(zPath, "wb");
+    if( f == 0 ) {
+        return SQLITE_ERROR;
+    }
+
+    struct ctrace_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CTRACE_MAGIC, sizeof(CTRACE_MAGIC));
+    header.version = CTRACE_VERSION;
+    header.record_size = sizeof(struct ctrace_record);
+
+    header.ticks_per_ns = _cprobe_ticks_per_ns();
+
+    /* the header is rewritten once we know how many records there are */
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    struct ctrace_ring* ring = __atomic_load_n(&_ctrace_rings, __ATOMIC_ACQUIRE);
+    for( ; ring && ok; ring = ring->next ) {
+        const sqlite3_uint64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        const sqlite3_uint64 n = (head < CTRACE_RING_RECORDS) ? head : CTRACE_RING_RECORDS;
+        const sqlite3_uint64 first = head - n;
+
+        /* the records [first, head) may wrap around the end of the ring */
+        const sqlite3_uint64 i = first & (CTRACE_RING_RECORDS - 1);
+        const sqlite3_uint64 n1 = (i + n > CTRACE_RING_RECORDS) ? CTRACE_RING_RECORDS - i : n;
+        ok = fwrite(&ring->records[i], sizeof(struct ctrace_record), n1, f) == n1;
+        if( ok && n1 < n ) {
+            ok = fwrite(&ring->records[0], sizeof(struct ctrace_record), n - n1, f) == n - n1;
+        }
+
+        header.nRecords += n;
+        header.nDropped += first;
+    }
+
+    if( ok ) {
+        ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    }
+
+    if( fclose(f) != 0 ) {
+        ok = 0;
+    }
+
+    return ok ? SQLITE_OK : SQLITE_ERROR;
+}
+
+#else
+
+int composite_trace_dump(const char* zPath) {
+    return SQLITE_ERROR;
+}
+
+#endif // SQLITE_COS_TRACE_BINARY
+
+#if SQLITE_COS_HISTOGRAMS
+
+/* a duration of v ticks goes in bucket v if v < CHIST_SUB; otherwise each power of two is split into
+ * CHIST_SUB buckets, so a bucket's upper bound is at most 1/CHIST_SUB above any value in it
+ */
+#define CHIST_SUB_BITS 2
+#define CHIST_SUB (1 << CHIST_SUB_BITS)
+#define CHIST_MAX_POW 34 /* durations of 2^CHIST_MAX_POW ticks or more all go in the last bucket */
+#define CHIST_BUCKETS ( (CHIST_MAX_POW - CHIST_SUB_BITS + 1) * CHIST_SUB )
+
+/* xClose through xOpen act on a file, and get one histogram per file type; every other method gets one */
+#define CHIST_FILE_OPS (CTRACE_OP_OPEN + 1)
+#define CHIST_SLOTS ( CHIST_FILE_OPS * CFILE_TYPE_COUNT + (CTRACE_OP_COUNT - CHIST_FILE_OPS) )
+
+struct chist {
+    sqlite3_uint64 count;
+    sqlite3_uint64 sum; /* ticks */
+    sqlite3_uint64 max; /* ticks */
+    sqlite3_uint64 buckets[CHIST_BUCKETS];
+};
+
+/* one thread's histograms */
+struct chist_block {
+    struct chist_block* next; /* every block that has been created, newest first */
+    int inUse; /* 1 while a thread owns the block */
+    struct chist hists[CHIST_SLOTS];
+};
+
+static struct chist_block* _chist_blocks = 0;
+static __thread struct chist_block* _chist_block = 0;
+static __thread int _chist_exited = 0; /* the thread is exiting, and has given up its block */
+
+#if SQLITE_THREADSAFE
+static pthread_key_t _chist_key;
+static pthread_once_t _chist_key_once = PTHREAD_ONCE_INIT;
+static int _chist_key_ok = 0;
+
+/* runs when a thread that has a block exits; its counts stay in the block, and the next new thread adds to them */
+static void _chist_thread_exit(void* p) {
+    struct chist_block* block = (struct chist_block*)p;
+    _chist_block = 0;
+    _chist_exited = 1;
+    __atomic_store_n(&block->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void _chist_key_create() {
+    _chist_key_ok = ( pthread_key_create(&_chist_key, _chist_thread_exit) == 0 );
+}
+#endif
+
+/* gives the calling thread a block: one a thread left behind if there is one, or a new one; returns 0 if there's
+ * neither, and then the thread's calls aren't counted
+ */
+static struct chist_block* _chist_attach() {
+    #if SQLITE_THREADSAFE
+        pthread_once(&_chist_key_once, _chist_key_create);
+        if( !_chist_key_ok ) {
+            return 0;
+        }
+    #endif
+
+    struct chist_block* block;
+    for( block = __atomic_load_n(&_chist_blocks, __ATOMIC_ACQUIRE); block; block = block->next ) {
+        int unused = 0;
+        if( __atomic_compare_exchange_n(&block->inUse, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) {
+            break;
+        }
+    }
+
+    if( block == 0 ) {
+        /* like the trace rings, blocks come from the system allocator and are never freed */
+        block = calloc(1, sizeof(struct chist_block));
+        if( block == 0 ) {
+            return 0;
+        }
+        block->inUse = 1;
+        _cprobe_calibrate();
+
+        block->next = __atomic_load_n(&_chist_blocks, __ATOMIC_RELAXED);
+        while( !__atomic_compare_exchange_n(&_chist_blocks, &block->next, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) {}
+    }
+
+    #if SQLITE_THREADSAFE
+        if( pthread_setspecific(_chist_key, block) != 0 ) {
+            __atomic_store_n(&block->inUse, 0, __ATOMIC_RELEASE);
+            return 0;
+        }
+    #endif
+    _chist_block = block;
+    return block;
+}
+
+#define CTRACE_OP_NAME(name, str) str,
+static const char* const _chist_op_names[] = {
+    CTRACE_OPS(CTRACE_OP_NAME)
+};
+#undef CTRACE_OP_NAME
+
+static const char* const _chist_type_names[] = {
+    "main-db", "main-journal", "temp-db", "temp-journal", "transient-db", "subjournal", "master-journal", "wal", "other"
+};
+
+static int _chist_slot(int op, int fileType) {
+    if( op < CHIST_FILE_OPS ) {
+        return op * CFILE_TYPE_COUNT + fileType;
+    }
+    return CHIST_FILE_OPS * CFILE_TYPE_COUNT + (op - CHIST_FILE_OPS);
+}
+
+static int _chist_bucket(sqlite3_uint64 ticks) {
+    if( ticks < CHIST_SUB ) {
+        return (int)ticks;
+    }
+
+    const int p = 63 - __builtin_clzll(ticks);
+    if( p >= CHIST_MAX_POW ) {
+        return CHIST_BUCKETS - 1;
+    }
+    return (p - CHIST_SUB_BITS + 1) * CHIST_SUB + (int)( (ticks >> (p - CHIST_SUB_BITS)) & (CHIST_SUB - 1) );
+}
+
+/* the smallest duration, in ticks, that's too long for the bucket */
+static sqlite3_uint64 _chist_bucket_limit(int b) {
+    if( b < CHIST_SUB ) {
+        return b + 1;
+    }
+
+    const int p = b / CHIST_SUB + CHIST_SUB_BITS - 1;
+    const sqlite3_uint64 step = 1ull << (p - CHIST_SUB_BITS);
+    return (1ull << p) + (sqlite3_uint64)(b % CHIST_SUB + 1) * step;
+}
+
+static void _chist_add(int op, int fileType, sqlite3_uint64 ticks) {
+    struct chist_block* block = _chist_block;
+    if( block == 0 ) {
+        if( _chist_exited || (block = _chist_attach()) == 0 ) {
+            return;
+        }
+    }
+
+    struct chist* h = &block->hists[ _chist_slot(op, fileType) ];
+    h->count++;
+    h->sum += ticks;
+    if( ticks > h->max ) h->max = ticks;
+    h->buckets[ _chist_bucket(ticks) ]++;
+}
+
+/* adds every thread's histogram for the slot into *pSum. other threads may be counting calls while we
+ * read their histograms, so a concurrent call may or may not be included.
+ */
+static void _chist_sum(int slot, struct chist* pSum) {
+    struct chist_block* block = __atomic_load_n(&_chist_blocks, __ATOMIC_ACQUIRE);
+    for( ; block; block = block->next ) {
+        const struct chist* h = &block->hists[slot];
+        const sqlite3_uint64 max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+        pSum->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        pSum->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        if( max > pSum->max ) pSum->max = max;
+
+        int b;
+        for( b = 0; b < CHIST_BUCKETS; b++ ) {
+            pSum->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* the upper bound, in ticks, of the bucket that holds the q'th quantile */
+static sqlite3_uint64 _chist_quantile(const struct chist* h, double q) {
+    sqlite3_uint64 total = 0;
+    int b;
+    for( b = 0; b < CHIST_BUCKETS; b++ ) {
+        total += h->buckets[b];
+    }
+
+    const sqlite3_uint64 rank = (sqlite3_uint64)(q * (double)total);
+    sqlite3_uint64 seen = 0;
+    for( b = 0; b < CHIST_BUCKETS; b++ ) {
+        seen += h->buckets[b];
+        if( seen > rank ) {
+            const sqlite3_uint64 limit = _chist_bucket_limit(b);
+            return (limit < h->max) ? limit : h->max; /* no call took longer than max */
+        }
+    }
+    return h->max;
+}
+
+int composite_latency_query(int op, int fileType, struct composite_latency* pOut) {
+    if( op < 0 || op >= CTRACE_OP_COUNT || fileType < -1 || fileType >= CFILE_TYPE_COUNT ) {
+        return SQLITE_RANGE;
+    }
+    if( op >= CHIST_FILE_OPS && fileType != -1 && fileType != CFILE_TYPE_OTHER ) {
+        return SQLITE_RANGE;
+    }
+
+    struct chist sum;
+    memset(&sum, 0, sizeof(sum));
+    if( op < CHIST_FILE_OPS && fileType == -1 ) {
+        int t;
+        for( t = 0; t < CFILE_TYPE_COUNT; t++ ) {
+            _chist_sum(_chist_slot(op, t), &sum);
+        }
+    } else {
+        _chist_sum(_chist_slot(op, fileType == -1 ? CFILE_TYPE_OTHER : fileType), &sum);
+    }
+
+    double ticks_per_ns = _cprobe_ticks_per_ns();
+    if( ticks_per_ns <= 0 ) ticks_per_ns = 1;
+
+    pOut->count = sum.count;
+    pOut->mean_ns = sum.count ? (double)sum.sum / (double)sum.count / ticks_per_ns : 0;
+    pOut->p50_ns = (double)_chist_quantile(&sum, 0.5) / ticks_per_ns;
+    pOut->p99_ns = (double)_chist_quantile(&sum, 0.99) / ticks_per_ns;
+    pOut->p999_ns = (double)_chist_quantile(&sum, 0.999) / ticks_per_ns;
+    pOut->max_ns = (double)sum.max / ticks_per_ns;
+    return SQLITE_OK;
+}
+
+void composite_latency_print(void) {
+    printf("%-24s %-16s %12s %10s %10s %10s %10s %12s\n", "method", "file type", "count", "mean ns", "p50 ns", "p99 ns", "p999 ns", "max ns");
+
+    int op;
+    for( op = 0; op < CTRACE_OP_COUNT; op++ ) {
+        int t;
+        for( t = 0; t < CFILE_TYPE_COUNT; t++ ) {
+            if( op >= CHIST_FILE_OPS && t != CFILE_TYPE_OTHER ) {
+                continue;
+            }
+
+            struct composite_latency lat;
+            composite_latency_query(op, t, &lat);
+            if( lat.count == 0 ) {
+                continue;
+            }
+
+            printf("%-24s %-16s %12llu %10.0f %10.0f %10.0f %10.0f %12.0f\n", _chist_op_names[op], _chist_type_names[t],
+                   (unsigned long long)lat.count, lat.mean_ns, lat.p50_ns, lat.p99_ns, lat.p999_ns, lat.max_ns);
+        }
+    }
+}
+
+#else
+
+int composite_latency_query(int op, int fileType, struct composite_latency* pOut) {
+    return SQLITE_ERROR;
+}
+
+void composite_latency_print(void) {
+}
+
+#endif // SQLITE_COS_HISTOGRAMS
+
+#if SQLITE_COS_TRACE_BINARY || SQLITE_COS_HISTOGRAMS
+
+void cProbeRecord(int op, struct cFile* file, sqlite3_int64 offset, int len, int result, sqlite3_uint64 start) {
+    const sqlite3_uint64 end = cProbeNow();
+
+    #if SQLITE_COS_TRACE_BINARY
+        _ctrace_append(op, file ? file->fileId : 0, offset, len, result, start, end);
+    #endif
+
+    #if SQLITE_COS_HISTOGRAMS
+        _chist_add(op, file ? file->fileType : CFILE_TYPE_OTHER, end - start);
+    #endif
+}
+
+#endif
+
+#endif // SQLITE_OS_OTHER
@@ -0,0 +1,106 @@
+/* The binary trace format written by SQLITE_COS_TRACE_BINARY builds
+ *
+ * this header is shared with the offline decoder (tools/ctrace_decode.c), so it only depends on <stdint.h>.
+ *
+ * a trace file is a struct ctrace_file_header followed by records, grouped by thread. within a thread,
+ * records are in the order the calls completed.
+ */
+#ifndef SQLITE_COS_OS_COMPOSITE_TRACE_H
+#define SQLITE_COS_OS_COMPOSITE_TRACE_H
+
+#include <stdint.h>
+
+#define CTRACE_MAGIC "CTRACE1"
+#define CTRACE_VERSION 1
+
+/* every traced method; X(enum name, method name) */
+#define CTRACE_OPS(X) \
+    X(CLOSE, "xClose") \
+    X(READ, "xRead") \
+    X(WRITE, "xWrite") \
+    X(TRUNCATE, "xTruncate") \
+    X(SYNC, "xSync") \
+    X(FILESIZE, "xFileSize") \
+    X(LOCK, "xLock") \
+    X(UNLOCK, "xUnlock") \
+    X(CHECKRESERVEDLOCK, "xCheckReservedLock") \
+    X(FILECONTROL, "xFileControl") \
+    X(SECTORSIZE, "xSectorSize") \
+    X(DEVICECHARACTERISTICS, "xDeviceCharacteristics") \
+    X(SHMMAP, "xShmMap") \
+    X(SHMLOCK, "xShmLock") \
+    X(SHMBARRIER, "xShmBarrier") \
+    X(SHMUNMAP, "xShmUnmap") \
+    X(FETCH, "xFetch") \
+    X(UNFETCH, "xUnfetch") \
+    X(OPEN, "xOpen") \
+    X(DELETE, "xDelete") \
+    X(ACCESS, "xAccess") \
+    X(FULLPATHNAME, "xFullPathname") \
+    X(RANDOMNESS, "xRandomness") \
+    X(SLEEP, "xSleep") \
+    X(GETLASTERROR, "xGetLastError") \
+    X(CURRENTTIME, "xCurrentTime") \
+    X(CURRENTTIMEINT64, "xCurrentTimeInt64") \
+    X(MUTEXINIT, "xMutexInit") \
+    X(MUTEXEND, "xMutexEnd") \
+    X(MUTEXALLOC, "xMutexAlloc") \
+    X(MUTEXFREE, "xMutexFree") \
+    X(MUTEXENTER, "xMutexEnter") \
+    X(MUTEXTRY, "xMutexTry") \
+    X(MUTEXLEAVE, "xMutexLeave") \
+    X(MUTEXHELD, "xMutexHeld") \
+    X(MUTEXNOTHELD, "xMutexNotheld") \
+    X(MALLOC, "xMalloc") \
+    X(FREE, "xFree") \
+    X(REALLOC, "xRealloc") \
+    X(SIZE, "xSize") \
+    X(ROUNDUP, "xRoundup") \
+    X(MEMINIT, "xMemInit") \
+    X(MEMSHUTDOWN, "xMemShutdown") \
+    X(PCACHEINIT, "xPcacheInit") \
+    X(PCACHESHUTDOWN, "xPcacheShutdown") \
+    X(PCACHECREATE, "xPcacheCreate") \
+    X(PCACHECACHESIZE, "xPcacheCachesize") \
+    X(PCACHEPAGECOUNT, "xPcachePagecount") \
+    X(PCACHEFETCH, "xPcacheFetch") \
+    X(PCACHEUNPIN, "xPcacheUnpin") \
+    X(PCACHEREKEY, "xPcacheRekey") \
+    X(PCACHETRUNCATE, "xPcacheTruncate") \
+    X(PCACHEDESTROY, "xPcacheDestroy") \
+    X(PCACHESHRINK, "xPcacheShrink")
+
+#define CTRACE_OP_ENUM(name, str) CTRACE_OP_##name,
+enum ctrace_op {
+    CTRACE_OPS(CTRACE_OP_ENUM)
+    CTRACE_OP_COUNT
+};
+#undef CTRACE_OP_ENUM
+
+/* one traced call. what offset and len hold depends on the method:
+ *   file methods: the file offset and byte count (xLock/xUnlock: len is the lock type; xFileControl: len is the op)
+ *   mutex methods: offset is the mutex's address (xMutexAlloc: len is the mutex type)
+ *   memory methods: offset is the allocation's address and len its requested size
+ *   pcache methods: offset is the cache's address and len the page number, where there is one
+ */
+struct ctrace_record {
+    uint64_t tsc; /* the timestamp counter when the call started */
+    uint64_t ticks; /* how long the call took, in timestamp counter ticks */
+    int64_t offset;
+    int32_t len;
+    int32_t result; /* the method's return code; 0 for methods that return void */
+    uint32_t file; /* the id of the file the call was made on, or 0 */
+    uint16_t op; /* one of CTRACE_OP_* */
+    uint16_t thread; /* a small per-process thread number, starting at 1 */
+};
+
+struct ctrace_file_header {
+    char magic[8]; /* CTRACE_MAGIC, nul-terminated */
+    uint32_t version; /* CTRACE_VERSION */
+    uint32_t record_size; /* sizeof(struct ctrace_record) */
+    double ticks_per_ns; /* measured when the trace was written; 0 if unknown */
+    uint64_t nRecords; /* the number of records that follow */
+    uint64_t nDropped; /* records that were overwritten before the trace was written */
+};
+
+#endif
@@ -3,9 +3,19 @@
 
 #include "os_composite.h"
 
+#include <time.h> /* for nanosleep() */
+
 /* sqlite3_io_methods */
 int cClose(sqlite3_file* baseFile) {
     struct cFile* file = (struct cFile*)baseFile;
+
+    if( file->shmMapped ) {
+        cShmUnmap(baseFile, 0);
+    }
+
+    if( file->eLock != SQLITE_LOCK_NONE ) {
+        cUnlock(baseFile, SQLITE_LOCK_NONE);
+    }
     
     fs_close((struct fs_file*)file->fd);
     file->fd = 0;
@@ -27,10 +37,7 @@ int cRead(sqlite3_file* baseFile, void* buf, int iAmt, sqlite3_int64 iOfst) {
 
     if( bytesRead < iAmt ) {
         /* if we do a short read, we have to fill the rest of the buffer with 0's */
-        char* data = buf;
-        int i;
-        for( i = bytesRead; i < iAmt; i++ )
-            data[i] = 0;
+        cZero( (char*)buf + bytesRead, (size_t)(iAmt - bytesRead) );
 
         return SQLITE_IOERR_SHORT_READ;
     }
@@ -77,17 +84,73 @@ int cFileSize(sqlite3_file* baseFile, sqlite3_int64 *pSize) {
 
 /* increases the lock on a file
  * @param lockType one of SQLITE_LOCK_*
+ *
+ * any number of connections may hold SHARED locks. a single connection may hold RESERVED alongside them.
+ * a connection asking for EXCLUSIVE while others still hold SHARED is left holding PENDING, which keeps
+ * new SHARED locks out, and gets SQLITE_BUSY until the readers drain.
  */
 int cLock(sqlite3_file* baseFile, int lockType) {
     struct cFile* file = (struct cFile*)baseFile;
-    return SQLITE_OK;
+    struct fs_file* fd = (struct fs_file*)file->fd;
+    int rc = SQLITE_OK;
+
+    /* we already hold a lock at least this strong; this doesn't need the mutex */
+    if( file->eLock >= lockType ) {
+        return SQLITE_OK;
+    }
+
+    CVFS_MUTEX_ENTER(fd->cVfs);
+    if( file->eLock != fd->eLock && (fd->eLock >= SQLITE_LOCK_PENDING || lockType > SQLITE_LOCK_SHARED) ) {
+        /* another connection holds the strongest lock on the file, and it conflicts with ours */
+        rc = SQLITE_BUSY;
+    } else if( lockType == SQLITE_LOCK_SHARED ) {
+        /* the file is unlocked, or only other readers and a RESERVED writer hold it */
+        if( fd->eLock == SQLITE_LOCK_NONE ) {
+            fd->eLock = SQLITE_LOCK_SHARED;
+        }
+        fd->nShared++;
+        file->eLock = SQLITE_LOCK_SHARED;
+    } else if( lockType == SQLITE_LOCK_EXCLUSIVE && fd->nShared > 1 ) {
+        /* other readers are still active; hold PENDING so that no new ones can start */
+        fd->eLock = SQLITE_LOCK_PENDING;
+        file->eLock = SQLITE_LOCK_PENDING;
+        rc = SQLITE_BUSY;
+    } else {
+        fd->eLock = lockType;
+        file->eLock = lockType;
+    }
+    CVFS_MUTEX_LEAVE(fd->cVfs);
+
+    return rc;
 }
 
 /* decreases the lock on a file
- * @param lockType one of SQLITE_LOCK_*
+ * @param lockType SQLITE_LOCK_SHARED or SQLITE_LOCK_NONE
  */
 int cUnlock(sqlite3_file* baseFile, int lockType) {
     struct cFile* file = (struct cFile*)baseFile;
+    struct fs_file* fd = (struct fs_file*)file->fd;
+
+    if( file->eLock <= lockType ) {
+        return SQLITE_OK;
+    }
+
+    CVFS_MUTEX_ENTER(fd->cVfs);
+    if( file->eLock > SQLITE_LOCK_SHARED ) {
+        /* we were the connection holding the strongest lock; only readers remain */
+        fd->eLock = SQLITE_LOCK_SHARED;
+    }
+
+    if( lockType == SQLITE_LOCK_NONE ) {
+        fd->nShared--;
+        if( fd->nShared == 0 ) {
+            fd->eLock = SQLITE_LOCK_NONE;
+        }
+    }
+
+    file->eLock = lockType;
+    CVFS_MUTEX_LEAVE(fd->cVfs);
+
     return SQLITE_OK;
 }
 
@@ -95,7 +158,9 @@ int cUnlock(sqlite3_file* baseFile, int lockType) {
  */
 int cCheckReservedLock(sqlite3_file* baseFile, int *pResOut) {
     struct cFile* file = (struct cFile*)baseFile;
-    if( pResOut ) *pResOut = 0;
+    struct fs_file* fd = (struct fs_file*)file->fd;
+
+    if( pResOut ) *pResOut = (fd->eLock > SQLITE_LOCK_SHARED);
     return SQLITE_OK;
 }
 
@@ -117,6 +182,21 @@ int cFileControl(sqlite3_file* baseFile, int op, void *pArg) {
                  fs_size_hint(fd, (sqlite3_int64)size_hint);
              }
              return SQLITE_OK;
+        case SQLITE_FCNTL_MMAP_SIZE: {
+            /* "The argument is a pointer to a value of type sqlite3_int64 that is an advisory maximum number
+             * of bytes in the file to memory map...If the value is negative, the current limit is returned
+             * without changing it."
+             */
+            sqlite3_int64 newLimit = *((sqlite3_int64*)pArg);
+            *((sqlite3_int64*)pArg) = file->mmapSize;
+            if( newLimit >= 0 && file->nFetchOut == 0 ) {
+                file->mmapSize = newLimit;
+            }
+            return SQLITE_OK;
+        }
+        case COMPOSITE_FCNTL_CLONE:
+            fd = (struct fs_file*)file->fd;
+            return fs_clone(fd->cVfs, fd->zName, (const char*)pArg);
         default:
             return SQLITE_NOTFOUND;
     }
@@ -146,30 +226,198 @@ int cDeviceCharacteristics(sqlite3_file* baseFile) {
     return flags;
 }
 
-int cShmMap(sqlite3_file* baseFile, int iPg, int pgsz, int i, void volatile** v) {
-    return SQLITE_IOERR;
+/* maps region iPg of the database's wal-index into *v
+ * @param pgsz the size of each region
+ * @param bExtend if 0 and the region doesn't exist yet, *v is set to 0 instead of allocating it
+ */
+int cShmMap(sqlite3_file* baseFile, int iPg, int pgsz, int bExtend, void volatile** v) {
+    struct cFile* file = (struct cFile*)baseFile;
+    struct fs_file* fd = (struct fs_file*)file->fd;
+    int rc = SQLITE_OK;
+
+    CVFS_MUTEX_ENTER(fd->cVfs);
+    if( fs_shm_map(fd, iPg, pgsz, bExtend, v) == 0 ) {
+        rc = SQLITE_IOERR_NOMEM;
+    } else if( !file->shmMapped ) {
+        fd->shm->nRef++;
+        file->shmMapped = 1;
+    }
+    CVFS_MUTEX_LEAVE(fd->cVfs);
+
+    return rc;
 }
 
+/* acquires or releases the wal-index locks on slots [offset, offset+n)
+ * @param flags SQLITE_SHM_LOCK or SQLITE_SHM_UNLOCK, combined with SQLITE_SHM_SHARED or SQLITE_SHM_EXCLUSIVE
+ *
+ * any number of connections can hold a slot SHARED, or one connection can hold it EXCLUSIVE.
+ * if the lock can't be granted immediately, SQLITE_BUSY is returned and nothing changes.
+ */
 int cShmLock(sqlite3_file* baseFile, int offset, int n, int flags) {
-    return SQLITE_OK;
+    struct cFile* file = (struct cFile*)baseFile;
+    struct fs_file* fd = (struct fs_file*)file->fd;
+    struct fs_shm* shm = fd->shm;
+    const unsigned short mask = (unsigned short)( ((1 << (offset+n)) - 1) & ~((1 << offset) - 1) );
+    int rc = SQLITE_OK;
+    int i;
+
+    if( shm == 0 || !file->shmMapped ) {
+        return SQLITE_IOERR_SHMLOCK;
+    }
+
+    CVFS_MUTEX_ENTER(fd->cVfs);
+    if( flags & SQLITE_SHM_UNLOCK ) {
+        for( i = offset; i < offset+n; i++ ) {
+            if( file->shmSharedMask & (1 << i) ) shm->nShared[i]--;
+            if( file->shmExclMask & (1 << i) ) shm->exclusive[i] = 0;
+        }
+        file->shmSharedMask &= ~mask;
+        file->shmExclMask &= ~mask;
+    } else if( flags & SQLITE_SHM_SHARED ) {
+        /* SQLite only ever asks for one shared slot at a time */
+        if( (file->shmSharedMask & mask) == 0 ) {
+            if( shm->exclusive[offset] ) {
+                rc = SQLITE_BUSY;
+            } else {
+                shm->nShared[offset]++;
+                file->shmSharedMask |= mask;
+            }
+        }
+    } else {
+        /* make sure no other connection holds any of the slots before taking them */
+        for( i = offset; i < offset+n && rc == SQLITE_OK; i++ ) {
+            if( file->shmExclMask & (1 << i) ) continue;
+            if( shm->exclusive[i] || shm->nShared[i] > ((file->shmSharedMask >> i) & 1) ) {
+                rc = SQLITE_BUSY;
+            }
+        }
+
+        if( rc == SQLITE_OK ) {
+            for( i = offset; i < offset+n; i++ ) {
+                shm->exclusive[i] = 1;
+            }
+            file->shmExclMask |= mask;
+        }
+    }
+    CVFS_MUTEX_LEAVE(fd->cVfs);
+
+    return rc;
 }
 
+/* "The xShmBarrier method ... is a memory barrier" between connections sharing the wal-index */
 void cShmBarrier(sqlite3_file* baseFile) {
+    struct fs_file* fd = (struct fs_file*)((struct cFile*)baseFile)->fd;
+    __sync_synchronize();
+    CVFS_MUTEX_ENTER(fd->cVfs);
+    CVFS_MUTEX_LEAVE(fd->cVfs);
 }
 
+/* releases this connection's mapping of the wal-index
+ * the wal-index only lives in memory, so deleteFlag makes no difference: it is freed once no connection has it mapped
+ */
 int cShmUnmap(sqlite3_file* baseFile, int deleteFlag) {
-    return SQLITE_IOERR;
+    struct cFile* file = (struct cFile*)baseFile;
+    struct fs_file* fd = (struct fs_file*)file->fd;
+
+    if( !file->shmMapped ) {
+        return SQLITE_OK;
+    }
+
+    CVFS_MUTEX_ENTER(fd->cVfs);
+    if( file->shmSharedMask | file->shmExclMask ) {
+        /* the connection shouldn't hold any locks at this point; drop them anyway */
+        CVFS_MUTEX_LEAVE(fd->cVfs);
+        cShmLock(baseFile, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE);
+        CVFS_MUTEX_ENTER(fd->cVfs);
+    }
+    fs_shm_unmap(fd);
+    file->shmMapped = 0;
+    CVFS_MUTEX_LEAVE(fd->cVfs);
+
+    return SQLITE_OK;
 }
 
+/* "The xFetch() method ... returns a pointer to iAmt bytes of the file starting at iOfst"
+ * the in-memory FS already holds the file in our address space, so we hand out a pointer into its pages.
+ * if the request can't be satisfied, *pp is set to 0 and SQLite falls back to xRead().
+ */
 int cFetch(sqlite3_file* baseFile, sqlite3_int64 iOfst, int iAmt, void **pp) {
-    return SQLITE_IOERR;
+    struct cFile* file = (struct cFile*)baseFile;
+    struct fs_file* fd = (struct fs_file*)file->fd;
+
+    *pp = 0;
+    if( iOfst + iAmt > file->mmapSize ) {
+        return SQLITE_OK; /* beyond the limit set with PRAGMA mmap_size */
+    }
+
+    *pp = fs_fetch(fd, iOfst, iAmt);
+    if( *pp ) {
+        file->nFetchOut++;
+    }
+
+    return SQLITE_OK;
 }
 
+/* releases a pointer obtained from xFetch()
+ * if p is 0, SQLite is asking us to drop any mappings; our pointers never go stale, so there is nothing to do
+ */
 int cUnfetch(sqlite3_file* baseFile, sqlite3_int64 iOfst, void *p) {
-    return SQLITE_IOERR;
+    struct cFile* file = (struct cFile*)baseFile;
+    struct fs_file* fd = (struct fs_file*)file->fd;
+
+    if( p ) {
+        fs_unfetch(fd, iOfst);
+        file->nFetchOut--;
+    }
+
+    return SQLITE_OK;
 }
 
 /** sqlite3_vfs methods */
+#define TEMP_NAME_PREFIX "etilqs_"
+#define TEMP_NAME_LEN (sizeof(TEMP_NAME_PREFIX) - 1 + 16) /* the prefix followed by 16 hex digits */
+
+/* creates a temporary file under a name that isn't in use, which is left in zBuf (which must hold TEMP_NAME_LEN+1
+ * bytes). the name is claimed by fs_open() itself, so two connections can't both pick it. returns 0 if out of memory
+ */
+static struct fs_file* _cTempOpen(sqlite3_vfs* vfs, char* zBuf, int pool) {
+    static const char hex[] = "0123456789abcdef";
+    const int prefixLen = sizeof(TEMP_NAME_PREFIX) - 1;
+    struct fs_file* fd;
+    int i;
+
+    for( i = 0; i < prefixLen; i++ ) {
+        zBuf[i] = TEMP_NAME_PREFIX[i];
+    }
+
+    do {
+        unsigned char rand[8];
+        cRandomness(vfs, sizeof(rand), (char*)rand);
+        for( i = 0; i < 8; i++ ) {
+            zBuf[prefixLen + i*2] = hex[ rand[i] >> 4 ];
+            zBuf[prefixLen + i*2 + 1] = hex[ rand[i] & 0xf ];
+        }
+        zBuf[TEMP_NAME_LEN] = 0;
+        fd = fs_open(vfs, zBuf, pool, 1);
+    } while( fd == FS_OPEN_EXISTS );
+
+    return fd;
+}
+
+
+/* maps the SQLITE_OPEN_* type flag xOpen() was given to one of CFILE_TYPE_* */
+static int _cFileType(int flags) {
+    if( flags & SQLITE_OPEN_MAIN_DB ) return CFILE_TYPE_MAIN_DB;
+    if( flags & SQLITE_OPEN_MAIN_JOURNAL ) return CFILE_TYPE_MAIN_JOURNAL;
+    if( flags & SQLITE_OPEN_TEMP_DB ) return CFILE_TYPE_TEMP_DB;
+    if( flags & SQLITE_OPEN_TEMP_JOURNAL ) return CFILE_TYPE_TEMP_JOURNAL;
+    if( flags & SQLITE_OPEN_TRANSIENT_DB ) return CFILE_TYPE_TRANSIENT_DB;
+    if( flags & SQLITE_OPEN_SUBJOURNAL ) return CFILE_TYPE_SUBJOURNAL;
+    if( flags & SQLITE_OPEN_MASTER_JOURNAL ) return CFILE_TYPE_MASTER_JOURNAL;
+    if( flags & SQLITE_OPEN_WAL ) return CFILE_TYPE_WAL;
+    return CFILE_TYPE_OTHER;
+}
+
 /* opens a file
  * @param vfs
  * @param zName the name of the file to open
@@ -183,31 +431,61 @@ int cOpen(sqlite3_vfs* vfs, const char *zName, sqlite3_file* baseFile, int flags
 
     if( pOutFlags ) *pOutFlags = flags;
 
-    /* does the file exist? */
-    int fileExists = 0;
-    cAccess(vfs, zName, SQLITE_ACCESS_EXISTS, &fileExists);
+    /* main databases and their WAL files are the data to keep; journals and temporary files get a pool of their own */
+    const int pool = (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_WAL)) || _cFileType(flags) == CFILE_TYPE_OTHER
+        ? COMPOSITE_FS_POOL_MAIN : COMPOSITE_FS_POOL_TEMP;
 
-    if( (flags & SQLITE_OPEN_CREATE) && (flags & SQLITE_OPEN_EXCLUSIVE) ) {
-        /* These two flags mean "that file should always be created, and that it is an error if it already exists."
+    /* "If the zFilename parameter to xOpen is a NULL pointer then xOpen must invent its own temporary name for the file." */
+    char zTempName[TEMP_NAME_LEN + 1];
+    struct fs_file* fd;
+    if( zName == 0 ) {
+        fd = _cTempOpen(vfs, zTempName, pool);
+        zName = zTempName;
+    } else {
+        /* URI parameters are only passed along with the main database's name */
+        const char* zSource = (flags & SQLITE_OPEN_MAIN_DB) && (flags & SQLITE_OPEN_URI) ? sqlite3_uri_parameter(zName, "source") : 0;
+        int fileExists = 0;
+        if( zSource && cAccess(vfs, zName, SQLITE_ACCESS_EXISTS, &fileExists) == SQLITE_OK && !fileExists ) {
+            /* another connection may have adopted it since we looked; then we open theirs */
+            const int rc = fs_adopt_file((struct composite_vfs_data*)vfs->pAppData, zName, zSource, 0);
+            if( rc != SQLITE_OK && rc != FS_ADOPT_EXISTS ) {
+                return rc;
+            }
+        }
+
+        /* CREATE and EXCLUSIVE mean "that file should always be created, and that it is an error if it already exists."
          * They are always used together.
          */
-         if( fileExists ) {
-             return SQLITE_IOERR; //the file already exists -- error!
-         }
+        fd = fs_open(vfs, zName, pool, (flags & SQLITE_OPEN_CREATE) && (flags & SQLITE_OPEN_EXCLUSIVE));
+        if( fd == FS_OPEN_EXISTS ) {
+            return SQLITE_IOERR; //the file already exists -- error!
+        }
     }
-
-    void* fd = fs_open(vfs, zName);
     if( fd == 0 ) {
         return SQLITE_IOERR;
     }
     
     file->composite_io_methods = &composite_io_methods;
-    file->zName = zName;
+    file->zName = fd->zName; /* zName may be our temporary name, which goes out of scope */
     file->fd = fd;
+    file->fileId = fd->id;
+    file->fileType = _cFileType(flags);
+    file->mmapSize = 0;
+    file->nFetchOut = 0;
+    file->eLock = SQLITE_LOCK_NONE;
+    file->shmMapped = 0;
+    file->shmSharedMask = 0;
+    file->shmExclMask = 0;
     if( flags & SQLITE_OPEN_DELETEONCLOSE ) {
         fs_delete(vfs, zName); /* the file will be deleted when it's reference count hits 0 */
     }
 
+    if( (flags & SQLITE_OPEN_MAIN_DB) && (flags & SQLITE_OPEN_URI) && sqlite3_uri_parameter(zName, "compress") ) {
+        const int bCompress = sqlite3_uri_boolean(zName, "compress", 0);
+        const sqlite3_int64 nCache = sqlite3_uri_int64(zName, "compress_cache", FS_COMPRESS_DEFAULT_CACHE);
+        fs_set_compression(fd, bCompress ? (int)(nCache > 0x7fffffff ? 0x7fffffff : nCache) : 0);
+    }
+
     return SQLITE_OK;
 }
 
@@ -247,13 +525,20 @@ int cFullPathname(sqlite3_vfs* vfs, const char *zName, int nOut, char *zOut) {
     return SQLITE_OK;
 }
 
-/* xorshift* */
+/* xorshift*. the state is shared by every connection of the instance, so it's advanced with a compare-and-swap:
+ * two threads never get the same value
+ */
 static sqlite3_uint64 get_random(sqlite3_uint64 *state) {
     const sqlite3_uint64 magic = 2685821657736338717L;
-    *state ^= *state >> 12;
-    *state ^= *state << 25;
-    *state ^= *state >> 17;
-    return (*state) * magic;
+    sqlite3_uint64 old = __atomic_load_n(state, __ATOMIC_RELAXED);
+    sqlite3_uint64 x;
+    do {
+        x = old;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 17;
+    } while( !__atomic_compare_exchange_n(state, &old, x, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+    return x * magic;
 }
 
 /* attempts to return nByte bytes of randomness.
@@ -284,11 +569,15 @@ int cRandomness(sqlite3_vfs* vfs, int nByte, char *zOut) {
     return nByte;
 }
 
-/* sleep for at least the given number of microseconds
+/* sleeps for the given number of microseconds, and returns the number of microseconds slept.
+ * SQLite's busy handler relies on this to wait for another connection to release its lock.
  */
 int cSleep(sqlite3_vfs* vfs, int microseconds) {
-    //TODO
-    return SQLITE_OK;
+    struct timespec ts;
+    ts.tv_sec = microseconds / 1000000;
+    ts.tv_nsec = (microseconds % 1000000) * 1000;
+    nanosleep(&ts, 0);
+    return microseconds;
 }
 
 int cGetLastError(sqlite3_vfs* vfs, int i, char *ch) {
@@ -307,11 +596,111 @@ int cCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* time) {
     //TODO
 }
 
-void cVfsInit() {
-    fs_init();
+/* the image to restore on initialization; empty for none */
+static char _cVfs_image_path[MAX_PATHNAME+1] = { 0 };
+static int _cVfs_initialized = 0;
+
+int composite_fs_set_image(const char* zPath) {
+    if( _cVfs_initialized ) {
+        return SQLITE_MISUSE; /* the image is only read by cVfsInit() */
+    }
+    if( zPath == 0 ) {
+        _cVfs_image_path[0] = 0;
+        return SQLITE_OK;
+    }
+
+    int i;
+    for( i = 0; zPath[i] != 0; i++ ) {
+        if( i == MAX_PATHNAME ) {
+            return SQLITE_MISUSE;
+        }
+    }
+
+    for( i = 0; zPath[i] != 0; i++ ) {
+        _cVfs_image_path[i] = zPath[i];
+    }
+    _cVfs_image_path[i] = 0;
+    return SQLITE_OK;
+}
+
+/* the memory budget to apply at initialization; see composite_fs_set_budget() */
+static sqlite3_int64 _cVfs_budget = 0;
+static char _cVfs_spill_path[MAX_PATHNAME+1] = { 0 };
+
+int composite_fs_set_budget(sqlite3_int64 nBytes, const char* zSpillPath) {
+    if( zSpillPath ) {
+        int i;
+        for( i = 0; zSpillPath[i] != 0; i++ ) {
+            if( i == MAX_PATHNAME ) {
+                return SQLITE_MISUSE;
+            }
+        }
+
+        for( i = 0; zSpillPath[i] != 0; i++ ) {
+            _cVfs_spill_path[i] = zSpillPath[i];
+        }
+        _cVfs_spill_path[i] = 0;
+    }
+    _cVfs_budget = nBytes;
+
+    /* before initialization, the FS_SPILL mutex can't be allocated yet */
+    return _cVfs_initialized ? fs_set_budget(nBytes, zSpillPath) : SQLITE_OK;
+}
+
+int composite_fs_set_pool_budget(int pool, sqlite3_int64 nBytes) {
+    if( pool < 0 || pool >= COMPOSITE_FS_POOL_COUNT ) {
+        return SQLITE_RANGE;
+    }
+    cPoolSetBudget(pool, nBytes);
+    return SQLITE_OK;
+}
+
+int composite_fs_clone(const char* zSrc, const char* zDst) {
+    return fs_clone(&composite_vfs_app_data, zSrc, zDst);
+}
+
+int composite_fs_adopt(const char* zName, const void* pData, sqlite3_int64 nData, void (*xFree)(void*)) {
+    if( !_cVfs_initialized ) {
+        return SQLITE_MISUSE;
+    }
+    return fs_adopt(&composite_vfs_app_data, zName, pData, nData, xFree, (void*)pData, 1);
+}
+
+int composite_fs_export(const char* zName, struct composite_fs_view* pView) {
+    if( !_cVfs_initialized ) {
+        return SQLITE_MISUSE;
+    }
+    return fs_export(&composite_vfs_app_data, zName, pView);
+}
+
+void composite_fs_export_release(struct composite_fs_view* pView) {
+    fs_export_release(pView);
+}
+
+sqlite3_int64 composite_fs_shrink(void) {
+    return fs_shrink();
+}
+
+int composite_fs_snapshot(const char* zPath) {
+    return fs_snapshot(&composite_vfs_app_data, zPath);
+}
+
+int cVfsInit() {
+    int rc = fs_init();
+    if( rc == SQLITE_OK && _cVfs_image_path[0] != 0 ) {
+        rc = fs_restore(&composite_vfs_app_data, _cVfs_image_path);
+    }
+
+    if( rc == SQLITE_OK && _cVfs_spill_path[0] != 0 ) {
+        rc = fs_set_budget(_cVfs_budget, _cVfs_spill_path);
+    }
+
+    _cVfs_initialized = (rc == SQLITE_OK);
+    return rc;
 }
 
 void cVfsDeinit() {
+    _cVfs_initialized = 0;
     fs_deinit();
 }
 
@@ -1,4 +1,5 @@
 #include "sqlite3.h"
+#include "os_composite.h"
 
 #include <stdio.h>
 
@@ -98,6 +99,7 @@ int run_example_statements(sqlite3 *db) {
 }
 
 int main(void) {
+  composite_os_config();
   sqlite3_initialize();
 
   sqlite3* db;
@@ -0,0 +1,109 @@
+/* Decodes a binary trace written by a SQLITE_COS_TRACE_BINARY build into text or CSV
+ *
+ * usage: ctrace_decode [-csv] composite.trace
+ *
+ * records from every thread are merged into start-time order. times are relative to the first record,
+ * in nanoseconds when the trace knows its timestamp counter's rate, and in raw ticks otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "../os_composite_trace.h"
+
+#define CTRACE_OP_NAME(name, str) str,
+static const char* const op_names[] = {
+    CTRACE_OPS(CTRACE_OP_NAME)
+};
+#undef CTRACE_OP_NAME
+
+static int compare_records(const void* a, const void* b) {
+    const struct ctrace_record* r1 = (const struct ctrace_record*)a;
+    const struct ctrace_record* r2 = (const struct ctrace_record*)b;
+    if( r1->tsc < r2->tsc ) return -1;
+    if( r1->tsc > r2->tsc ) return 1;
+    return 0;
+}
+
+static const char* op_name(unsigned int op) {
+    return (op < CTRACE_OP_COUNT) ? op_names[op] : "?";
+}
+
+int main(int argc, char** argv) {
+    int csv = 0;
+    const char* path = 0;
+
+    int i;
+    for( i = 1; i < argc; i++ ) {
+        if( strcmp(argv[i], "-csv") == 0 ) {
+            csv = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if( path == 0 ) {
+        fprintf(stderr, "usage: %s [-csv] trace-file\n", argv[0]);
+        return 1;
+    }
+
+    FILE* f = fopen(path, "rb");
+    if( f == 0 ) {
+        perror(path);
+        return 1;
+    }
+
+    struct ctrace_file_header header;
+    if( fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CTRACE_MAGIC, sizeof(CTRACE_MAGIC)) != 0 ) {
+        fprintf(stderr, "%s: not a composite trace\n", path);
+        return 1;
+    }
+
+    if( header.version != CTRACE_VERSION || header.record_size != sizeof(struct ctrace_record) ) {
+        fprintf(stderr, "%s: unsupported trace version %u (record size %u)\n", path, header.version, header.record_size);
+        return 1;
+    }
+
+    struct ctrace_record* records = malloc( (header.nRecords ? header.nRecords : 1) * sizeof(struct ctrace_record) );
+    if( records == 0 ) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    const uint64_t n = fread(records, sizeof(struct ctrace_record), header.nRecords, f);
+    fclose(f);
+    if( n != header.nRecords ) {
+        fprintf(stderr, "%s: truncated trace (%" PRIu64 " of %" PRIu64 " records)\n", path, n, header.nRecords);
+    }
+
+    qsort(records, n, sizeof(struct ctrace_record), compare_records);
+
+    const double scale = (header.ticks_per_ns > 0) ? 1.0 / header.ticks_per_ns : 1.0;
+    const char* unit = (header.ticks_per_ns > 0) ? "ns" : "ticks";
+    const uint64_t t0 = n ? records[0].tsc : 0;
+
+    if( csv ) {
+        printf("time_%s,duration_%s,thread,op,file,offset,len,result\n", unit, unit);
+    } else {
+        printf("# %" PRIu64 " records, %" PRIu64 " dropped, %.3f ticks/ns\n", n, header.nDropped, header.ticks_per_ns);
+    }
+
+    uint64_t j;
+    for( j = 0; j < n; j++ ) {
+        const struct ctrace_record* r = &records[j];
+        const double t = (double)(r->tsc - t0) * scale;
+        const double d = (double)r->ticks * scale;
+
+        if( csv ) {
+            printf("%.0f,%.0f,%u,%s,%u,%" PRId64 ",%d,%d\n", t, d, r->thread, op_name(r->op), r->file, r->offset, r->len, r->result);
+        } else {
+            printf("%14.0f %10.0f%s  t%-3u %-22s file=%-4u offset=%-12" PRId64 " len=%-8d => %d\n",
+                   t, d, unit, r->thread, op_name(r->op), r->file, r->offset, r->len, r->result);
+        }
+    }
+
+    free(records);
+    return 0;
+}
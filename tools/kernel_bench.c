@@ -0,0 +1,168 @@
+/* Measures the copy and zero kernels behind cCopy() and cZero(), in GB/s, for each kernel set the CPU supports
+ *
+ * usage: kernel_bench [-csv] [megabytes]
+ *
+ * every size is moved until the total reaches the given number of megabytes (1024 by default), between buffers that
+ * are reused, so sizes that fit in the cache are measured from the cache. memcpy() and memset() are measured as well,
+ * for comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../os_composite_kernels.h"
+
+static const size_t sizes[] = {
+    64, 512, 4096, 8192, 16384, 32768, 65536, 262144, 1048576, 4194304, 16777216
+};
+#define NSIZES ( sizeof(sizes) / sizeof(sizes[0]) )
+
+#define NKERNELS ( CKERNEL_COUNT + 1 ) /* the kernel sets, then libc */
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static const char* kernel_name(int k) {
+    return (k == CKERNEL_COUNT) ? "libc" : cKernelName(k);
+}
+
+/* returns the rate of kernel k copying (or zeroing) n bytes at a time, in GB/s */
+static double measure(int k, int zero, char* dst, const char* src, size_t n, double total) {
+    long reps = (long)(total / n);
+    if( reps < 1 ) reps = 1;
+
+    const double start = now_seconds();
+    long i;
+    for( i = 0; i < reps; i++ ) {
+        if( k == CKERNEL_COUNT ) {
+            if( zero ) memset(dst, 0, n); else memcpy(dst, src, n);
+        } else {
+            if( zero ) cZero(dst, n); else cCopy(dst, src, n);
+        }
+        __asm__ __volatile__("" : : "r"(dst) : "memory"); /* keep the compiler from dropping repeated copies */
+    }
+    const double elapsed = now_seconds() - start;
+
+    return (double)reps * n / elapsed / 1e9;
+}
+
+/* checks that kernel set k, which must be selected, copies and zeroes exactly n bytes at dst + dOff, from src + sOff;
+ * returns 1 if it does
+ */
+static int check(int k, char* dst, const char* src, size_t n, size_t dOff, size_t sOff) {
+    memset(dst, 1, dOff + n + 8);
+    cCopy(dst + dOff, src + sOff, n);
+    if( (n && memcmp(dst + dOff, src + sOff, n) != 0) || dst[dOff + n] != 1 || (dOff && dst[dOff - 1] != 1) ) {
+        fprintf(stderr, "%s: cCopy(%zu) to offset %zu from offset %zu is wrong\n", cKernelName(k), n, dOff, sOff);
+        return 0;
+    }
+
+    cZero(dst + dOff, n);
+    size_t i;
+    for( i = 0; i < n; i++ ) {
+        if( dst[dOff + i] != 0 ) break;
+    }
+    if( i < n || dst[dOff + n] != 1 || (dOff && dst[dOff - 1] != 1) ) {
+        fprintf(stderr, "%s: cZero(%zu) at offset %zu is wrong\n", cKernelName(k), n, dOff);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    int csv = 0;
+    double total = 1024.0 * 1024 * 1024;
+
+    int i;
+    for( i = 1; i < argc; i++ ) {
+        if( strcmp(argv[i], "-csv") == 0 ) {
+            csv = 1;
+        } else if( atof(argv[i]) > 0 ) {
+            total = atof(argv[i]) * 1024 * 1024;
+        } else {
+            fprintf(stderr, "usage: %s [-csv] [megabytes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const size_t maxSize = sizes[NSIZES - 1];
+    char* src = malloc(maxSize + 64);
+    char* dst = malloc(maxSize + 64);
+    if( src == 0 || dst == 0 ) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    /* a pattern that doesn't repeat every vector, so that a copy from the wrong offset shows */
+    for( i = 0; i < (int)(maxSize + 64); i++ ) {
+        src[i] = (char)(i * 7 + (i >> 9));
+    }
+    memset(dst, 0, maxSize + 64);
+
+    /* check that each kernel copies and zeroes exactly the bytes it's given, at odd lengths and alignments: short
+     * lengths, and lengths either side of the switch to non-temporal stores, whose aligned loop has a head and a tail
+     */
+    static const size_t ntDelta[] = { 0, 1, 7, 63, 64, 65, 4095 };
+    const int best = cKernelBest();
+    int k;
+    for( k = 0; k <= best; k++ ) {
+        cKernelSelect(k);
+        size_t n, dOff, sOff, d;
+        for( n = 0; n < 600; n += 7 ) {
+            for( dOff = 0; dOff < 3; dOff++ ) {
+                if( !check(k, dst, src, n, dOff, 1) ) return 1;
+            }
+        }
+        for( d = 0; d < sizeof(ntDelta) / sizeof(ntDelta[0]); d++ ) {
+            for( dOff = 0; dOff < 64; dOff += 13 ) {
+                for( sOff = 0; sOff < 64; sOff += 21 ) {
+                    if( !check(k, dst, src, CKERNEL_NT_THRESHOLD + ntDelta[d], dOff, sOff) ) return 1;
+                    if( ntDelta[d] && !check(k, dst, src, CKERNEL_NT_THRESHOLD - ntDelta[d], dOff, sOff) ) return 1;
+                }
+            }
+        }
+    }
+
+    if( csv ) {
+        printf("op,kernel,size,gbps\n");
+    } else {
+        printf("best kernel set: %s; non-temporal stores from %d bytes\n", cKernelName(best), CKERNEL_NT_THRESHOLD);
+    }
+
+    int zero;
+    for( zero = 0; zero <= 1; zero++ ) {
+        if( !csv ) {
+            printf("\n%-6s %10s", zero ? "zero" : "copy", "size");
+            for( k = 0; k < NKERNELS; k++ ) {
+                if( k <= best || k == CKERNEL_COUNT ) printf(" %9s", kernel_name(k));
+            }
+            printf("   (GB/s)\n");
+        }
+
+        size_t j;
+        for( j = 0; j < NSIZES; j++ ) {
+            if( !csv ) printf("%-6s %10zu", "", sizes[j]);
+            for( k = 0; k < NKERNELS; k++ ) {
+                if( k > best && k != CKERNEL_COUNT ) continue;
+                if( k < CKERNEL_COUNT ) cKernelSelect(k);
+
+                measure(k, zero, dst, src, sizes[j], total / 16); /* warm up */
+                const double gbps = measure(k, zero, dst, src, sizes[j], total);
+                if( csv ) {
+                    printf("%s,%s,%zu,%.2f\n", zero ? "zero" : "copy", kernel_name(k), sizes[j], gbps);
+                } else {
+                    printf(" %9.2f", gbps);
+                }
+            }
+            if( !csv ) printf("\n");
+        }
+    }
+
+    free(src);
+    free(dst);
+    return 0;
+}